@@ -0,0 +1,471 @@
+#ifndef AIO_C
+#define AIO_C
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "timestamp.c"
+
+/* ----------Asynchronous output --------------*/
+// Worker threads hand their output (ledger lines, status frames) to a stream
+// and carry on; the write happens in the background. aio_write() copies the
+// data onto the stream's queue and does not wait for the disk or terminal
+// unless the stream falls more than AIO_QUEUE_BYTES behind. Then an
+// AIO_DROP stream (the display) drops new writes and counts them, and an
+// AIO_BLOCK stream (the ledger, whose every line is a bill) holds the writer
+// up until there is room.
+//
+// Writes to a stream land in the order they were queued. Everything queued
+// on a stream is written as one writev: through io_uring when the kernel
+// allows it, otherwise (or with PARK_AIO=threads) by a writer thread per stream.
+//
+// A file offset handed out by aio_write() is kept: if writing a file fails,
+// the unwritten part is tried again every AIO_RETRY_NS, and anything queued
+// behind it waits (see above once the queue is full). A terminal or pipe
+// has no offsets, so what failed to reach it is given up on instead.
+
+#define AIO_MAX_STREAMS 8
+#define AIO_MAX_IOV 64
+#define AIO_QUEUE_BYTES (1 << 20)
+#define AIO_RING_ENTRIES 16
+#define AIO_RETRY_NS (100 * 1000000ULL)
+
+// what aio_write() does when a stream's queue is full
+#define AIO_DROP 0
+#define AIO_BLOCK 1
+
+typedef struct aio_req aio_req_t;
+struct aio_req {
+    aio_req_t *next;
+    uint64_t ts;  // when it was queued
+    size_t len;
+    char data[];
+};
+
+typedef struct aio_stream {
+    const char *name;
+    int fd;
+    int64_t offset;  // where the next queued byte lands, -1 for a terminal or pipe
+    int full;        // AIO_DROP or AIO_BLOCK
+    pthread_cond_t c;  // the stream's writer thread waits here
+    pthread_cond_t room;  // aio_write() and aio_drain() wait here for writes to finish
+    aio_req_t *head;   // queued, not yet being written
+    aio_req_t *tail;
+    size_t queued_bytes;
+    // the batch being written
+    aio_req_t *flight;
+    struct iovec iov[AIO_MAX_IOV];
+    int iovcnt;
+    int64_t flight_off;
+    bool submitted;  // the flight is with io_uring
+    uint64_t retry_at;  // ts_now() to try a failed flight again, 0 if it has not failed
+    // stats
+    unsigned depth;  // requests queued or being written
+    unsigned max_depth;
+    unsigned long writes;
+    unsigned long dropped;
+    unsigned long completed;
+    uint64_t lat_sum_ns;  // queued to written
+    uint64_t lat_max_ns;
+    unsigned long failed;  // writes that failed, each tried again for a file
+    int error;  // last errno from a failed write
+} aio_stream_t;
+
+typedef struct aio_uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} aio_uring_t;
+
+struct aio {
+    pthread_mutex_t m;  // guards every stream's queue and stats
+    pthread_cond_t c;   // the uring thread waits here
+    bool uring;
+    aio_uring_t ring;
+    aio_stream_t *streams[AIO_MAX_STREAMS];
+    int num_streams;
+    unsigned queued;  // requests queued on all streams, not yet taken
+} aio = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+static int aio_uring_setup(aio_uring_t *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, AIO_RING_ENTRIES, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+    }
+    char *sq = mmap(0, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(0, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// move up to AIO_MAX_IOV queued requests of a stream into its flight, aio.m held
+static void aio_take_batch(aio_stream_t *s) {
+    s->flight = s->head;
+    s->iovcnt = 0;
+    s->flight_off = s->offset < 0 ? -1 : s->offset - (int64_t)s->queued_bytes;
+    aio_req_t *last = NULL;
+    for (aio_req_t *r = s->head; r != NULL && s->iovcnt < AIO_MAX_IOV; r = r->next) {
+        s->iov[s->iovcnt].iov_base = r->data;
+        s->iov[s->iovcnt].iov_len = r->len;
+        s->iovcnt++;
+        s->queued_bytes -= r->len;
+        aio.queued--;
+        last = r;
+    }
+    s->head = last->next;
+    if (s->head == NULL) {
+        s->tail = NULL;
+    }
+    last->next = NULL;
+    pthread_cond_broadcast(&s->room);
+}
+
+// account for n bytes of the flight written; true once all of it is, aio.m held
+static bool aio_written(aio_stream_t *s, size_t n) {
+    if (s->flight_off >= 0) {
+        s->flight_off += n;
+    }
+    while (s->iovcnt > 0 && n >= s->iov[0].iov_len) {
+        n -= s->iov[0].iov_len;
+        memmove(s->iov, s->iov + 1, sizeof(struct iovec) * --s->iovcnt);
+    }
+    if (s->iovcnt > 0) {
+        s->iov[0].iov_base = (char *)s->iov[0].iov_base + n;
+        s->iov[0].iov_len -= n;
+        return false;
+    }
+
+    uint64_t now = ts_now();
+    for (aio_req_t *r = s->flight; r != NULL;) {
+        aio_req_t *next = r->next;
+        uint64_t lat = now - r->ts;
+        s->lat_sum_ns += lat;
+        if (lat > s->lat_max_ns) {
+            s->lat_max_ns = lat;
+        }
+        s->completed++;
+        s->depth--;
+        free(r);
+        r = next;
+    }
+    s->flight = NULL;
+    s->retry_at = 0;
+    pthread_cond_broadcast(&s->room);
+    return true;
+}
+
+// whether a failed flight is still waiting to be tried again, aio.m held
+static bool aio_backing_off(aio_stream_t *s, uint64_t now) {
+    return s->flight != NULL && s->retry_at > now;
+}
+
+// anything for the uring thread to submit now, aio.m held
+static bool aio_has_work() {
+    uint64_t now = ts_now();
+    for (int i = 0; i < aio.num_streams; i++) {
+        aio_stream_t *s = aio.streams[i];
+        if (s->flight ? !s->submitted && !aio_backing_off(s, now) : s->head != NULL) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// whether any stream has a failed flight to try again later, aio.m held
+static bool aio_has_retry() {
+    for (int i = 0; i < aio.num_streams; i++) {
+        if (aio.streams[i]->flight != NULL && aio.streams[i]->retry_at != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// A write failed. A file keeps the unwritten part of the flight to try again
+// after AIO_RETRY_NS, so the offsets given out for it stay good; anything
+// else gives up on it. aio.m held
+static void aio_failed(aio_stream_t *s, int error) {
+    s->error = error;
+    s->failed++;
+    if (s->flight_off >= 0) {
+        s->retry_at = ts_now() + AIO_RETRY_NS;
+        return;
+    }
+    size_t left = 0;
+    for (int i = 0; i < s->iovcnt; i++) {
+        left += s->iov[i].iov_len;
+    }
+    aio_written(s, left);
+}
+
+// the io_uring thread: submits a writev per busy stream and reaps completions
+static void *aio_uring_run(void *arg) {
+    aio_uring_t *r = &aio.ring;
+    unsigned inflight = 0;
+
+    pthread_mutex_lock(&aio.m);
+    for (;;) {
+        while (inflight == 0 && !aio_has_work()) {
+            if (aio_has_retry()) {
+                // only failed writes left, wait out the back off
+                pthread_mutex_unlock(&aio.m);
+                usleep(AIO_RETRY_NS / 10000);
+                pthread_mutex_lock(&aio.m);
+            } else {
+                pthread_cond_wait(&aio.c, &aio.m);
+            }
+        }
+
+        unsigned to_submit = 0;
+        uint64_t now = ts_now();
+        for (int i = 0; i < aio.num_streams; i++) {
+            aio_stream_t *s = aio.streams[i];
+            if (s->flight == NULL && s->head != NULL) {
+                aio_take_batch(s);
+            } else if (s->flight == NULL || s->submitted || aio_backing_off(s, now)) {
+                continue;  // idle, already with io_uring, or waiting to try again
+            }
+            unsigned tail = *r->sq_tail;
+            struct io_uring_sqe *sqe = &r->sqes[tail & *r->sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->fd = s->fd;
+            sqe->addr = (uint64_t)(uintptr_t)s->iov;
+            sqe->len = s->iovcnt;
+            sqe->off = s->flight_off;
+            sqe->user_data = i;
+            r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+            __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+            s->submitted = true;
+            to_submit++;
+            inflight++;
+        }
+        pthread_mutex_unlock(&aio.m);
+
+        // submit and wait for at least one write to finish
+        int ret = syscall(__NR_io_uring_enter, r->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+        pthread_mutex_lock(&aio.m);
+        if (ret < 0 && errno != EINTR) {
+            // the ring is unusable, fail what was submitted
+            for (int i = 0; i < aio.num_streams; i++) {
+                if (aio.streams[i]->flight) {
+                    aio.streams[i]->submitted = false;
+                    aio_failed(aio.streams[i], errno);
+                }
+            }
+            inflight = 0;
+            continue;
+        }
+
+        unsigned head = *r->cq_head;
+        while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            aio_stream_t *s = aio.streams[cqe->user_data];
+            s->submitted = false;
+            if (cqe->res < 0) {
+                aio_failed(s, -cqe->res);
+            } else {
+                aio_written(s, cqe->res);  // a short write is resubmitted next time round
+            }
+            inflight--;
+            head++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// the fallback writer thread of one stream
+static void *aio_stream_run(void *arg) {
+    aio_stream_t *s = arg;
+
+    pthread_mutex_lock(&aio.m);
+    for (;;) {
+        while (s->head == NULL) {
+            pthread_cond_wait(&s->c, &aio.m);
+        }
+        aio_take_batch(s);
+        do {
+            int64_t off = s->flight_off;
+            pthread_mutex_unlock(&aio.m);
+            ssize_t n = off < 0 ? writev(s->fd, s->iov, s->iovcnt) : pwritev(s->fd, s->iov, s->iovcnt, off);
+            int error = errno;
+            pthread_mutex_lock(&aio.m);
+            if (n < 0) {
+                if (error == EINTR) {
+                    continue;
+                }
+                aio_failed(s, error);
+                if (s->flight != NULL) {
+                    // kept to try again, once the back off is over
+                    pthread_mutex_unlock(&aio.m);
+                    usleep(AIO_RETRY_NS / 1000);
+                    pthread_mutex_lock(&aio.m);
+                }
+            } else {
+                aio_written(s, n);
+            }
+        } while (s->flight != NULL);
+    }
+    return NULL;
+}
+
+// Pick the backend.
+// pre: ts_init()
+// post: io_uring is used if the kernel allows it and PARK_AIO is not "threads"
+void aio_init() {
+    char *mode = getenv("PARK_AIO");
+    if (mode == NULL || strcmp(mode, "threads") != 0) {
+        aio.uring = aio_uring_setup(&aio.ring) == 0;
+    }
+    if (aio.uring) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, aio_uring_run, NULL);
+    }
+}
+
+// Start a stream writing to fd, e.g. stdout or the ledger.
+// pre: aio_init() AND full is AIO_DROP or AIO_BLOCK
+// post: (return == false AND there are already AIO_MAX_STREAMS streams)
+//       OR (aio_write(s, ...) queues writes to fd)
+bool aio_open(aio_stream_t *s, const char *name, int fd, int full) {
+    memset(s, 0, sizeof(*s));
+    s->name = name;
+    s->fd = fd;
+    s->full = full;
+    // regular files are written at explicit offsets from the current end
+    s->offset = lseek(fd, 0, SEEK_END);
+    pthread_cond_init(&s->c, NULL);
+    pthread_cond_init(&s->room, NULL);
+
+    pthread_mutex_lock(&aio.m);
+    if (aio.num_streams == AIO_MAX_STREAMS) {
+        pthread_mutex_unlock(&aio.m);
+        return false;
+    }
+    aio.streams[aio.num_streams++] = s;
+    pthread_mutex_unlock(&aio.m);
+
+    if (!aio.uring) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, aio_stream_run, s);
+    }
+    return true;
+}
+
+// Queue len bytes of buf to be written to the stream; buf can be reused at once.
+// pre: aio_open(s)
+// post: (return == -1 AND the stream is AIO_DROP and too far behind, or out
+//       of memory, the write is dropped)
+//       OR (the data will be written at file offset return, 0 for a terminal)
+int64_t aio_write(aio_stream_t *s, const char *buf, size_t len) {
+    aio_req_t *r = malloc(sizeof(aio_req_t) + len);
+    if (r == NULL) {
+        return -1;
+    }
+    memcpy(r->data, buf, len);
+    r->len = len;
+    r->next = NULL;
+    r->ts = ts_now();
+
+    pthread_mutex_lock(&aio.m);
+    // an empty queue takes a write of any size, so a blocked writer gets in
+    while (s->full == AIO_BLOCK && s->head != NULL && s->queued_bytes + len > AIO_QUEUE_BYTES) {
+        pthread_cond_wait(&s->room, &aio.m);
+    }
+    if (s->queued_bytes + len > AIO_QUEUE_BYTES) {
+        s->dropped++;
+        pthread_mutex_unlock(&aio.m);
+        free(r);
+        return -1;
+    }
+    if (s->tail) {
+        s->tail->next = r;
+    } else {
+        s->head = r;
+    }
+    s->tail = r;
+    s->queued_bytes += len;
+    s->writes++;
+    if (++s->depth > s->max_depth) {
+        s->max_depth = s->depth;
+    }
+    int64_t at = 0;
+    if (s->offset >= 0) {
+        at = s->offset;
+        s->offset += len;
+    }
+    aio.queued++;
+    pthread_cond_signal(aio.uring ? &aio.c : &s->c);
+    pthread_mutex_unlock(&aio.m);
+    return at;
+}
+
+// Wait for everything queued on the stream to be written, e.g. before exit.
+// pre: aio_open(s)
+// post: (return == false AND a write was still failing after wait_ns)
+//       OR everything aio_write() queued before the call has been written
+bool aio_drain(aio_stream_t *s, uint64_t wait_ns) {
+    uint64_t end = ts_clock(CLOCK_REALTIME) + wait_ns;
+    struct timespec until = {end / 1000000000ULL, end % 1000000000ULL};
+    pthread_mutex_lock(&aio.m);
+    int timed_out = 0;
+    while (s->depth > 0 && timed_out == 0) {
+        timed_out = pthread_cond_timedwait(&s->room, &aio.m, &until);
+    }
+    bool drained = s->depth == 0;
+    pthread_mutex_unlock(&aio.m);
+    return drained;
+}
+
+// one line of stats for a stream: queue depth and completion latency
+int aio_stats(aio_stream_t *s, char *buf, size_t size) {
+    pthread_mutex_lock(&aio.m);
+    int n = snprintf(buf, size, "%s (%s): depth %u (max %u) \t latency avg %lu us max %lu us \t dropped %lu \t failed %lu",
+                     s->name, aio.uring ? "io_uring" : "threads", s->depth, s->max_depth,
+                     s->completed ? (unsigned long)(s->lat_sum_ns / s->completed / 1000) : 0UL,
+                     (unsigned long)(s->lat_max_ns / 1000), s->dropped, s->failed);
+    pthread_mutex_unlock(&aio.m);
+    return n;
+}
+/* ----------Asynchronous output --------------*/
+
+#endif
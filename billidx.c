@@ -0,0 +1,469 @@
+#ifndef BILLIDX_C
+#define BILLIDX_C
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ledger.c"
+
+/* ----------Billing index --------------*/
+// Every visit billed, by plate, next to billing.txt, so a plate's visits are
+// found without reading the ledger. The file has three parts: a header, a
+// table of plates, and the visits in the order they were billed.
+//
+// Each visit records where its line is in the ledger, the fee and the times,
+// and the number of the same plate's visit before it. The plate table, open
+// addressing and probed linearly, holds each plate's latest visit. So a
+// lookup is one probe and then a walk back through that plate's visits only,
+// however long the ledger has grown.
+//
+// Visits are only ever appended. A visit is written before the table or the
+// header points at it, so a reader mapping the file while the manager adds
+// to it sees whole visits. When the table is half full a thread copies the
+// index into a new file with a table twice the size, while visits go on
+// being added to the old one. Once it has caught up, the next add copies the
+// few visits it missed and renames the new file over the old one; readers
+// that had the old one mapped keep it. Only if the old table reaches three
+// quarters full first does an add wait for the copy. If the copy fails, e.g.
+// the disk is full, the next is tried BILLIDX_RETRY adds later.
+//
+// The header says how much of the ledger the index covers. At startup the
+// manager adds any lines written past that, and rebuilds the index from the
+// ledger if the index claims more than the ledger has, e.g. after a crash
+// lost the ledger's last writes. A visit whose line was dropped from the
+// ledger (see aio.c) is kept with no offset, and lost on a rebuild.
+
+#define BILLIDX_FILE "billing.idx"
+#define BILLIDX_MAGIC 0x58444942  // "BIDX"
+#define BILLIDX_VERSION 1
+#define BILLIDX_SLOTS 4096             // plate table size to start with, a power of two
+#define BILLIDX_GROW 16384             // visits added to the file at a time
+#define BILLIDX_MAP_MAX (1ULL << 36)   // address space kept for the file to grow into
+#define BILLIDX_NONE UINT64_MAX        // offset of a visit that is not in the ledger
+#define BILLIDX_TAIL 256               // visits a switch to a bigger table may copy
+#define BILLIDX_RETRY 1024             // adds after a failed grow before the next try
+
+// how far a bigger table has got, see billidx_grow()
+#define BILLIDX_IDLE 0
+#define BILLIDX_COPYING 1
+#define BILLIDX_COPIED 2
+#define BILLIDX_FAILED 3
+
+typedef struct billidx_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t visit_size;
+    uint32_t slots;   // a power of two
+    uint32_t plates;  // slots in use
+    uint64_t visits;
+    uint64_t ledger_end;  // bytes of the ledger the index covers
+    uint64_t slots_off;   // billidx_slot_t[slots]
+    uint64_t visits_off;  // billidx_visit_t[...]
+} billidx_header_t;
+
+typedef struct billidx_slot {
+    uint64_t plate;  // packed, see billidx_key()
+    uint64_t last;   // the plate's latest visit + 1, 0 for an empty slot
+} billidx_slot_t;
+
+typedef struct billidx_visit {
+    uint64_t plate;
+    uint64_t prev;    // the plate's visit before + 1, 0 for its first
+    uint64_t offset;  // of the line in the ledger, or BILLIDX_NONE
+    int64_t entry_ms;
+    int64_t exit_ms;
+    int64_t cents;
+    uint16_t len;  // of the line
+    uint8_t level;
+    uint8_t gate;
+    uint32_t reserved;
+} billidx_visit_t;
+
+typedef struct billidx {
+    int fd;
+    bool writable;
+    char path[256];
+    char *base;
+    billidx_header_t *header;
+    uint64_t capacity;  // visits the file has room for
+    // growing, writable only
+    int growing;             // BILLIDX_IDLE etc.
+    pthread_t grower;
+    struct billidx *bigger;  // the copy with twice the table
+    uint64_t copied;         // visits in bigger so far
+    int copy_error;          // errno of a grower that failed
+    int grow_error;          // errno of the last grow that failed, 0 once one works
+    unsigned grow_wait;      // adds to let by before the next grow
+} billidx_t;
+
+// a plate as a number, for the table
+static inline uint64_t billidx_key(const char plate[6]) {
+    uint64_t key = 0;
+    memcpy(&key, plate, 6);
+    return key;
+}
+
+static inline billidx_slot_t *billidx_slots(const billidx_t *idx) {
+    return (billidx_slot_t *)(idx->base + idx->header->slots_off);
+}
+
+static inline billidx_visit_t *billidx_visit(const billidx_t *idx, uint64_t i) {
+    return (billidx_visit_t *)(idx->base + idx->header->visits_off) + i;
+}
+
+// the slot for a plate, its own or the empty one it would go in
+static billidx_slot_t *billidx_slot(const billidx_t *idx, uint64_t key) {
+    billidx_slot_t *slots = billidx_slots(idx);
+    uint32_t mask = idx->header->slots - 1;
+    for (uint32_t s = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;; s = (s + 1) & mask) {
+        if (__atomic_load_n(&slots[s].last, __ATOMIC_ACQUIRE) == 0 || slots[s].plate == key) {
+            return &slots[s];
+        }
+    }
+}
+
+// Map an index file.
+// pre: true
+// post: (return == NULL AND the file is missing, not an index or cannot be
+//       mapped) OR return is the index
+static billidx_t *billidx_map(const char *path, bool writable) {
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    char *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(billidx_header_t)) {
+        base = mmap(0, BILLIDX_MAP_MAX, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    }
+    billidx_header_t *h = (billidx_header_t *)base;
+    if (base == MAP_FAILED || h->magic != BILLIDX_MAGIC || h->version != BILLIDX_VERSION ||
+        h->visit_size != sizeof(billidx_visit_t)) {
+        fprintf(stderr, "%s: not a billing index\n", path);
+        if (base != MAP_FAILED) {
+            munmap(base, BILLIDX_MAP_MAX);
+        }
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    billidx_t *idx = calloc(1, sizeof(billidx_t));
+    idx->fd = fd;
+    idx->writable = writable;
+    snprintf(idx->path, sizeof(idx->path), "%s", path);
+    idx->base = base;
+    idx->header = h;
+    idx->capacity = (st.st_size - h->visits_off) / sizeof(billidx_visit_t);
+    return idx;
+}
+
+static bool billidx_switch(billidx_t *idx);
+
+void billidx_close(billidx_t *idx) {
+    if (idx->growing != BILLIDX_IDLE) {
+        billidx_switch(idx);
+    }
+    munmap(idx->base, BILLIDX_MAP_MAX);
+    close(idx->fd);
+    free(idx);
+}
+
+// Make an empty index with a table of slots plates.
+// pre: slots is a power of two
+// post: (return == false AND errno says why the file could not be written)
+//       OR it is at path
+static bool billidx_create(const char *path, uint32_t slots) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    billidx_header_t h = {BILLIDX_MAGIC, BILLIDX_VERSION, sizeof(billidx_visit_t), slots};
+    h.slots_off = 4096;
+    h.visits_off = (h.slots_off + (uint64_t)slots * sizeof(billidx_slot_t) + 4095) & ~4095ULL;
+    // the rest of the file starts as zeros, so every slot is empty
+    bool ok = ftruncate(fd, h.visits_off + BILLIDX_GROW * sizeof(billidx_visit_t)) == 0 &&
+              pwrite(fd, &h, sizeof(h), 0) == sizeof(h);
+    int error = errno;
+    close(fd);
+    errno = error;
+    return ok;
+}
+
+// Put a visit in, without growing the table.
+// pre: idx is writable AND the table has an empty slot
+// post: (return == false AND the file could not grow) OR the visit is the
+//       plate's latest
+static bool billidx_put(billidx_t *idx, const ledger_rec_t *r, uint64_t offset, uint16_t len) {
+    billidx_header_t *h = idx->header;
+    uint64_t i = h->visits;
+    if (i == idx->capacity) {
+        uint64_t more = idx->capacity + BILLIDX_GROW;
+        if (h->visits_off + more * sizeof(billidx_visit_t) > BILLIDX_MAP_MAX ||
+            ftruncate(idx->fd, h->visits_off + more * sizeof(billidx_visit_t)) != 0) {
+            return false;
+        }
+        idx->capacity = more;
+    }
+
+    uint64_t key = billidx_key(r->plate);
+    billidx_slot_t *slot = billidx_slot(idx, key);
+    billidx_visit_t *v = billidx_visit(idx, i);
+    *v = (billidx_visit_t){key, slot->last, offset, r->entry_ms, r->exit_ms, r->cents, len, r->level, r->gate};
+
+    // the visit is complete before anything points at it
+    __atomic_store_n(&h->visits, i + 1, __ATOMIC_RELEASE);
+    if (slot->last == 0) {
+        slot->plate = key;
+        h->plates++;
+    }
+    __atomic_store_n(&slot->last, i + 1, __ATOMIC_RELEASE);
+    if (offset != BILLIDX_NONE && offset + len > h->ledger_end) {
+        h->ledger_end = offset + len;
+    }
+    return true;
+}
+
+// put idx's visits from idx->copied up to visits into idx->bigger, in the
+// same order, so each one's prev is rebuilt
+static bool billidx_copy(billidx_t *idx, uint64_t visits) {
+    for (; idx->copied < visits; idx->copied++) {
+        const billidx_visit_t *v = billidx_visit(idx, idx->copied);
+        ledger_rec_t r = {.cents = v->cents, .entry_ms = v->entry_ms, .exit_ms = v->exit_ms, .level = v->level, .gate = v->gate};
+        memcpy(r.plate, &v->plate, 6);
+        if (!billidx_put(idx->bigger, &r, v->offset, v->len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The grower: copy the index into path.new with twice the table, until no
+// more than BILLIDX_TAIL visits are left for billidx_switch(). Runs beside
+// billidx_add(), which only appends to idx, so the visits it reads do not
+// change.
+static void *billidx_grow(void *arg) {
+    billidx_t *idx = arg;
+    char tmp[sizeof(idx->path) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.new", idx->path);
+    int done = BILLIDX_FAILED;
+    if (billidx_create(tmp, idx->header->slots * 2) && (idx->bigger = billidx_map(tmp, true)) != NULL) {
+        // write it back here, or renaming it over the old file has ext4 do it
+        // in billidx_switch(); go round until the visits added meanwhile are
+        // few enough to leave to that
+        bool ok;
+        do {
+            ok = billidx_copy(idx, __atomic_load_n(&idx->header->visits, __ATOMIC_ACQUIRE)) &&
+                 fdatasync(idx->bigger->fd) == 0;
+        } while (ok && __atomic_load_n(&idx->header->visits, __ATOMIC_ACQUIRE) - idx->copied > BILLIDX_TAIL);
+        done = ok ? BILLIDX_COPIED : BILLIDX_FAILED;
+    }
+    if (done == BILLIDX_FAILED) {
+        idx->copy_error = errno != 0 ? errno : EIO;
+    }
+    __atomic_store_n(&idx->growing, done, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// a grow did not work: say so the first time, and wait a while to try again
+static void billidx_grow_failed(billidx_t *idx, int error) {
+    if (idx->grow_error == 0 || error != idx->grow_error) {
+        fprintf(stderr, "%s: could not grow the plate table (%s), trying again after %d more visits\n", idx->path,
+                strerror(error), BILLIDX_RETRY);
+    }
+    idx->grow_error = error;
+    idx->grow_wait = BILLIDX_RETRY;
+}
+
+static void *billidx_closer(void *arg) {
+    billidx_close(arg);
+    return NULL;
+}
+
+// Wait for the grower, copy what it missed and switch to the bigger index.
+// pre: idx->growing != BILLIDX_IDLE AND the caller is the only one adding
+// post: idx->growing == BILLIDX_IDLE AND (return == false AND idx is as it
+//       was) OR idx has twice the table
+static bool billidx_switch(billidx_t *idx) {
+    char tmp[sizeof(idx->path) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.new", idx->path);
+    pthread_join(idx->grower, NULL);
+    billidx_t *bigger = idx->bigger;
+    // the grower's errno, unless it was this thread that failed
+    int error = idx->copy_error;
+    bool ok = idx->growing == BILLIDX_COPIED && billidx_copy(idx, idx->header->visits);
+    idx->growing = BILLIDX_IDLE;
+    idx->bigger = NULL;
+    idx->copied = 0;
+    if (ok) {
+        bigger->header->ledger_end = idx->header->ledger_end;
+        ok = rename(tmp, idx->path) == 0;
+    }
+    if (!ok) {
+        if (bigger != NULL) {
+            error = errno;
+            billidx_close(bigger);
+        }
+        unlink(tmp);
+        billidx_grow_failed(idx, error);
+        return false;
+    }
+    idx->grow_error = 0;
+    // swap, and let go of the old file on a thread of its own: dropping the
+    // last reference to it takes as long as it is big
+    billidx_t old = *bigger;
+    *bigger = *idx;
+    idx->fd = old.fd;
+    idx->base = old.base;
+    idx->header = old.header;
+    idx->capacity = old.capacity;
+    pthread_t closer;
+    if (pthread_create(&closer, NULL, billidx_closer, bigger) == 0) {
+        pthread_detach(closer);
+    } else {
+        billidx_close(bigger);
+    }
+    return true;
+}
+
+// Add a visit.
+// pre: idx is writable AND the caller is the only one adding
+// post: (return == false AND the file could not grow) OR the visit is the
+//       plate's latest
+bool billidx_add(billidx_t *idx, const ledger_rec_t *r, uint64_t offset, uint16_t len) {
+    uint64_t want = idx->header->plates + 1;
+    bool full = want * 4 > (uint64_t)idx->header->slots * 3;
+    int growing = __atomic_load_n(&idx->growing, __ATOMIC_ACQUIRE);
+    if (idx->grow_wait > 0) {
+        idx->grow_wait--;
+    } else if (growing == BILLIDX_IDLE && want * 2 > idx->header->slots) {
+        idx->growing = BILLIDX_COPYING;
+        int error = pthread_create(&idx->grower, NULL, billidx_grow, idx);
+        if (error != 0) {
+            idx->growing = BILLIDX_IDLE;
+            billidx_grow_failed(idx, error);
+        }
+    } else if (growing != BILLIDX_IDLE && growing != BILLIDX_COPYING) {
+        billidx_switch(idx);
+    }
+    // out of room: wait for the copy rather than fill the table, and keep
+    // an empty slot for billidx_slot() to stop at
+    if (full && idx->growing != BILLIDX_IDLE) {
+        billidx_switch(idx);
+    }
+    if (want >= idx->header->slots) {
+        return false;
+    }
+    return billidx_put(idx, r, offset, len);
+}
+
+// Add the ledger's lines past what the index covers.
+// pre: idx is writable AND no one is writing to the ledger
+// post: (return == false AND the index covers more than the ledger has, it
+//       needs rebuilding, or it could not grow)
+//       OR every complete line of the ledger is covered
+bool billidx_catch_up(billidx_t *idx, int ledger_fd) {
+    struct stat st;
+    if (fstat(ledger_fd, &st) != 0 || idx->header->ledger_end > (uint64_t)st.st_size) {
+        return false;
+    }
+    uint64_t from = idx->header->ledger_end;
+    if (from == (uint64_t)st.st_size) {
+        return true;
+    }
+    // map from the page the uncovered part starts in
+    uint64_t page = from & ~4095ULL;
+    size_t len = st.st_size - page;
+    char *map = mmap(0, len, PROT_READ, MAP_PRIVATE, ledger_fd, page);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    madvise(map, len, MADV_SEQUENTIAL);
+    const char *end = map + len;
+    const char *p = map + (from - page);
+    const char *next;
+    bool added = true;
+    ledger_rec_t r;
+    bool ok;
+    while (added && p < end && (next = ledger_parse(p, end, &r, &ok)) != NULL) {
+        uint64_t off = page + (p - map);
+        if (ok) {
+            added = billidx_add(idx, &r, off, next - p);
+        }
+        // a line that is not a bill is covered all the same
+        if (added && page + (next - map) > idx->header->ledger_end) {
+            idx->header->ledger_end = page + (next - map);
+        }
+        p = next;
+    }
+    munmap(map, len);
+    return added;
+}
+
+// Open the index for writing, making it or bringing it up to date with the
+// ledger, or building it again from the ledger if it does not match.
+// pre: no one is writing to the ledger
+// post: (return == NULL AND the index could not be written) OR return is
+//       the index, covering every complete line of the ledger
+billidx_t *billidx_open(const char *path, int ledger_fd) {
+    billidx_t *idx = billidx_map(path, true);
+    if (idx != NULL && billidx_catch_up(idx, ledger_fd)) {
+        return idx;
+    }
+    if (idx != NULL) {
+        billidx_close(idx);
+        fprintf(stderr, "%s: does not match the ledger, building it again\n", path);
+    } else if (errno != ENOENT && errno != EINVAL) {
+        perror(path);
+        return NULL;
+    }
+    if (!billidx_create(path, BILLIDX_SLOTS)) {
+        perror(path);
+        return NULL;
+    }
+    if ((idx = billidx_map(path, true)) == NULL) {
+        return NULL;
+    }
+    if (!billidx_catch_up(idx, ledger_fd)) {
+        fprintf(stderr, "%s: could not index the ledger\n", path);
+        billidx_close(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+// Open the index to read.
+// pre: true
+// post: (return == NULL AND there is no index at path) OR return is the index
+billidx_t *billidx_read(const char *path) {
+    billidx_t *idx = billidx_map(path, false);
+    if (idx == NULL && errno != EINVAL) {
+        perror(path);
+    }
+    return idx;
+}
+
+// A plate's latest visit.
+// pre: plate is 6 characters
+// post: (return == NULL AND the plate has never been billed)
+//       OR return is its latest visit, return->prev leads to the one before
+static inline const billidx_visit_t *billidx_find(const billidx_t *idx, const char plate[6]) {
+    uint64_t last = __atomic_load_n(&billidx_slot(idx, billidx_key(plate))->last, __ATOMIC_ACQUIRE);
+    return last == 0 ? NULL : billidx_visit(idx, last - 1);
+}
+
+// the visit before v for the same plate, NULL for its first
+static inline const billidx_visit_t *billidx_prev(const billidx_t *idx, const billidx_visit_t *v) {
+    return v->prev == 0 ? NULL : billidx_visit(idx, v->prev - 1);
+}
+/* ----------Billing index --------------*/
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef BOOMGATE_C
+#define BOOMGATE_C
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "header.h"
+
+/* ----------Boom gates --------------*/
+// One state machine for every gate, used by all three processes:
+//
+//     C --manager raises--> R --gate, BG_TRAVEL_MS later--> O
+//     O --manager lowers--> L --gate, BG_TRAVEL_MS later--> C
+//
+// and in an emergency the fire alarm takes a closed or lowering gate
+// straight to R, after which it only ever goes up.
+//
+// Every change is made with the gate's mutex held and broadcast on its
+// condvar, and every wait is for a state rather than for a signal, so a
+// change can never be missed and nobody has to hand the gate back and forth.
+// A full cycle is four changes, two made by the gate itself.
+//
+// A state alone does not say whose the open gate is: it may still be up for
+// the car before, or go up and down before a waiting car looks. So the gate
+// also counts the times it was let up for someone, and a car waits for the
+// count to pass what it was before the car asked, with the gate open.
+
+#define BG_TRAVEL_MS 10  // time a gate takes to go up or down
+
+// Set up a gate in the shared segment, closed.
+// pre: the attributes are process shared
+// post: the gate is 'C'
+void bg_init(boomgate_t *bg, pthread_mutexattr_t *m_shared, pthread_condattr_t *c_shared) {
+    pthread_mutex_init(&bg->m, m_shared);
+    pthread_cond_init(&bg->c, c_shared);
+    bg->s = 'C';
+    bg->opens = 0;
+}
+
+// Change the gate from one state to another.
+// pre: true
+// post: (return == true AND the gate was in from, is now in to, and every
+//        waiter has been woken) OR (return == false AND the gate is unchanged)
+bool bg_set(boomgate_t *bg, char from, char to) {
+    bool changed = false;
+    pthread_mutex_lock(&bg->m);
+    if (bg->s == from) {
+        bg->s = to;
+        changed = true;
+        pthread_cond_broadcast(&bg->c);
+    }
+    pthread_mutex_unlock(&bg->m);
+    return changed;
+}
+
+// Wait until the gate is in one of states, e.g. "RL".
+// pre: true
+// post: return is the state the gate was in when the wait ended
+char bg_wait(boomgate_t *bg, const char *states) {
+    pthread_mutex_lock(&bg->m);
+    while (bg->s == '\0' || strchr(states, bg->s) == NULL) {
+        pthread_cond_wait(&bg->c, &bg->m);
+    }
+    char s = bg->s;
+    pthread_mutex_unlock(&bg->m);
+    return s;
+}
+
+// how many times the gate has been let up, to pass to bg_wait_open()
+uint32_t bg_opens(boomgate_t *bg) {
+    pthread_mutex_lock(&bg->m);
+    uint32_t opens = bg->opens;
+    pthread_mutex_unlock(&bg->m);
+    return opens;
+}
+
+// Count the gate as let up for a car.
+// pre: the gate is going up (R) or is open (O) for the car
+// post: bg_wait_open(bg, n) returns for any n taken before, once it is open
+void bg_let_through(boomgate_t *bg) {
+    pthread_mutex_lock(&bg->m);
+    bg->opens++;
+    pthread_cond_broadcast(&bg->c);
+    pthread_mutex_unlock(&bg->m);
+}
+
+// Wait for the gate to be open for a car that asked when bg_opens() was since.
+// pre: since was taken before the car asked for the gate
+// post: the gate has been let up since then, and was open when the wait ended
+void bg_wait_open(boomgate_t *bg, uint32_t since) {
+    pthread_mutex_lock(&bg->m);
+    while (bg->opens == since || bg->s != 'O') {
+        pthread_cond_wait(&bg->c, &bg->m);
+    }
+    pthread_mutex_unlock(&bg->m);
+}
+
+// Open a gate in an emergency, as one change, and let everyone through.
+// pre: true
+// post: the gate is going up (R) or is open (O)
+void bg_emergency_open(boomgate_t *bg) {
+    pthread_mutex_lock(&bg->m);
+    if (bg->s != 'R' && bg->s != 'O') {
+        bg->s = 'R';
+    }
+    bg->opens++;
+    pthread_cond_broadcast(&bg->c);
+    pthread_mutex_unlock(&bg->m);
+}
+
+// the gate itself: finish each raise and lower after BG_TRAVEL_MS
+void *bg_run(void *arg) {
+    boomgate_t *bg = arg;
+    for (;;) {
+        char s = bg_wait(bg, "RL");
+        usleep(BG_TRAVEL_MS * 1000);
+        bg_set(bg, s, s == 'R' ? 'O' : 'C');
+    }
+    return NULL;
+}
+
+// keep a gate open for the rest of an emergency, reopening it if it is lowered
+void *bg_hold_open(void *arg) {
+    boomgate_t *bg = arg;
+    for (;;) {
+        bg_wait(bg, "CL");
+        bg_emergency_open(bg);
+    }
+    return NULL;
+}
+/* ----------Boom gates --------------*/
+
+#endif
@@ -1,12 +1,22 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "rings.c"
+#include "boomgate.c"
+#include "placement.c"
+
 int16_t shm_fd;
 void *shm;
 
@@ -14,19 +24,14 @@ int16_t alarm_active = 0;
 pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t alarm_condvar = PTHREAD_COND_INITIALIZER;
 
-#define LEVELS 5
-#define ENTRANCES 5
-#define EXITS 5
-
 #define MEDIAN_WINDOW 5
 #define TEMPCHANGE_WINDOW 30
+#define TEMP_BATCH 32 // samples taken from a sensor's ring at a time
 int lv_id[LEVELS];
-struct boomgate
-{
-    pthread_mutex_t m;
-    pthread_cond_t c;
-    char s;
-};
+
+// temperature sensors' samples, see rings.c
+rings_t *rings;
+
 struct parkingsign
 {
     pthread_mutex_t m;
@@ -34,180 +39,444 @@ struct parkingsign
     char display;
 };
 
-struct tempnode
+// smoothing and rate-of-rise state of a level, fed every sample in order
+struct tempstate
 {
-    unsigned short temperature;
-    struct tempnode *next;
+    unsigned short raw[MEDIAN_WINDOW];        // the last raw samples
+    unsigned short median[TEMPCHANGE_WINDOW]; // the last smoothed temperatures
+    unsigned long samples;
+    unsigned long medians;
+    unsigned long lost;     // samples overwritten before they were read
+    uint64_t max_lag_ns;    // longest a sample waited to be checked
+    uint64_t detect_lag_ns; // from the sample that raised the alarm to raising it
 };
+struct tempstate tempstates[LEVELS];
 
-struct tempnode *deletenodes(struct tempnode *templist, int after)
+// Feed a level's next sample through the median filter and the checks.
+// pre: samples are fed in the order they were taken
+// post: return == true if the sample shows a fire
+bool tempsample(struct tempstate *st, unsigned short temp)
 {
-    if (templist->next)
+    // Temperatures are only counted once we have 5 samples
+    st->raw[st->samples++ % MEDIAN_WINDOW] = temp;
+    if (st->samples < MEDIAN_WINDOW)
     {
-        templist->next = deletenodes(templist->next, after - 1);
+        return false;
     }
-    if (after <= 0)
+    // insertion sort, cheaper than qsort for a window this small
+    int sorttemp[MEDIAN_WINDOW];
+    for (int i = 0; i < MEDIAN_WINDOW; i++)
     {
-        free(templist);
-        return NULL;
+        int j = i;
+        for (; j > 0 && sorttemp[j - 1] > st->raw[i]; j--)
+        {
+            sorttemp[j] = sorttemp[j - 1];
+        }
+        sorttemp[j] = st->raw[i];
     }
-    return templist;
-}
-int compare(const void *first, const void *second)
-{
-    return *((const int *)first) - *((const int *)second);
+    st->median[st->medians++ % TEMPCHANGE_WINDOW] = sorttemp[(MEDIAN_WINDOW - 1) / 2];
+    if (st->medians < TEMPCHANGE_WINDOW)
+    {
+        return false;
+    }
+
+    // Temperatures of 58 degrees and higher are a concern
+    int hightemps = 0;
+    for (int i = 0; i < TEMPCHANGE_WINDOW; i++)
+    {
+        if (st->median[i] >= 58)
+        {
+            hightemps++;
+        }
+    }
+    // the oldest of the last 30 is the one the next median overwrites
+    unsigned short oldesttemp = st->median[st->medians % TEMPCHANGE_WINDOW];
+
+    // If 90% of the last 30 temperatures are >= 58 degrees,
+    // this is considered a high temperature.
+    if (hightemps >= TEMPCHANGE_WINDOW * 0.9)
+    {
+        return true;
+    }
+    // If the newest temp is >= 8 degrees higher than the oldest
+    // temp (out of the last 30), this is a high rate-of-rise.
+    return temp - oldesttemp >= 8 && oldesttemp != 0;
 }
 
 void *tempmonitor(void *arg)
 {
     int level = (*(int *)arg);
-    struct tempnode *templist = malloc(sizeof(struct tempnode));
-    struct tempnode *newtemp;
-    struct tempnode *medianlist = malloc(sizeof(struct tempnode));
-    struct tempnode *oldesttemp;
-    int32_t count;
-    int16_t addr;
-    unsigned short temp;
-    int16_t mediantemp;
-    int16_t hightemps;
-    char *sign;
-
+    struct tempstate *st = &tempstates[level];
+    temp_ring_t *ring = &rings->temp[level];
+    temp_sample_t batch[TEMP_BATCH];
+    // Calculate address of the level's alarm
+    char *sign = shm + 2498 + 104 * level;
+
+    // every sample from now on is checked, in order, at whatever rate the sensor runs
+    uint64_t next = temp_ring_head(ring);
     for (;;)
     {
-        // Calculate address of temperature sensor
-        addr = 2496 + 104 * level;
-        temp = *((int *)(shm + addr));
-
-        // Add temperature to beginning of linked list
-        newtemp = malloc(sizeof(struct tempnode));
-        newtemp->temperature = temp;
-        newtemp->next = templist;
-        templist = newtemp;
-
-        // Delete nodes after 5th
-        deletenodes(templist, MEDIAN_WINDOW);
-
-        // Count nodes
-        count = 0;
-        for (struct tempnode *t = templist; t != NULL; t = t->next)
+        temp_ring_wait(ring, next);
+        size_t n = temp_ring_read(ring, &next, batch, TEMP_BATCH, &st->lost);
+        for (size_t k = 0; k < n; k++)
         {
-            count++;
+            uint64_t lag = ts_now() - batch[k].ts;
+            if (lag > st->max_lag_ns)
+            {
+                st->max_lag_ns = lag;
+            }
+            if (tempsample(st, batch[k].temp) && *sign == 0)
+            {
+                // Raise the alarm
+                alarm_active = 1;
+                *sign = 1;
+                st->detect_lag_ns = ts_now() - batch[k].ts;
+                fprintf(stderr, "level %d: fire detected %.3f ms after sample %lu was taken\n",
+                        level + 1, st->detect_lag_ns / 1e6, (unsigned long)batch[k].seq);
+            }
         }
+    }
+}
 
-        if (count == MEDIAN_WINDOW)
-        { // Temperatures are only counted once we have 5 samples
-            int *sorttemp = malloc(sizeof(int) * MEDIAN_WINDOW);
-            count = 0;
-            for (struct tempnode *t = templist; t != NULL; t = t->next)
+// how the sensors were followed, printed on the way out
+void tempreport(FILE *out)
+{
+    for (int i = 0; i < LEVELS; i++)
+    {
+        struct tempstate *st = &tempstates[i];
+        fprintf(out, "level %d: %lu samples \t missed %lu \t max lag %.3f ms", i + 1, st->samples, st->lost, st->max_lag_ns / 1e6);
+        if (st->detect_lag_ns)
+        {
+            fprintf(out, " \t detected in %.3f ms", st->detect_lag_ns / 1e6);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+/* ----------Event loop --------------*/
+// With -e one thread does the work of all the others: a timerfd wakes it
+// every FIRE_TICK_NS and each tick it sweeps every sensor's ring, feeding the
+// new samples through the same checks as tempmonitor. Once the alarm is
+// raised the same tick also opens the boom gates again if anything lowered
+// them (see boomgate.c) and steps the evacuation signs, which are a state
+// machine here rather than a thread that sleeps, so nothing in the loop ever
+// waits for long.
+//
+// With -b N it follows N synthetic sensors, grouped into sites of LEVELS
+// sensors, fed by another thread, and reports how much of a core the loop
+// needed to keep up with them.
+
+#define FIRE_TICK_NS (1000 * 1000ULL)
+#define EVAC_STEP_NS (20 * 1000 * 1000ULL)         // each letter of the evacuation message is shown for 20ms
+#define BENCH_PERIOD_NS (2 * 1000 * 1000ULL)       // a synthetic sensor takes a sample every 2ms
+#define BENCH_TIME_NS (10 * 1000 * 1000 * 1000ULL) // how long the bench runs
+
+struct sensor
+{
+    temp_ring_t *ring;
+    uint64_t next; // sequence number of the next sample to read
+    struct tempstate *st;
+    char *alarm; // the level's alarm flag
+};
+
+struct fireloop
+{
+    struct sensor *sensors;
+    int nsensors;
+    bool carpark; // drive the car park's gates and signs
+    int epfd;
+    int tfd;
+    // evacuation signs
+    const char *evacpos;
+    uint64_t evacnext;
+    // how the loop kept up
+    unsigned long ticks;
+    unsigned long samples;
+    uint64_t max_sweep_ns;
+};
+
+// read everything new from a sensor, returns true if it shows a fire
+bool sensor_sweep(struct sensor *s, struct fireloop *loop)
+{
+    temp_sample_t batch[TEMP_BATCH];
+    bool fire = false;
+    size_t n;
+    while ((n = temp_ring_read(s->ring, &s->next, batch, TEMP_BATCH, &s->st->lost)) > 0)
+    {
+        uint64_t now = ts_now();
+        for (size_t k = 0; k < n; k++)
+        {
+            if (now - batch[k].ts > s->st->max_lag_ns)
             {
-                sorttemp[count++] = t->temperature;
+                s->st->max_lag_ns = now - batch[k].ts;
             }
-            qsort(sorttemp, MEDIAN_WINDOW, sizeof(int), compare);
-            mediantemp = sorttemp[(MEDIAN_WINDOW - 1) / 2];
+            if (tempsample(s->st, batch[k].temp) && *s->alarm == 0)
+            {
+                *s->alarm = 1;
+                s->st->detect_lag_ns = now - batch[k].ts;
+                fire = true;
+            }
+        }
+        loop->samples += n;
+    }
+    return fire;
+}
+
+// show the next letter of the evacuation message when it is due
+void evac_step(struct fireloop *loop, uint64_t now)
+{
+    static const char *evacmessage = "EVACUATE ";
+    if (now < loop->evacnext)
+    {
+        return;
+    }
+    if (loop->evacpos == NULL || *loop->evacpos == '\0')
+    {
+        loop->evacpos = evacmessage;
+    }
+    for (int i = 0; i < ENTRANCES; i++)
+    {
+        struct parkingsign *sign = shm + 288 * i + 192;
+        pthread_mutex_lock(&sign->m);
+        sign->display = *loop->evacpos;
+        pthread_cond_broadcast(&sign->c);
+        pthread_mutex_unlock(&sign->m);
+    }
+    loop->evacpos++;
+    loop->evacnext = now + EVAC_STEP_NS;
+}
+
+// set up the timer and epoll set
+// post: (return == false AND the timer could not be made) OR the loop is ticking
+bool fireloop_init(struct fireloop *loop)
+{
+    struct itimerspec tick = {{0, FIRE_TICK_NS}, {0, FIRE_TICK_NS}};
+    struct epoll_event ev = {EPOLLIN, {0}};
 
-            // Add median temp to linked list
-            newtemp = malloc(sizeof(struct tempnode));
-            newtemp->temperature = mediantemp;
-            newtemp->next = medianlist;
-            medianlist = newtemp;
+    loop->epfd = epoll_create1(0);
+    loop->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (loop->epfd < 0 || loop->tfd < 0 || timerfd_settime(loop->tfd, 0, &tick, NULL) != 0 ||
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->tfd, &ev) != 0)
+    {
+        perror("firealarm: timer");
+        return false;
+    }
+    for (int i = 0; i < loop->nsensors; i++)
+    {
+        loop->sensors[i].next = temp_ring_head(loop->sensors[i].ring);
+    }
+    return true;
+}
 
-            // Delete nodes after 30th
-            deletenodes(medianlist, TEMPCHANGE_WINDOW);
+// Run the loop until the simulation stops (or until, if not 0).
+// pre: fireloop_init(loop)
+// post: every sample published while it ran has been checked or counted as lost
+void fireloop_run(struct fireloop *loop, uint64_t until)
+{
+    struct epoll_event ev;
+    uint64_t expirations;
 
-            // Count nodes
-            count = 0;
-            hightemps = 0;
+    for (;;)
+    {
+        if (epoll_wait(loop->epfd, &ev, 1, -1) < 1)
+        {
+            continue;
+        }
+        read(loop->tfd, &expirations, sizeof(expirations));
+        uint64_t start = ts_now();
+        if ((until && start >= until) || (loop->carpark && *(char *)(shm + 2919) == 1))
+        {
+            return;
+        }
+        loop->ticks++;
 
-            for (struct tempnode *t = medianlist; t != NULL; t = t->next)
+        for (int i = 0; i < loop->nsensors; i++)
+        {
+            if (sensor_sweep(&loop->sensors[i], loop) && loop->carpark)
             {
-                // Temperatures of 58 degrees and higher are a concern
-                if (t->temperature >= 58)
+                if (!alarm_active)
                 {
-                    hightemps++;
+                    fprintf(stderr, "level %d: fire detected %.3f ms after the sample was taken\n",
+                            i + 1, loop->sensors[i].st->detect_lag_ns / 1e6);
                 }
-                // Store the oldest temperature for rate-of-rise detection
-                oldesttemp = t;
-                count++;
+                alarm_active = 1;
             }
+        }
 
-            if (count == TEMPCHANGE_WINDOW)
+        if (alarm_active && loop->carpark)
+        {
+            // Activate alarms on all levels
+            for (int i = 0; i < LEVELS; i++)
             {
-                // If 90% of the last 30 temperatures are >= 58 degrees,
-                // this is considered a high temperature. Raise the alarm
-                if (hightemps >= TEMPCHANGE_WINDOW * 0.9)
-                {
-                    alarm_active = 1;
-                    sign = shm + addr + 2;
-                    *sign = 1;
-                }
-
-                // If the newest temp is >= 8 degrees higher than the oldest
-                // temp (out of the last 30), this is a high rate-of-rise.
-                // Raise the alarm
-                if (templist->temperature - oldesttemp->temperature >= 8 && oldesttemp->temperature != 0)
-                {
-                
-                    alarm_active = 1;
-                    sign = shm + addr + 2;
-                    *sign = 1;
-                }
+                *(char *)(shm + 104 * i + 2498) = 1;
+            }
+            // Open up all boom gates
+            for (int i = 0; i < ENTRANCES; i++)
+            {
+                bg_emergency_open(shm + 288 * i + 96);
+            }
+            for (int i = 0; i < EXITS; i++)
+            {
+                bg_emergency_open(shm + 192 * i + 1536);
             }
+            evac_step(loop, start);
         }
 
-        usleep(2000);
+        uint64_t sweep = ts_now() - start;
+        if (sweep > loop->max_sweep_ns)
+        {
+            loop->max_sweep_ns = sweep;
+        }
     }
 }
 
-void *open_en_boomgate(void *arg) {
-    // struct boomgate *bg = arg;
-    int i = *((int *)arg);
-    struct boomgate *bg = shm + 288 * i + 96;
-
-    for (;;) {
-        pthread_mutex_lock(&bg->m);
-        if (bg->s == 'C') {
-            bg->s = 'R';
-            pthread_mutex_unlock(&bg->m);
-            pthread_cond_broadcast(&bg->c);
-        } else if (bg->s == 'O') {
-            pthread_cond_wait(&bg->c, &bg->m);
-        } else {
-            pthread_mutex_unlock(&bg->m);
+static volatile bool bench_running = true;
+
+// keeps the synthetic sensors publishing, one sample each per period
+void *bench_feed(void *arg)
+{
+    struct fireloop *loop = arg;
+    uint64_t next = ts_now();
+    while (bench_running)
+    {
+        for (int i = 0; i < loop->nsensors; i++)
+        {
+            temp_ring_publish(loop->sensors[i].ring, 20 + rand() % 8);
         }
+        next += BENCH_PERIOD_NS;
+        struct timespec until = {next / 1000000000ULL, next % 1000000000ULL};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
     }
+    return NULL;
 }
 
-void *open_ex_boomgate(void *arg) {
-    // struct boomgate *bg = arg;
-    int i = *((int *)arg);
-    struct boomgate *bg = shm + 192 * i + 1536;
-    
-    for (;;) {
-        pthread_mutex_lock(&bg->m);
-        if (bg->s != 'O') {
-            bg->s = 'R';
-            pthread_mutex_unlock(&bg->m);
-            pthread_cond_broadcast(&bg->c);
-        } else if (bg->s == 'O') {
-            pthread_cond_wait(&bg->c, &bg->m);
-        } else {
-            pthread_mutex_unlock(&bg->m);
+// Follow n synthetic sensors for BENCH_TIME_NS and report the cost.
+int fireloop_bench(int n)
+{
+    struct fireloop loop = {0};
+    temp_ring_t *synthetic = calloc(n, sizeof(temp_ring_t));
+    struct tempstate *states = calloc(n, sizeof(struct tempstate));
+    char *alarms = calloc(n, 1);
+    pthread_t feeder;
+    struct timespec cpu0, cpu1;
+
+    loop.sensors = calloc(n, sizeof(struct sensor));
+    loop.nsensors = n;
+    if (!synthetic || !states || !alarms || !loop.sensors)
+    {
+        fprintf(stderr, "firealarm: out of memory for %d sensors\n", n);
+        return 1;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        loop.sensors[i].ring = &synthetic[i];
+        loop.sensors[i].st = &states[i];
+        loop.sensors[i].alarm = &alarms[i];
+    }
+    if (!fireloop_init(&loop))
+    {
+        return 1;
+    }
+
+    pthread_create(&feeder, NULL, bench_feed, &loop);
+    uint64_t start = ts_now();
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+    fireloop_run(&loop, start + BENCH_TIME_NS);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+    double seconds = ts_elapsed_ns(start) / 1e9;
+    bench_running = false;
+    pthread_join(feeder, NULL);
+
+    unsigned long lost = 0;
+    uint64_t max_lag = 0;
+    for (int i = 0; i < n; i++)
+    {
+        lost += states[i].lost;
+        if (states[i].max_lag_ns > max_lag)
+        {
+            max_lag = states[i].max_lag_ns;
         }
     }
+    double cpu = (cpu1.tv_sec - cpu0.tv_sec) + (cpu1.tv_nsec - cpu0.tv_nsec) / 1e9;
+    printf("%d sensors (%d sites) over %.1f s: %lu samples (%.0f/s) \t missed %lu\n",
+           n, (n + LEVELS - 1) / LEVELS, seconds, loop.samples, loop.samples / seconds, lost);
+    printf("loop: %lu ticks \t cpu %.1f%% of a core \t worst sweep %.3f ms \t worst sample lag %.3f ms\n",
+           loop.ticks, 100 * cpu / seconds, loop.max_sweep_ns / 1e6, max_lag / 1e6);
+    return 0;
+}
+/* ----------Event loop --------------*/
+
+void usage()
+{
+    printf("Usage: ./firealarm [-e] [-b SENSORS]\n");
+    printf("  -e          follow every sensor from one event loop instead of a thread per level\n");
+    printf("  -b SENSORS  run the event loop on SENSORS synthetic sensors and report its cost\n");
+    exit(1);
 }
 
-int main()
+int main(int argc, char *argv[])
 {
-    int en_id[ENTRANCES];
-    int ex_id[EXITS];
+    bool eventloop = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "eb:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'e':
+            eventloop = true;
+            break;
+        case 'b':
+            ts_init();
+            return fireloop_bench(atoi(optarg) > 0 ? atoi(optarg) : LEVELS);
+        default:
+            usage();
+        }
+    }
 
     shm_fd = shm_open("PARKING", O_RDWR, 0);
     shm = (void *)mmap(0, 2920, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    ts_init();
+    rings = rings_open(false);
+    if (rings == NULL)
+    {
+        exit(1);
+    }
+    // the monitors and the event loop are all sensor work, and inherit this
+    place_init("firealarm");
+    place_thread(pthread_self(), PLACE_SENSOR);
+    place_hot("PARKING", shm, 2920, true);
+    place_hot(RINGS_NAME, rings, sizeof(rings_t), true);
+    if (place_requested())
+    {
+        place_report(stdout);
+    }
 
     while ((*(char *)(shm + 2919)) == 1)
     {
     };
 
+    if (eventloop)
+    {
+        struct sensor sensors[LEVELS];
+        struct fireloop loop = {sensors, LEVELS, true};
+        for (int i = 0; i < LEVELS; i++)
+        {
+            sensors[i].ring = &rings->temp[i];
+            sensors[i].st = &tempstates[i];
+            sensors[i].alarm = shm + 104 * i + 2498;
+        }
+        if (!fireloop_init(&loop))
+        {
+            exit(1);
+        }
+        fireloop_run(&loop, 0);
+        tempreport(stdout);
+        munmap((void *)shm, 2920);
+        close(shm_fd);
+        return 0;
+    }
+
     pthread_t *threads = malloc(sizeof(pthread_t) * LEVELS);
 
     for (int i = 0; i < LEVELS; i++)
@@ -240,21 +509,17 @@ int main()
             *alarm_trigger = 1;
         }
 
-        // Open up all boom gates
+        // Open up all boom gates and keep them open
         pthread_t *boomgatethreads = malloc(sizeof(pthread_t) * (ENTRANCES + EXITS));
         for (int i = 0; i < ENTRANCES; i++)
         {
-            en_id[i] = i;
-            // int addr = 288 * i + 96;
-            // struct boomgate *bg = shm + addr;
-            pthread_create(boomgatethreads + i, NULL, open_en_boomgate, (void *)&en_id[i]);
+            pthread_create(boomgatethreads + i, NULL, bg_hold_open, shm + 288 * i + 96);
+            place_thread(boomgatethreads[i], PLACE_DEVICE);
         }
         for (int i = 0; i < EXITS; i++)
         {
-            ex_id[i] = i;
-            // int addr = 192 * i + 1536;
-            // struct boomgate *bg = shm + addr;
-            pthread_create(boomgatethreads + ENTRANCES + i, NULL, open_ex_boomgate, (void *)&ex_id[i]);
+            pthread_create(boomgatethreads + ENTRANCES + i, NULL, bg_hold_open, shm + 192 * i + 1536);
+            place_thread(boomgatethreads[ENTRANCES + i], PLACE_DEVICE);
         }
 
         // Show evacuation message on an endless loop
@@ -280,6 +545,7 @@ int main()
             }
         }
     }
+    tempreport(stdout);
     munmap((void *)shm, 2920);
     close(shm_fd);
 
@@ -0,0 +1,225 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "header.h"
+#include "random_string.c"
+#include "timestamp.c"
+#include "whitelist.c"
+
+/* ----------Arrival generator --------------*/
+// Generates car arrivals for load testing. Each generator thread keeps its
+// own schedule of arrival times, random state and ring of random plates, so
+// threads never contend with each other; the arrivals are handed to the
+// simulator through a callback.
+//
+// Profiles:
+//     poisson - exponential gaps between arrivals at the given mean rate
+//     burst   - poisson, but a rush hour at the start of every period runs
+//               at GEN_RUSH_FACTOR times the rate
+//     fixed   - evenly spaced arrivals
+
+#define GEN_MAX_THREADS 64
+#define GEN_RUSH_PERIOD_NS (10 * 1000000000ULL)
+#define GEN_RUSH_LENGTH_NS (2 * 1000000000ULL)
+#define GEN_RUSH_FACTOR 5.0
+// arrivals due within this much of now are sent straight away instead of sleeping
+#define GEN_SLACK_NS (1000 * 1000ULL)
+
+typedef enum gen_profile {
+    GEN_POISSON,
+    GEN_BURST,
+    GEN_FIXED
+} gen_profile_t;
+
+// called for every arrival, plate is PLATE_LEN characters and only valid during the call
+typedef void (*gen_arrival_fn)(const char *plate, int entrance_id);
+
+typedef struct gen_config
+{
+    gen_profile_t profile;
+    double rate;              // arrivals per second over all threads
+    double whitelist_ratio;   // share of arrivals with a whitelisted plate
+    double weight[ENTRANCES]; // relative share of arrivals at each entrance
+    int threads;
+    gen_arrival_fn arrive;
+    const whitelist_t *whitelist; // plates a whitelisted arrival is picked from
+} gen_config_t;
+
+typedef struct gen_thread
+{
+    pthread_t thread;
+    uint64_t rng;
+    plate_ring_t plates; // random plates for cars not on the whitelist
+    unsigned long offered[ENTRANCES];
+} __attribute__((aligned(64))) gen_thread_t;
+
+gen_config_t gen_cfg = {GEN_POISSON, 20.0, 0.5, {1, 1, 1, 1, 1}, 1, NULL, NULL};
+static gen_thread_t gen_threads[GEN_MAX_THREADS];
+static double gen_cum_weight[ENTRANCES];
+static uint64_t gen_start_ns;
+
+// outcome at the sign, counted by the simulator
+unsigned long gen_admitted[ENTRANCES];
+unsigned long gen_refused[ENTRANCES];
+
+// uniform in [0, 1)
+static inline double gen_uniform(uint64_t *s)
+{
+    return (rand_u64(s) >> 11) * 0x1.0p-53;
+}
+
+// pick an entrance according to the weights
+static inline int gen_entrance(uint64_t *s)
+{
+    double u = gen_uniform(s) * gen_cum_weight[ENTRANCES - 1];
+    int i = 0;
+    while (i < ENTRANCES - 1 && u >= gen_cum_weight[i])
+    {
+        i++;
+    }
+    return i;
+}
+
+// gap until the arrival after one due at time at
+static uint64_t gen_interval_ns(gen_thread_t *g, uint64_t at)
+{
+    double rate = gen_cfg.rate / gen_cfg.threads;
+    if (gen_cfg.profile == GEN_BURST && (at - gen_start_ns) % GEN_RUSH_PERIOD_NS < GEN_RUSH_LENGTH_NS)
+    {
+        rate *= GEN_RUSH_FACTOR;
+    }
+    if (gen_cfg.profile == GEN_FIXED)
+    {
+        return (uint64_t)(1e9 / rate);
+    }
+    return (uint64_t)(-log(1.0 - gen_uniform(&g->rng)) * 1e9 / rate);
+}
+
+static void *gen_thread_handler(void *arg)
+{
+    gen_thread_t *g = arg;
+    uint64_t next = ts_now();
+
+    for (;;)
+    {
+        if (next > ts_now() + GEN_SLACK_NS)
+        {
+            struct timespec until = {next / 1000000000ULL, next % 1000000000ULL};
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+        }
+
+        const char *plate;
+        if (gen_uniform(&g->rng) < gen_cfg.whitelist_ratio)
+        {
+            plate = whitelist_plate(gen_cfg.whitelist, rand_u64(&g->rng) % gen_cfg.whitelist->count);
+        }
+        else
+        {
+            plate = plate_ring_next(&g->plates);
+        }
+        int entrance_id = gen_entrance(&g->rng);
+        gen_cfg.arrive(plate, entrance_id);
+        __atomic_fetch_add(&g->offered[entrance_id], 1, __ATOMIC_RELAXED);
+
+        next += gen_interval_ns(g, next);
+    }
+    return NULL;
+}
+
+// parse "poisson", "burst" or "fixed", returns -1 if unknown
+int gen_parse_profile(const char *s)
+{
+    if (strcmp(s, "poisson") == 0)
+    {
+        return GEN_POISSON;
+    }
+    if (strcmp(s, "burst") == 0)
+    {
+        return GEN_BURST;
+    }
+    if (strcmp(s, "fixed") == 0)
+    {
+        return GEN_FIXED;
+    }
+    return -1;
+}
+
+// parse comma separated entrance weights, e.g. "4,1,1,1,2"
+bool gen_parse_weights(const char *s, double *weight)
+{
+    char *end;
+    for (int i = 0; i < ENTRANCES; i++)
+    {
+        weight[i] = strtod(s, &end);
+        if (end == s || weight[i] < 0)
+        {
+            return false;
+        }
+        s = end;
+        if (i < ENTRANCES - 1)
+        {
+            if (*s != ',')
+            {
+                return false;
+            }
+            s++;
+        }
+    }
+    return *s == '\0';
+}
+
+// Start the generator threads with gen_cfg.
+// pre: ts_init() AND gen_cfg.arrive != NULL
+// post: (return == false AND the configuration is invalid)
+//       OR (gen_cfg.threads threads are generating arrivals)
+bool gen_start()
+{
+    double sum = 0;
+    for (int i = 0; i < ENTRANCES; i++)
+    {
+        sum += gen_cfg.weight[i];
+        gen_cum_weight[i] = sum;
+    }
+    if (sum <= 0 || gen_cfg.rate <= 0 || gen_cfg.threads < 1 || gen_cfg.threads > GEN_MAX_THREADS ||
+        (gen_cfg.whitelist_ratio > 0 && (gen_cfg.whitelist == NULL || gen_cfg.whitelist->count < 1)))
+    {
+        return false;
+    }
+
+    gen_start_ns = ts_now();
+    for (int i = 0; i < gen_cfg.threads; i++)
+    {
+        gen_threads[i].rng = (gen_start_ns ^ (0x9E3779B97F4A7C15ULL * (i + 1))) | 1;
+        gen_threads[i].plates.rng = rand_u64(&gen_threads[i].rng) | 1;
+        pthread_create(&gen_threads[i].thread, NULL, gen_thread_handler, &gen_threads[i]);
+    }
+    return true;
+}
+
+// print offered against accepted load since gen_start()
+void gen_report(FILE *out)
+{
+    double seconds = ts_elapsed_ns(gen_start_ns) / 1e9;
+    unsigned long offered = 0, admitted = 0, refused = 0;
+
+    fprintf(out, "arrivals over %.1f s:\n", seconds);
+    for (int i = 0; i < ENTRANCES; i++)
+    {
+        unsigned long lane = 0;
+        for (int t = 0; t < gen_cfg.threads; t++)
+        {
+            lane += __atomic_load_n(&gen_threads[t].offered[i], __ATOMIC_RELAXED);
+        }
+        fprintf(out, "entrance %d: offered %lu \t admitted %lu \t refused %lu\n", i + 1, lane, gen_admitted[i], gen_refused[i]);
+        offered += lane;
+        admitted += gen_admitted[i];
+        refused += gen_refused[i];
+    }
+    fprintf(out, "total: offered %lu (%.1f/s) \t admitted %lu (%.1f/s) \t refused %lu\n", offered, offered / seconds, admitted, admitted / seconds, refused);
+}
+/* ----------Arrival generator --------------*/
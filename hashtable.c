@@ -19,11 +19,26 @@ void item_print(item_t *i) {
     printf("key=%s value=%Lf", i->key, i->value);
 }
 
+// The table grows by itself. When an add would take the load (items per
+// bucket) over HTAB_MAX_LOAD, a table twice the size is allocated and the
+// items are moved across a few buckets at a time, HTAB_REHASH_STEP old
+// buckets on every add and delete, so no single call pays for the whole
+// rehash. Until the move is done an item can be in either table, and
+// lookups check both.
+
+#define HTAB_MAX_LOAD 1.0
+#define HTAB_REHASH_STEP 4  // old buckets moved per add or delete
+
 // A hash table mapping a string to an integer.
 typedef struct htab htab_t;
 struct htab {
     item_t **buckets;
     size_t size;
+    size_t count;        // items in both tables
+    item_t **old;        // the table being emptied, NULL when not rehashing
+    size_t old_size;
+    size_t migrated;     // old buckets already moved
+    unsigned long rehashes;  // times the table has grown
 };
 
 // Initialise a new hash table with n buckets.
@@ -31,8 +46,13 @@ struct htab {
 // post: (return == false AND allocation of table failed)
 //       OR (all buckets are null pointers)
 bool htab_init(htab_t *h, size_t n) {
-    h->size = n;
-    h->buckets = (item_t **)calloc(n, sizeof(item_t *));
+    h->size = n > 0 ? n : 1;
+    h->count = 0;
+    h->old = NULL;
+    h->old_size = 0;
+    h->migrated = 0;
+    h->rehashes = 0;
+    h->buckets = (item_t **)calloc(h->size, sizeof(item_t *));
     return h->buckets != 0;
 }
 
@@ -53,6 +73,61 @@ size_t htab_index(htab_t *h, char *key) {
     return djb_hash(key) % h->size;
 }
 
+// the bucket for key in the table being emptied, NULL if it has been moved
+item_t **htab_old_bucket(htab_t *h, char *key) {
+    if (h->old == NULL) {
+        return NULL;
+    }
+    size_t i = djb_hash(key) % h->old_size;
+    return i < h->migrated ? NULL : &h->old[i];
+}
+
+// Move up to n old buckets into the new table.
+// pre: true
+// post: the rehash has moved on by n buckets, or finished and freed the old table
+void htab_rehash_step(htab_t *h, size_t n) {
+    while (h->old != NULL && n-- > 0) {
+        item_t *i = h->old[h->migrated];
+        while (i != NULL) {
+            item_t *next = i->next;
+            size_t bucket = htab_index(h, i->key);
+            i->next = h->buckets[bucket];
+            h->buckets[bucket] = i;
+            i = next;
+        }
+        h->old[h->migrated++] = NULL;
+        if (h->migrated == h->old_size) {
+            free(h->old);
+            h->old = NULL;
+            h->old_size = 0;
+            h->migrated = 0;
+        }
+    }
+}
+
+// Make room for one more item: carry on with a rehash, or start one if the
+// table is too full. A table that cannot grow just gets fuller.
+void htab_grow(htab_t *h) {
+    if (h->old != NULL) {
+        htab_rehash_step(h, HTAB_REHASH_STEP);
+        return;
+    }
+    if (h->count + 1 <= h->size * HTAB_MAX_LOAD) {
+        return;
+    }
+    item_t **bigger = (item_t **)calloc(h->size * 2, sizeof(item_t *));
+    if (bigger == NULL) {
+        return;
+    }
+    h->old = h->buckets;
+    h->old_size = h->size;
+    h->migrated = 0;
+    h->buckets = bigger;
+    h->size *= 2;
+    h->rehashes++;
+    htab_rehash_step(h, HTAB_REHASH_STEP);
+}
+
 size_t test_index(char *key) {
     return djb_hash(key) % 127;
 }
@@ -72,6 +147,13 @@ item_t *htab_find(htab_t *h, char *key) {
             return i;
         }
     }
+    // not moved across yet
+    item_t **old = htab_old_bucket(h, key);
+    for (item_t *i = old ? *old : NULL; i != NULL; i = i->next) {
+        if (strcmp(i->key, key) == 0) {
+            return i;
+        }
+    }
     // printf("i did not find it\n");
     return NULL;
 }
@@ -89,27 +171,12 @@ bool htab_add(htab_t *h, char *key, long double value) {
     newhead->key = key;
     newhead->value = value;
 
-    // hash key and place item in appropriate bucket
-    size_t bucket = htab_index(h, key);
-    newhead->next = h->buckets[bucket];
-    h->buckets[bucket] = newhead;
-    return true;
-}
-
-// hash table only for cars with the time when entrance lpr started to read its license
-bool htab_add_billing(htab_t *h, char *key, struct timeval start_time) {
-    item_t *
-        newhead = (item_t *)malloc(sizeof(item_t));
-    if (newhead == NULL) {
-        return false;
-    }
-    newhead->key = key;
-    newhead->start_time = start_time;
-
-    // hash key and place item in appropriate bucket
+    // hash key and place item in appropriate bucket, new items always go in the new table
+    htab_grow(h);
     size_t bucket = htab_index(h, key);
     newhead->next = h->buckets[bucket];
     h->buckets[bucket] = newhead;
+    h->count++;
     return true;
 }
 
@@ -139,8 +206,7 @@ void htab_print(htab_t *h) {
         } else {
             for (item_t *j = h->buckets[i]; j != NULL; j = j->next) {
                 item_print(j);
-                // struct timeval time = j->start_time;
-                // printf("start time: %ld\n", time.tv_usec);
+                // printf("entry time: %lu\n", j->car.entry_ts);
                 if (j->next != NULL) {
                     printf(" -> ");
                 }
@@ -154,21 +220,27 @@ void htab_print(htab_t *h) {
 // pre: htab_find(h, key) != NULL
 // post: htab_find(h, key) == NULL
 void htab_delete(htab_t *h, char *key) {
-    item_t *head = htab_bucket(h, key);
-    item_t *current = head;
-    item_t *previous = NULL;
-    while (current != NULL) {
-        if (strcmp(current->key, key) == 0) {
-            if (previous == NULL) {  // first item in list
-                h->buckets[htab_index(h, key)] = current->next;
-            } else {
-                previous->next = current->next;
+    item_t **bucket = &h->buckets[htab_index(h, key)];
+    for (int table = 0; table < 2 && bucket != NULL; table++) {
+        item_t *current = *bucket;
+        item_t *previous = NULL;
+        while (current != NULL) {
+            if (strcmp(current->key, key) == 0) {
+                if (previous == NULL) {  // first item in list
+                    *bucket = current->next;
+                } else {
+                    previous->next = current->next;
+                }
+                free(current);
+                h->count--;
+                htab_rehash_step(h, HTAB_REHASH_STEP);
+                return;
             }
-            free(current);
-            break;
+            previous = current;
+            current = current->next;
         }
-        previous = current;
-        current = current->next;
+        // not moved across yet
+        bucket = htab_old_bucket(h, key);
     }
 }
 
@@ -185,6 +257,7 @@ void htab_delete_level(htab_t *h, char *key, int level) {
                 previous->next = current->next;
             }
             free(current);
+            h->count--;
             break;
         }
         previous = current;
@@ -196,7 +269,8 @@ void htab_delete_level(htab_t *h, char *key, int level) {
 // pre: htab_init(h)
 // post: all memory for hash table is released
 void htab_destroy(htab_t *h) {
-    // free linked lists
+    // move anything left in the old table, then free linked lists
+    htab_rehash_step(h, h->old_size);
     for (size_t i = 0; i < h->size; ++i) {
         item_t *bucket = h->buckets[i];
         while (bucket != NULL) {
@@ -210,5 +284,34 @@ void htab_destroy(htab_t *h) {
     free(h->buckets);
     h->buckets = NULL;
     h->size = 0;
+    h->count = 0;
+}
+
+// Measure the table, for telemetry. Walks every bucket, so it costs as
+// much as the table is big.
+// pre: htab_init(h)
+// post: *st describes h
+void htab_stats(htab_t *h, htab_stats_t *st) {
+    size_t used = 0;
+    size_t longest = 0;
+    for (int table = 0; table < 2; table++) {
+        item_t **buckets = table == 0 ? h->buckets : h->old;
+        size_t size = table == 0 ? h->size : h->old_size;
+        for (size_t b = (table == 0 ? 0 : h->migrated); buckets != NULL && b < size; b++) {
+            size_t chain = 0;
+            for (item_t *i = buckets[b]; i != NULL; i = i->next) {
+                chain++;
+            }
+            used += chain > 0;
+            longest = chain > longest ? chain : longest;
+        }
+    }
+    st->count = h->count;
+    st->buckets = h->size + h->old_size;
+    st->load = (double)h->count / h->size;
+    st->avg_chain = used > 0 ? (double)h->count / used : 0;
+    st->max_chain = longest;
+    st->rehash_progress = h->old != NULL ? (double)h->migrated / h->old_size : 1.0;
+    st->rehashes = h->rehashes;
 }
 /* ----------Hash tables from Prac 3 --------------*/
\ No newline at end of file
@@ -1,4 +1,9 @@
+#ifndef HEADER_H
+#define HEADER_H
+
 #include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define SHARE_NAME "PARKING"
 #define SHARE_SIZE 2920
@@ -19,6 +24,7 @@ typedef struct boomgate {
     pthread_mutex_t m;
     pthread_cond_t c;
     char s;
+    uint32_t opens;  // in the padding after s, see bg_let_through()
 } boomgate_t;
 
 // struct for information sign
@@ -56,11 +62,29 @@ typedef struct item item_t;
 struct item {
     char *key;
     long double value;
-    struct timeval start_time;
     item_t *next;
 };
 
+// how full a hash table is, see htab_stats() in hashtable.c
+typedef struct htab_stats {
+    size_t count;            // items
+    size_t buckets;          // in both tables while rehashing
+    double load;             // items per bucket of the current table
+    double avg_chain;        // items per non-empty bucket, the average probe length
+    size_t max_chain;        // longest chain, the worst probe length
+    double rehash_progress;  // share of the old table moved, 1 when not rehashing
+    unsigned long rehashes;  // times the table has grown
+} htab_stats_t;
+
+// a car to bill, copied out of its state so the state can go when it leaves
 typedef struct bill_task {
-    item_t *car;
+    char license[7];
+    int level;
+    uint64_t entry_ts;
+    uint64_t exit_ts;  // when the exit lpr read the plate
+    int gate;          // the exit it left by
+    int overstayed;    // it was still inside past the overstay limit
     struct bill_task *next;
-} bill_task_t;
\ No newline at end of file
+} bill_task_t;
+
+#endif
@@ -0,0 +1,453 @@
+#ifndef LANES_C
+#define LANES_C
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "random_string.c"
+#include "timestamp.c"
+
+/* ----------Lane queues --------------*/
+// The cars waiting at each entrance and exit. A lane is a fixed ring of
+// LANE_DEFAULT_CAP cars (or -q) that is allocated once, so overload shows up
+// as full lanes, waiting and lost cars instead of a heap that keeps growing.
+// What happens to a car that finds its lane full is the lane policy:
+//     block  - whoever brought the car (a generator thread, or a car leaving
+//              its level) waits for room, so arrivals fall behind schedule
+//     drop   - the car goes away and is counted
+//     divert - the car goes to the lane with the most room, and is dropped
+//              only if every lane is full
+//     divert, else block - as divert, but if every lane is full the car
+//              waits for its own lane, for a car that cannot be lost
+//
+// Every lane counts what went through it, how long cars waited in it, how
+// long it was full for, and how long its handler was busy with a car, for
+// lane_report().
+
+#define LANE_DEFAULT_CAP 64
+#define LANE_WAIT_BUCKETS 40  // log2 of the ns a car waited
+
+typedef enum lane_policy
+{
+    LANE_BLOCK,
+    LANE_DROP,
+    LANE_DIVERT,
+    LANE_DIVERT_OR_BLOCK
+} lane_policy_t;
+
+typedef struct lane_car
+{
+    char license[6];
+    char lv;           // level it is parked on, for the exits
+    uint64_t queued;   // ts_now() when it joined the lane
+} lane_car_t;
+
+typedef struct lane
+{
+    pthread_mutex_t m;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    lane_car_t *ring;
+    uint32_t cap;
+    uint32_t head;    // next car out
+    uint32_t count;
+    // stats, guarded by m
+    uint64_t start;      // ts_now() at lane_init()
+    uint64_t changed;    // ts_now() when count last changed
+    uint64_t depth_ns;   // sum of count * time at that count
+    uint32_t peak;
+    unsigned long queued;    // took a place, including cars diverted here
+    unsigned long served;
+    unsigned long dropped;   // turned away from this lane
+    unsigned long diverted;  // sent from this lane to another
+    unsigned long blocked;   // pushes that waited for room
+    uint64_t blocked_ns;
+    uint64_t wait_ns;        // sum over the cars served
+    uint64_t wait_max_ns;
+    unsigned long wait_hist[LANE_WAIT_BUCKETS];
+    uint64_t serving;  // ts_now() when the car being handled left the lane, 0 if none
+    uint64_t busy_ns;  // handling cars, up to the last lane_done()
+} lane_t;
+
+lane_policy_t lane_policy = LANE_BLOCK;
+uint32_t lane_cap = LANE_DEFAULT_CAP;
+
+// parse "block", "drop" or "divert", returns -1 if unknown
+int lane_parse_policy(const char *s)
+{
+    if (strcmp(s, "block") == 0)
+    {
+        return LANE_BLOCK;
+    }
+    if (strcmp(s, "drop") == 0)
+    {
+        return LANE_DROP;
+    }
+    if (strcmp(s, "divert") == 0)
+    {
+        return LANE_DIVERT;
+    }
+    return -1;
+}
+
+// Set up an empty lane for cap cars.
+// pre: ts_init() AND cap > 0
+// post: (return == false AND allocation failed) OR the lane is empty
+bool lane_init(lane_t *l, uint32_t cap, const pthread_mutexattr_t *ma, const pthread_condattr_t *ca)
+{
+    memset(l, 0, sizeof(lane_t));
+    l->ring = calloc(cap, sizeof(lane_car_t));
+    if (l->ring == NULL)
+    {
+        return false;
+    }
+    l->cap = cap;
+    pthread_mutex_init(&l->m, ma);
+    pthread_cond_init(&l->not_empty, ca);
+    pthread_cond_init(&l->not_full, ca);
+    l->start = l->changed = ts_now();
+    return true;
+}
+
+// count the time spent at the current length, lane locked
+static void lane_changed(lane_t *l, uint64_t now)
+{
+    l->depth_ns += (uint64_t)l->count * (now - l->changed);
+    l->changed = now;
+}
+
+// add a car at the back, lane locked and not full
+static void lane_put(lane_t *l, const char license[6], char lv)
+{
+    uint64_t now = ts_now();
+    lane_changed(l, now);
+    lane_car_t *c = &l->ring[(l->head + l->count) % l->cap];
+    memcpy(c->license, license, 6);
+    c->lv = lv;
+    c->queued = now;
+    l->count++;
+    l->queued++;
+    if (l->count > l->peak)
+    {
+        l->peak = l->count;
+    }
+    pthread_cond_signal(&l->not_empty);
+}
+
+// wait for room and add a car at the back, lane locked
+static void lane_wait_put(lane_t *l, const char license[6], char lv)
+{
+    if (l->count == l->cap)
+    {
+        uint64_t start = ts_now();
+        l->blocked++;
+        while (l->count == l->cap)
+        {
+            pthread_cond_wait(&l->not_full, &l->m);
+        }
+        l->blocked_ns += ts_elapsed_ns(start);
+    }
+    lane_put(l, license, lv);
+}
+
+// Queue a car on lane id of lanes, or as policy says if that lane is full.
+// pre: 0 <= id < n
+// post: (return == -1 AND the car was dropped, never for LANE_BLOCK or
+//       LANE_DIVERT_OR_BLOCK) OR the car is queued on lane return
+int lane_push(lane_t *lanes, int n, int id, const char license[6], char lv, lane_policy_t policy)
+{
+    lane_t *l = &lanes[id];
+    pthread_mutex_lock(&l->m);
+    if (l->count < l->cap || policy == LANE_BLOCK)
+    {
+        lane_wait_put(l, license, lv);
+        pthread_mutex_unlock(&l->m);
+        return id;
+    }
+    if (policy == LANE_DROP)
+    {
+        l->dropped++;
+        pthread_mutex_unlock(&l->m);
+        return -1;
+    }
+
+    // divert: the lengths are only a guess by the time the car gets there,
+    // so try the lanes from the most room down until one takes it
+    l->diverted++;
+    pthread_mutex_unlock(&l->m);
+    bool tried[n];
+    memset(tried, 0, sizeof(tried));
+    tried[id] = true;
+    for (int k = 1; k < n; k++)
+    {
+        int best = -1;
+        uint32_t room = 0;
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t r = lanes[i].cap - __atomic_load_n(&lanes[i].count, __ATOMIC_RELAXED);
+            if (!tried[i] && r > room)
+            {
+                best = i;
+                room = r;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        tried[best] = true;
+        lane_t *other = &lanes[best];
+        pthread_mutex_lock(&other->m);
+        if (other->count < other->cap)
+        {
+            lane_put(other, license, lv);
+            pthread_mutex_unlock(&other->m);
+            return best;
+        }
+        pthread_mutex_unlock(&other->m);
+    }
+    pthread_mutex_lock(&l->m);
+    if (policy == LANE_DIVERT_OR_BLOCK)
+    {
+        lane_wait_put(l, license, lv);
+        pthread_mutex_unlock(&l->m);
+        return id;
+    }
+    l->dropped++;
+    pthread_mutex_unlock(&l->m);
+    return -1;
+}
+
+// Take the car at the front of a lane, waiting for one.
+// pre: true
+// post: *out is the car that has been in the lane longest, and it has left it
+void lane_pop(lane_t *l, lane_car_t *out)
+{
+    pthread_mutex_lock(&l->m);
+    while (l->count == 0)
+    {
+        pthread_cond_wait(&l->not_empty, &l->m);
+    }
+    uint64_t now = ts_now();
+    lane_changed(l, now);
+    *out = l->ring[l->head];
+    l->head = (l->head + 1) % l->cap;
+    l->count--;
+    l->served++;
+    l->serving = now;
+
+    uint64_t waited = now - out->queued;
+    int b = 0;
+    while (b < LANE_WAIT_BUCKETS - 1 && (waited >> b) > 1)
+    {
+        b++;
+    }
+    l->wait_hist[b]++;
+    l->wait_ns += waited;
+    if (waited > l->wait_max_ns)
+    {
+        l->wait_max_ns = waited;
+    }
+    pthread_mutex_unlock(&l->m);
+    pthread_cond_signal(&l->not_full);
+}
+
+// The car last taken off a lane has been dealt with, for the lane's busy time.
+// pre: lane_pop(l) by the same thread
+// post: the time since that lane_pop() counts as busy
+void lane_done(lane_t *l)
+{
+    pthread_mutex_lock(&l->m);
+    l->busy_ns += ts_elapsed_ns(l->serving);
+    l->serving = 0;
+    pthread_mutex_unlock(&l->m);
+}
+
+/* ----------Lane queues --------------*/
+
+/* ----------Lane routing --------------*/
+// Which lane a car goes to. The road brings each car to a lane (the
+// generator's -W weights for entrances, the router's own for exits); the
+// route then decides where it actually queues:
+//     uniform  - any lane, all equally likely, whatever the road does
+//     weighted - the lane the road brought it to
+//     jsq      - the shortest lane, that one if it ties (join the shortest queue)
+//     p2c      - the shorter of that lane and one other picked at random
+//                (the power of two choices)
+// jsq and p2c stand for signs showing the drivers the queues.
+
+#define LANE_MAX 8
+
+typedef enum lane_route
+{
+    ROUTE_UNIFORM,
+    ROUTE_WEIGHTED,
+    ROUTE_JSQ,
+    ROUTE_P2C
+} lane_route_t;
+
+static const char *lane_route_names[] = {"uniform", "weighted", "jsq", "p2c"};
+
+typedef struct lane_router
+{
+    lane_route_t route;
+    double cum_weight[LANE_MAX];  // running sums of the road's weights
+} lane_router_t;
+
+static __thread uint64_t lane_rng;  // each thread's own, seeded on first use
+
+static inline uint64_t lane_rand()
+{
+    if (lane_rng == 0)
+    {
+        lane_rng = (ts_now() ^ (0x9E3779B97F4A7C15ULL * (uintptr_t)&lane_rng)) | 1;
+    }
+    return rand_u64(&lane_rng);
+}
+
+// random in [0, n)
+static inline int lane_random(int n)
+{
+    return (int)(((lane_rand() >> 32) * (uint64_t)n) >> 32);
+}
+
+// parse "uniform", "weighted", "jsq" or "p2c", returns -1 if unknown
+int lane_parse_route(const char *s)
+{
+    for (int r = 0; r < (int)(sizeof(lane_route_names) / sizeof(lane_route_names[0])); r++)
+    {
+        if (strcmp(s, lane_route_names[r]) == 0)
+        {
+            return r;
+        }
+    }
+    return -1;
+}
+
+// Set a router's road weights.
+// pre: 0 < n <= LANE_MAX AND weight[0..n) >= 0
+// post: (return == false AND the weights are all 0) OR the router uses them
+bool lane_router_weights(lane_router_t *r, const double *weight, int n)
+{
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sum += weight[i];
+        r->cum_weight[i] = sum;
+    }
+    return sum > 0;
+}
+
+// the lane the road brings a car to, by the router's weights
+int lane_arrival(const lane_router_t *r, int n)
+{
+    double u = (lane_rand() >> 11) * 0x1.0p-53 * r->cum_weight[n - 1];
+    int i = 0;
+    while (i < n - 1 && u >= r->cum_weight[i])
+    {
+        i++;
+    }
+    return i;
+}
+
+// the length of a lane, without its lock; only a guess by the time the car gets there
+static inline uint32_t lane_length(lane_t *l)
+{
+    return __atomic_load_n(&l->count, __ATOMIC_RELAXED);
+}
+
+// Pick the lane for a car the road brought to lane arrived.
+// pre: 0 <= arrived < n <= LANE_MAX
+// post: 0 <= return < n
+int lane_route(lane_t *lanes, int n, const lane_router_t *r, int arrived)
+{
+    switch (r->route)
+    {
+    case ROUTE_UNIFORM:
+        return lane_random(n);
+    case ROUTE_JSQ:
+    {
+        int best = arrived;
+        for (int i = 0; i < n; i++)
+        {
+            if (lane_length(&lanes[i]) < lane_length(&lanes[best]))
+            {
+                best = i;
+            }
+        }
+        return best;
+    }
+    case ROUTE_P2C:
+    {
+        if (n < 2)
+        {
+            return arrived;  // no other lane to choose
+        }
+        int other = lane_random(n - 1);
+        other += other >= arrived;
+        return lane_length(&lanes[other]) < lane_length(&lanes[arrived]) ? other : arrived;
+    }
+    default:
+        return arrived;
+    }
+}
+/* ----------Lane routing --------------*/
+
+/* ----------Lane report --------------*/
+// the wait at quantile q, as the top of its histogram bucket or the longest wait
+static double lane_wait_quantile_ms(const lane_t *l, double q)
+{
+    unsigned long want = (unsigned long)(q * l->served), seen = 0;
+    for (int b = 0; b < LANE_WAIT_BUCKETS; b++)
+    {
+        seen += l->wait_hist[b];
+        if (seen > want)
+        {
+            uint64_t top = 2ULL << b;
+            return (top < l->wait_max_ns ? top : l->wait_max_ns) / 1e6;
+        }
+    }
+    return 0;
+}
+
+// print each lane's traffic, length, waits and busy time since lane_init(),
+// and how evenly the lanes were used; policy is what the lanes were pushed with
+void lane_report(FILE *out, const char *name, lane_t *lanes, int n, lane_policy_t policy, const lane_router_t *r)
+{
+    static const char *policies[] = {"block", "drop", "divert", "divert, else block"};
+    fprintf(out, "%s lanes (%u cars each, %s when full, routed %s):\n", name, lanes[0].cap, policies[policy],
+            lane_route_names[r->route]);
+    double busy_min = 1, busy_max = 0, busy_sum = 0, seconds = 0;
+    unsigned long served = 0;
+    for (int i = 0; i < n; i++)
+    {
+        lane_t *l = &lanes[i];
+        pthread_mutex_lock(&l->m);
+        uint64_t now = ts_now();
+        lane_changed(l, now);
+        seconds = (now - l->start) / 1e9;
+        // a car still being handled counts up to now
+        double busy = seconds > 0 ? (l->busy_ns + (l->serving ? now - l->serving : 0)) / 1e9 / seconds : 0;
+        fprintf(out, "%s %d: queued %lu \t served %lu \t dropped %lu \t diverted %lu \t blocked %lu (%.1f ms) \t busy %.1f%%\n",
+                name, i + 1, l->queued, l->served, l->dropped, l->diverted, l->blocked, l->blocked_ns / 1e6, busy * 100);
+        fprintf(out, "    length now %u \t peak %u \t mean %.2f \t wait mean %.2f ms \t p50 <%.2f ms \t p99 <%.2f ms \t max %.2f ms\n",
+                l->count, l->peak, seconds > 0 ? l->depth_ns / 1e9 / seconds : 0.0,
+                l->served > 0 ? l->wait_ns / 1e6 / l->served : 0.0, lane_wait_quantile_ms(l, 0.5),
+                lane_wait_quantile_ms(l, 0.99), l->wait_max_ns / 1e6);
+        served += l->served;
+        busy_sum += busy;
+        busy_min = busy < busy_min ? busy : busy_min;
+        busy_max = busy > busy_max ? busy : busy_max;
+        pthread_mutex_unlock(&l->m);
+    }
+    fprintf(out, "%s lanes: served %.1f/s \t busy min %.1f%% \t mean %.1f%% \t max %.1f%%\n", name,
+            seconds > 0 ? served / seconds : 0.0, busy_min * 100, busy_sum / n * 100, busy_max * 100);
+    fflush(out);
+}
+/* ----------Lane report --------------*/
+
+#endif
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include "./header.h"
+#include "timestamp.c"
+#include "rings.c"
+#include "placement.c"
+
+// benchmark for the placement options: the time from a plate read being
+// pushed to a consumer having it and its car's state in hand, the way the
+// manager's lpr threads work, over a private ring and car pool
+// usage: [PARK_CPUS=device=0] [PARK_HUGEPAGES=1] [PARK_MLOCK=1] ./lat_bench [READS] [POOL_MB]
+
+#define LAT_GAP_US 20  // between reads, so each one finds the consumer asleep
+
+static rings_t *bench_rings;
+static uint64_t *bench_pool;
+static size_t bench_cars;
+static long bench_reads;
+static uint64_t *bench_lat;
+
+static int by_value(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void *consume(void *arg) {
+    lpr_ring_t *r = &bench_rings->en[0];
+    lpr_event_t batch[LPR_BATCH];
+    long got = 0;
+    while (got < bench_reads) {
+        lpr_ring_wait(r);
+        size_t n = lpr_ring_pop(r, batch, LPR_BATCH);
+        for (size_t i = 0; i < n; i++, got++) {
+            // a car the read names, spread over the whole pool
+            uint64_t key = 0;
+            memcpy(&key, batch[i].license, 6);
+            uint64_t *car = &bench_pool[(key * 0x9E3779B97F4A7C15ULL >> 20) % bench_cars];
+            *car = batch[i].ts;
+            bench_lat[got] = ts_now() - batch[i].ts;
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    bench_reads = argc > 1 ? atol(argv[1]) : 20000;
+    size_t pool_mb = argc > 2 ? atol(argv[2]) : 4;
+
+    ts_init();
+    place_init("lat_bench");
+    bench_rings = place_alloc("rings", sizeof(rings_t));
+    bench_cars = pool_mb * 1024 * 1024 / sizeof(uint64_t);
+    bench_pool = place_alloc("cars", bench_cars * sizeof(uint64_t));
+    bench_lat = malloc(bench_reads * sizeof(uint64_t));
+    if (bench_rings == NULL || bench_pool == NULL || bench_lat == NULL) {
+        fprintf(stderr, "lat_bench: out of memory\n");
+        return 1;
+    }
+    // as rings_open() would set the ring up
+    lpr_ring_t *r = &bench_rings->en[0];
+    r->bell_off = (char *)&bench_rings->bell - (char *)r;
+
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, consume, NULL);
+    place_thread(consumer, PLACE_DEVICE);
+    place_thread(pthread_self(), PLACE_DEVICE);
+
+    uint64_t rng = ts_now() | 1;
+    char plate[6];
+    for (long i = 0; i < bench_reads; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        memcpy(plate, &rng, 6);
+        lpr_ring_push(r, plate);
+        usleep(LAT_GAP_US);
+    }
+    pthread_join(consumer, NULL);
+    getrusage(RUSAGE_SELF, &after);
+
+    if (place_requested()) {
+        place_report(stdout);
+    }
+    qsort(bench_lat, bench_reads, sizeof(uint64_t), by_value);
+    printf("%ld reads, %zu MB of cars: p50 %.1f us \t p99 %.1f us \t p99.9 %.1f us \t max %.1f us\n", bench_reads, pool_mb,
+           bench_lat[bench_reads / 2] / 1e3, bench_lat[bench_reads * 99 / 100] / 1e3,
+           bench_lat[bench_reads * 999 / 1000] / 1e3, bench_lat[bench_reads - 1] / 1e3);
+    printf("page faults while running: %ld minor \t %ld major\n", after.ru_minflt - before.ru_minflt,
+           after.ru_majflt - before.ru_majflt);
+    return 0;
+}
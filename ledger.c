@@ -0,0 +1,140 @@
+#ifndef LEDGER_C
+#define LEDGER_C
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+/* ----------Ledger lines --------------*/
+// billing.txt has a line per car billed:
+//
+//     029MZH $12.50 entry=1760000000000 exit=1760000012345 level=2 gate=3
+//
+// the plate, the fee, then when the car came in and left in ms since the
+// epoch, the level it counted towards and the exit it left by (both from 1).
+// A car that stayed past the manager's limit has overstay= after those, the
+// ms it stayed over by.
+// Older ledgers have only the plate and the fee; their lines parse with the
+// rest left at 0. Fields after the fee can come in any order, and ones this
+// code does not know are skipped, so more can be added.
+
+#define LEDGER_LINE 128  // longer than any line ledger_format() writes
+#define LEDGER_CENTS 24  // longer than any fee ledger_cents() writes
+
+typedef struct ledger_rec {
+    char plate[7];  // NUL terminated
+    int64_t cents;
+    int64_t entry_ms;  // 0 if the line does not say
+    int64_t exit_ms;
+    int level;  // from 1, 0 if the line does not say
+    int gate;
+    int64_t overstay_ms;  // how long past the limit it stayed, 0 if it did not
+} ledger_rec_t;
+
+// Write a fee as the ledger does, "$12.50" or "$-12.50".
+// pre: size >= LEDGER_CENTS
+// post: return is its length
+int ledger_cents(char *buf, size_t size, int64_t cents) {
+    int64_t abs = cents < 0 ? -cents : cents;
+    return snprintf(buf, size, "$%s%" PRId64 ".%02" PRId64, cents < 0 ? "-" : "", abs / 100, abs % 100);
+}
+
+// Write the line for a bill, with its newline.
+// pre: size >= LEDGER_LINE
+// post: return is the line's length
+int ledger_format(char *buf, size_t size, const ledger_rec_t *r) {
+    char fee[LEDGER_CENTS];
+    ledger_cents(fee, sizeof(fee), r->cents);
+    int len = snprintf(buf, size, "%.6s %s entry=%" PRId64 " exit=%" PRId64 " level=%d gate=%d", r->plate, fee, r->entry_ms,
+                       r->exit_ms, r->level, r->gate);
+    if (r->overstay_ms > 0) {
+        len += snprintf(buf + len, size - len, " overstay=%" PRId64, r->overstay_ms);
+    }
+    return len + snprintf(buf + len, size - len, "\n");
+}
+
+// digits at *p as a number, moving *p past them
+// post: (return == false AND there were no digits or too many) OR *out is the number
+static inline bool ledger_digits(const char **p, const char *end, int64_t *out) {
+    const char *s = *p;
+    int64_t v = 0;
+    while (s < end && *s >= '0' && *s <= '9' && s - *p < 18) {
+        v = v * 10 + (*s++ - '0');
+    }
+    if (s == *p || (s < end && *s >= '0' && *s <= '9')) {
+        return false;
+    }
+    *p = s;
+    *out = v;
+    return true;
+}
+
+// Parse the line starting at p, without going past end.
+// pre: p < end
+// post: (return == NULL AND there is no newline before end, the line is not
+//       complete yet)
+//       OR (return is just past the line's newline AND
+//           ((*ok AND r is the line) OR (!*ok AND the line is not a bill)))
+const char *ledger_parse(const char *p, const char *end, ledger_rec_t *r, bool *ok) {
+    const char *nl = memchr(p, '\n', end - p);
+    if (nl == NULL) {
+        return NULL;
+    }
+    memset(r, 0, sizeof(ledger_rec_t));
+    *ok = false;
+
+    // the plate and the fee, "$" then digits, "." and exactly 2 digits
+    if (nl - p < 11 || p[6] != ' ' || p[7] != '$') {
+        return nl + 1;
+    }
+    memcpy(r->plate, p, 6);
+    const char *s = p + 8;
+    bool negative = *s == '-';
+    s += negative;
+    int64_t dollars, cents;
+    if (!ledger_digits(&s, nl, &dollars) || s == nl || *s != '.') {
+        return nl + 1;
+    }
+    const char *fraction = ++s;
+    if (!ledger_digits(&s, nl, &cents) || s - fraction != 2) {
+        return nl + 1;
+    }
+    r->cents = (dollars * 100 + cents) * (negative ? -1 : 1);
+
+    // then name=value fields
+    while (s < nl && *s == ' ') {
+        s++;
+        const char *eq = memchr(s, '=', nl - s);
+        const char *next = memchr(s, ' ', nl - s);
+        next = next != NULL ? next : nl;
+        if (eq == NULL || eq > next) {
+            return nl + 1;
+        }
+        int64_t v;
+        const char *num = eq + 1;
+        if (!ledger_digits(&num, next, &v) || num != next) {
+            s = next;  // not a number, not one of ours
+            continue;
+        }
+        size_t name = eq - s;
+        if (name == 5 && memcmp(s, "entry", 5) == 0) {
+            r->entry_ms = v;
+        } else if (name == 4 && memcmp(s, "exit", 4) == 0) {
+            r->exit_ms = v;
+        } else if (name == 5 && memcmp(s, "level", 5) == 0) {
+            r->level = v;
+        } else if (name == 4 && memcmp(s, "gate", 4) == 0) {
+            r->gate = v;
+        } else if (name == 8 && memcmp(s, "overstay", 8) == 0) {
+            r->overstay_ms = v;
+        }
+        s = next;
+    }
+    *ok = s == nl || *s == '\r';
+    return nl + 1;
+}
+/* ----------Ledger lines --------------*/
+
+#endif
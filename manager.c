@@ -1,12 +1,27 @@
+#define _GNU_SOURCE
 #include <math.h>
 #include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "hashtable.c"
+#include "tariff.c"
+#include "timestamp.c"
+#include "timerwheel.c"
+#include "aio.c"
+#include "metrics.c"
+#include "rings.c"
+#include "snapshot.c"
+#include "boomgate.c"
+#include "whitelist.c"
+#include "trace.c"
+#include "placement.c"
+#include "tsdb.c"
+#include "billidx.c"
 // global variables
 int alarm_active = 0;
 
@@ -26,6 +41,9 @@ info_sign_t *ist[5];
 // lv
 lv_t *lv[5];
 
+// plate reads from the lprs, see rings.c
+rings_t *rings;
+
 // attributes for mutex and cond
 pthread_mutexattr_t m_shared;
 pthread_condattr_t c_shared;
@@ -34,81 +52,380 @@ pthread_condattr_t c_shared;
 pthread_mutex_t mutex_display = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t cond_display = PTHREAD_COND_INITIALIZER;
 
+// scheduled actions, run by two timer wheel threads: wheel only lowers the
+// gates, slow_wheel runs the callbacks that take locks other threads (and
+// the simulator) hold, so waiting on those never holds a gate open
+#define GATE_OPEN_MS 20     // how long a gate stays open
+#define SIGN_HOLD_MS 1000   // how long the sign shows its answer
+#define DISPLAY_TICK_MS 50  // how often the status screen is drawn
+timer_wheel_t wheel;
+timer_wheel_t slow_wheel;
+typedef struct gate_timer {
+    tw_timer_t timer;
+    boomgate_t *bg;
+    uint16_t trace_dev;  // which gate, for the trace
+} gate_timer_t;
+gate_timer_t en_bg_timer[ENTRANCES];
+gate_timer_t ex_bg_timer[EXITS];
+tw_timer_t ist_timer[ENTRANCES];
+tw_timer_t display_timer;
+
+// output written in the background, see aio.c
+#define FRAME_SIZE 8192
+#define LEDGER_DRAIN_NS (10 * 1000000000ULL)  // how long exit waits for the last bills
+#define SCREEN_DRAIN_NS (1000000000ULL)        // and for the last frames
+aio_stream_t ledger;  // billing.txt
+billidx_t *bills;     // billing.idx, the ledger's visits by plate, see billidx.c
+aio_stream_t screen;  // the status display
+
 // mutex and cond for billing thread
 pthread_mutex_t mutex_bill = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t cond_bill = PTHREAD_COND_INITIALIZER;
 int num_bill_tasks = 0;
 bill_task_t *bill_tasks = NULL;
 bill_task_t *last_bill_tasks = NULL;
+unsigned long cars_billed = 0;  // guarded by mutex_bill
+
+// worker pool, see the reactor below
+#define BILL_BIT LPR_RINGS  // the billing queue's bit in the doorbell
+int workers = 0;            // 0 for a thread per device
+
+// plates allowed in, shared with the simulator, see whitelist.c
+whitelist_t *whitelist;
 
-// hash table
-htab_t h;          // for license plates
-htab_t h_billing;  // for billing
-htab_t h_lv[5];    // for levels
+pthread_mutex_t mutex_cars = PTHREAD_MUTEX_INITIALIZER;  // guards cars, see below
 
 // tracking numbers
 int total_cars = 0;
-double revenue = 0;
+int64_t revenue = 0;  // in cents
+
+// cars staying too long, see overstays below
+uint64_t overstay_ms;         // the limit, 0 for none
+int overstaying = 0;          // cars inside and flagged, guarded by mutex_cars
+unsigned long overstays = 0;  // cars ever flagged, guarded by mutex_cars
+
+// pricing rules, compiled from tariff.txt
+tariff_t tariff;
+
+// number of cars counted towards each level, only changed through the
+// level functions below
+int num_lv[5];
+
+// ---------------------- cars -----------------------------
+// The state of every car on the whitelist, by its plate number there (see
+// whitelist.c), so a plate is looked up once per read and everything after
+// that works on the number. Each field is an array of its own: a read only
+// touches the few words it changes, and a pass over the whole car park runs
+// straight down one array.
+
+enum { CAR_OUTSIDE = 0, CAR_INSIDE = 1 };
+
+typedef struct cars {
+    uint32_t n;
+    tw_timer_t *overstay;  // due when it has been inside for the overstay limit
+    uint64_t *entry_ts;    // monotonic ns, see timestamp.c
+    int8_t *assigned_lv;   // level it counts towards (0 based)
+    int8_t *current_lv;    // level an lpr last saw it on, -1 until then
+    uint8_t *status;       // CAR_OUTSIDE or CAR_INSIDE
+    uint8_t *overstayed;   // still inside past the limit
+} cars_t;
+
+cars_t cars;
+
+// Make room for the state of n cars, all outside, in one pool so it can go
+// on huge pages and be locked (see placement.c).
+// pre: place_init()
+// post: (return == false AND allocation failed) OR cars holds n cars
+bool cars_init(uint32_t n) {
+    char *pool = place_alloc("cars", (size_t)n * (sizeof(tw_timer_t) + sizeof(uint64_t) + 4) + 1);
+    if (pool == NULL) {
+        return false;
+    }
+    cars.n = n;
+    cars.overstay = (tw_timer_t *)pool;
+    cars.entry_ts = (uint64_t *)(pool + (size_t)n * sizeof(tw_timer_t));
+    cars.assigned_lv = (int8_t *)(cars.entry_ts + n);
+    cars.current_lv = cars.assigned_lv + n;
+    cars.status = (uint8_t *)(cars.current_lv + n);
+    cars.overstayed = cars.status + n;
+    return true;
+}
 
-// global for storing plates in hash tables
-char temp[6];
-char *license_plate[100];
+// count the cars inside with one pass over the status array, as a check on total_cars
+uint32_t cars_inside() {
+    uint32_t inside = 0;
+    for (uint32_t c = 0; c < cars.n; c++) {
+        inside += cars.status[c];
+    }
+    return inside;
+}
+// ---------------------- cars -----------------------------
+
+// ---------------------- levels -----------------------------
+// The counts are changed with atomic operations, so a car can be counted on,
+// moved between or taken off levels without a lock around the counts, and a
+// level never goes over MAX_CAPACITY however the lprs race each other.
+
+// take a place on a level if it has room
+// post: (return == true AND num_lv[lv] was < MAX_CAPACITY and is one more)
+//       OR (return == false AND num_lv[lv] is unchanged)
+bool level_reserve(int lv) {
+    int n = __atomic_load_n(&num_lv[lv], __ATOMIC_RELAXED);
+    while (n < MAX_CAPACITY) {
+        if (__atomic_compare_exchange_n(&num_lv[lv], &n, n + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return true;
+        }
+    }
+    return false;
+}
 
-int num_lv[5];  // this is global variable to store the number of cars on each level
+// give back a place on a level
+void level_release(int lv) {
+    __atomic_fetch_sub(&num_lv[lv], 1, __ATOMIC_ACQ_REL);
+}
 
-// initalize hash tables for storing plates from txt
-bool store_plates() {
-    htab_destroy(&h);
+// Assign an arriving car to a level, trying the levels in turn so the cars
+// are spread over them.
+// post: (return == -1 AND every level is full)
+//       OR (the car counts towards level return AND total_cars)
+int level_assign() {
+    static unsigned next_lv;
+    unsigned first = __atomic_fetch_add(&next_lv, 1, __ATOMIC_RELAXED);
+    for (int k = 0; k < LEVELS; k++) {
+        int lv = (first + k) % LEVELS;
+        if (level_reserve(lv)) {
+            __atomic_fetch_add(&total_cars, 1, __ATOMIC_RELAXED);
+            return lv;
+        }
+    }
+    return -1;
+}
 
-    // buckets
-    size_t buckets = 50;
-    int h_key = 0;
-    FILE *f = fopen("plates.txt", "r");
+// a car seen on level lv counts towards it from now on, if it has room
+// pre: mutex_cars is held AND car is inside
+void level_seen(uint32_t car, int lv) {
+    if (cars.assigned_lv[car] != lv && level_reserve(lv)) {
+        level_release(cars.assigned_lv[car]);
+        cars.assigned_lv[car] = lv;
+    }
+    cars.current_lv[car] = lv;
+}
 
-    // put value in hash tables
+// take a leaving car off its level
+// pre: mutex_cars is held AND car is inside
+void level_leave(uint32_t car) {
+    level_release(cars.assigned_lv[car]);
+    __atomic_fetch_sub(&total_cars, 1, __ATOMIC_RELAXED);
+}
+// ---------------------- levels -----------------------------
+
+// ---------------------- status -----------------------------
+// Every change below is published to the status snapshot (see snapshot.c),
+// which is what the display, the metrics and outside tools read.
+
+// publish one change, made to st
+#define PUBLISH(change)                \
+    do {                               \
+        status_t *st = status_begin(); \
+        change;                        \
+        status_publish();              \
+    } while (0)
+
+// copy the counts
+// pre: mutex_cars is held, so no car is half way through a move
+void status_counts(status_t *st) {
+    st->total_cars = __atomic_load_n(&total_cars, __ATOMIC_RELAXED);
+    for (int i = 0; i < LEVELS; i++) {
+        st->num_lv[i] = __atomic_load_n(&num_lv[i], __ATOMIC_RELAXED);
+    }
+    st->overstaying = overstaying;
+}
 
-    if (!htab_init(&h, buckets)) {
-        printf("failed to initialise hash table\n");
-        return EXIT_FAILURE;
+// copy what the gates, the sensors and the fire alarm write straight into the segment
+void status_devices(status_t *st) {
+    for (int i = 0; i < ENTRANCES; i++) {
+        st->en_gate[i] = en_bg[i]->s;
+    }
+    for (int i = 0; i < EXITS; i++) {
+        st->ex_gate[i] = ex_bg[i]->s;
     }
-    while (fgets(temp, 8, f)) {
-        // fputs(license_plate, stdout);
-        // printf(":%s\n", license_plate);
-        temp[strcspn(temp, "\n")] = 0;
-        license_plate[h_key] = malloc(7);
-        strcpy(license_plate[h_key], temp);
-        htab_add(&h, license_plate[h_key], h_key);
-        h_key++;
+    for (int i = 0; i < LEVELS; i++) {
+        st->temp[i] = lv[i]->temp;
+        st->alarm[i] = lv[i]->sign;
     }
-    fclose(f);
-    return EXIT_SUCCESS;
+    st->alarm_active = alarm_active;
+}
+// ---------------------- status -----------------------------
+
+// ---------------------- overstays -----------------------------
+// A car inside for longer than PARK_OVERSTAY_MS (OVERSTAY_MS by default, 0
+// for no limit) is flagged as overstaying. Each car has a timer on the wheel,
+// set when it comes in and cancelled when it leaves, so only the cars that
+// are due are looked at, never every car inside. The flag shows on the
+// display and in the metrics, and the car's line in the ledger says by how
+// much it went over.
+
+#define OVERSTAY_MS 8000
+
+void overstay_init() {
+    char *ms = getenv("PARK_OVERSTAY_MS");
+    int limit = ms != NULL ? atoi(ms) : OVERSTAY_MS;
+    overstay_ms = limit > 0 ? limit : 0;
 }
 
-// initialize a hash table for storing license plate of the parked car
-bool create_hash_table() {
-    // htab_destroy(&h_lv);
-    htab_destroy(&h_billing);
-    for (int i = 0; i < 5; i++) {
-        htab_destroy(&h_lv[i]);
+// timer wheel callback: a car may have been inside for the limit
+void overstay_due(void *arg) {
+    uint32_t car = (tw_timer_t *)arg - cars.overstay;
+    pthread_mutex_lock(&mutex_cars);
+    // it may have left, or left and come in again, since the wheel took the timer
+    uint64_t inside_ms = ts_elapsed_ns(cars.entry_ts[car]) / 1000000;
+    if (cars.status[car] == CAR_INSIDE && !cars.overstayed[car]) {
+        if (inside_ms < overstay_ms) {
+            // armed a little after the car was read, come back when it is due
+            tw_add(&slow_wheel, &cars.overstay[car], overstay_ms - inside_ms, 0, overstay_due, &cars.overstay[car]);
+        } else {
+            cars.overstayed[car] = 1;
+            overstaying++;
+            overstays++;
+            const char *plate = whitelist_plate(whitelist, car);
+            PUBLISH(st->overstaying = overstaying; st->overstays = overstays; memcpy(st->overstay_plate, plate, 6));
+            trace(TRACE_OVERSTAY, TRACE_NONE, plate, inside_ms);
+        }
     }
+    pthread_mutex_unlock(&mutex_cars);
+}
 
-    // buckets
-    size_t buckets = 50;  // one for each level
-    if (!htab_init(&h_billing, buckets)) {
-        printf("failed to initialise hash table\n");
-        return EXIT_FAILURE;
+// start timing a car that has just come in
+// pre: mutex_cars is held AND car is inside
+void overstay_watch(uint32_t car) {
+    cars.overstayed[car] = 0;
+    if (overstay_ms > 0) {
+        tw_add(&slow_wheel, &cars.overstay[car], overstay_ms, 0, overstay_due, &cars.overstay[car]);
     }
-    for (int i = 0; i < 5; i++) {
-        if (!htab_init(&h_lv[i], buckets)) {
-            printf("failed to initialise hash table\n");
-            return EXIT_FAILURE;
+}
+
+// stop timing a car that is leaving
+// pre: mutex_cars is held AND car is inside
+void overstay_leave(uint32_t car) {
+    if (overstay_ms > 0) {
+        tw_cancel(&slow_wheel, &cars.overstay[car]);
+    }
+    if (cars.overstayed[car]) {
+        overstaying--;
+    }
+}
+// ---------------------- overstays -----------------------------
+
+// ---------------------- history -----------------------------
+// Each level's occupancy and temperature, sampled every PARK_HISTORY_MS
+// (HISTORY_MS by default, 0 for none) into the history store named by
+// PARK_HISTORY (see tsdb.c); parkhist reads it back.
+
+#define HISTORY_MS 1000
+tsdb_t *history;
+int history_occupancy[LEVELS];
+int history_temp[LEVELS];
+tw_timer_t history_timer;
+unsigned long history_samples;
+uint64_t history_ns;  // spent sampling
+
+// timer wheel callback: take a sample of every series, or of none
+void history_tick(void *arg) {
+    uint64_t start = ts_now();
+    int64_t now = ts_to_wall_ms(start);
+    if (!tsdb_reserve(history, 2 * LEVELS)) {
+        return;  // the disk is full, try again next tick
+    }
+    for (int i = 0; i < LEVELS; i++) {
+        tsdb_append(history, history_occupancy[i], now, __atomic_load_n(&num_lv[i], __ATOMIC_RELAXED));
+        tsdb_append(history, history_temp[i], now, lv[i]->temp);
+    }
+    __atomic_add_fetch(&history_samples, 2 * LEVELS, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&history_ns, ts_elapsed_ns(start), __ATOMIC_RELAXED);
+}
+
+// Open the history store and start sampling.
+// pre: the timer wheel is running AND lv is set up
+// post: history_tick() runs every PARK_HISTORY_MS, unless that is 0 or the
+//       store could not be opened
+void history_start() {
+    char *ms = getenv("PARK_HISTORY_MS");
+    int period = ms != NULL ? atoi(ms) : HISTORY_MS;
+    char *path = getenv("PARK_HISTORY");
+    if (period <= 0 || (history = tsdb_open(path != NULL ? path : TSDB_FILE, true)) == NULL) {
+        return;
+    }
+    char name[TSDB_NAME];
+    for (int i = 0; i < LEVELS; i++) {
+        snprintf(name, sizeof(name), "occupancy %d", i + 1);
+        history_occupancy[i] = tsdb_series(history, name);
+        snprintf(name, sizeof(name), "temperature %d", i + 1);
+        history_temp[i] = tsdb_series(history, name);
+        if (history_occupancy[i] < 0 || history_temp[i] < 0) {
+            fprintf(stderr, "history: no room for more series\n");
+            tsdb_close(history);
+            history = NULL;
+            return;
         }
     }
-    // if (!htab_init(&h_lv, LEVELS)) {
-    //     printf("failed to initialise hash table\n");
-    //     return EXIT_FAILURE;
-    // }
-    return EXIT_SUCCESS;
+    tw_add(&slow_wheel, &history_timer, period, period, history_tick, NULL);
+}
+// ---------------------- history -----------------------------
+
+// timer wheel callback: lower a gate once the car has had time to pass
+void close_gate(void *arg) {
+    gate_timer_t *g = arg;
+    if (alarm_active) {
+        return;  // the gates stay open in an emergency
+    }
+    if (bg_set(g->bg, 'O', 'L')) {
+        trace(TRACE_GATE, g->trace_dev, NULL, 'O' << 8 | 'L');
+    } else if (g->bg->s == 'R') {
+        // still on its way up, try again shortly
+        tw_add(&wheel, &g->timer, 1, 0, close_gate, g);
+    }
+}
+
+// Raise a gate for a car, the timer wheel lowers it again afterwards.
+// A gate still up for the last car just stays up longer, one on its way
+// down has to close before it can go up again.
+void raise_gate(gate_timer_t *g) {
+    while (bg_wait(g->bg, "CRO") == 'C') {
+        if (bg_set(g->bg, 'C', 'R')) {
+            trace(TRACE_GATE, g->trace_dev, NULL, 'C' << 8 | 'R');
+            break;
+        }
+    }
+    bg_let_through(g->bg);
+    tw_add(&wheel, &g->timer, BG_TRAVEL_MS + GATE_OPEN_MS, 0, close_gate, g);
+}
+
+// timer wheel callback: blank the sign after it has shown its answer
+void reset_sign(void *arg) {
+    info_sign_t *sign = arg;
+    if (alarm_active) {
+        return;  // the fire alarm owns the signs
+    }
+    pthread_mutex_lock(&sign->m);
+    sign->s = ' ';
+    for (int i = 0; i < ENTRANCES; i++) {
+        if (ist[i] == sign) {
+            PUBLISH(st->sign[i] = ' ');
+        }
+    }
+    pthread_mutex_unlock(&sign->m);
+}
+
+// timer wheel callback: wake the display thread
+void display_tick(void *arg) {
+    // the sensors are sampled, and the cars inside counted, for each frame
+    pthread_mutex_lock(&mutex_cars);
+    int tracked = cars_inside();
+    pthread_mutex_unlock(&mutex_cars);
+    PUBLISH(status_devices(st); st->tracked_cars = tracked);
+    pthread_mutex_lock(&mutex_display);
+    pthread_cond_signal(&cond_display);
+    pthread_mutex_unlock(&mutex_display);
 }
 
 void *testing(void *arg) {
@@ -133,99 +450,88 @@ void *testing(void *arg) {
     }
 }
 
-// control the entrance lpr
+// handle a plate read at an entrance
+void entrance_read(int id, const lpr_event_t *ev) {
+    PUBLISH(memcpy(st->en_plate[id], ev->license, 6));
+    trace(TRACE_LPR, TRACE_DEV(TRACE_ENTRANCE, id), ev->license, ts_elapsed_ns(ev->ts));
+    int found_car = whitelist_find(whitelist, ev->license);
+    // check the if license is whitelist
+    if (found_car >= 0) {
+        // controling the ist
+        //  lock mutex
+        pthread_mutex_lock(&ist[id]->m);
+        // a plate that is already inside cannot come in again
+        pthread_mutex_lock(&mutex_cars);
+        int i = -2;
+        if (cars.status[found_car] == CAR_OUTSIDE) {
+            // find a level with room, the car counts towards it from now on
+            i = level_assign();
+            if (i >= 0) {
+                cars.entry_ts[found_car] = ev->ts;
+                cars.assigned_lv[found_car] = i;
+                cars.current_lv[found_car] = -1;
+                cars.status[found_car] = CAR_INSIDE;
+                overstay_watch(found_car);
+                PUBLISH(status_counts(st));
+            }
+        }
+        pthread_mutex_unlock(&mutex_cars);
+
+        if (i >= 0) {
+            ist[id]->s = i + 49;
+            PUBLISH(st->sign[id] = ist[id]->s);
+            trace(TRACE_SIGN, TRACE_DEV(TRACE_ENTRANCE, id), ev->license, ist[id]->s);
+            tw_add(&slow_wheel, &ist_timer[id], SIGN_HOLD_MS, 0, reset_sign, ist[id]);
+
+            // unlock the mutex of the ist
+            pthread_mutex_unlock(&ist[id]->m);
+            pthread_cond_signal(&ist[id]->c);
+
+            // control the bg
+            raise_gate(&en_bg_timer[id]);
+
+        } else {  // if full, or already inside
+            ist[id]->s = i == -1 ? 'F' : 'X';
+            PUBLISH(st->sign[id] = ist[id]->s);
+            trace(TRACE_SIGN, TRACE_DEV(TRACE_ENTRANCE, id), ev->license, ist[id]->s);
+            tw_add(&slow_wheel, &ist_timer[id], SIGN_HOLD_MS, 0, reset_sign, ist[id]);
+            // unlock the mutex of the ist
+            pthread_mutex_unlock(&ist[id]->m);
+            pthread_cond_signal(&ist[id]->c);
+        }
+    } else {
+        // printf("%s can not be parked!\n", lpr->license);
+        pthread_mutex_lock(&ist[id]->m);
+        ist[id]->s = 'X';
+        PUBLISH(st->sign[id] = 'X');
+        trace(TRACE_SIGN, TRACE_DEV(TRACE_ENTRANCE, id), ev->license, 'X');
+        tw_add(&slow_wheel, &ist_timer[id], SIGN_HOLD_MS, 0, reset_sign, ist[id]);
+        // unlock the mutex
+        pthread_mutex_unlock(&ist[id]->m);
+        pthread_cond_signal(&ist[id]->c);
+    }
+}
+
+// control the entrance lpr, taking its reads from the ring in batches
 void *control_entrance(void *arg) {
     int id = *((int *)arg);
+    lpr_event_t batch[LPR_BATCH];
 
     // printf("ENTRANCE CREATED!\n");
     for (;;) {
-        // lock mutex
-        pthread_mutex_lock(&en_lpr[id]->m);
-        // wait for the signal to start reading
-
-        pthread_cond_wait(&en_lpr[id]->c, &en_lpr[id]->m);
-        item_t *found_car = htab_find(&h, en_lpr[id]->license);
-        // check the if license is whitelist
-        if (found_car != NULL) {
-            // unlock the mutex
-            pthread_mutex_unlock(&en_lpr[id]->m);
-
-            // controling the ist
-            //  lock mutex
-            pthread_mutex_lock(&ist[id]->m);
-            // check number of cars in the park
-            if (total_cars <= 100) {
-                // update the status
-                int i = total_cars % 5;
-
-                // if the level is full, assign another level
-                while (num_lv[i] > 20) {
-                    if (i == 4) {
-                        i = 0;
-                    } else {
-                        i++;
-                    }
-                }
-                // check one more time so that the car park is not overloaded
-                if (total_cars > 100) {
-                    ist[id]->s = 'F';
-                    // unlock the mutex of the ist
-                    pthread_mutex_unlock(&ist[id]->m);
-                    pthread_cond_signal(&ist[id]->c);
-                    continue;
-                }
-                ist[id]->s = i + 49;
-
-                struct timeval start_time;
-                gettimeofday(&start_time, 0);
-                htab_add_billing(&h_billing, found_car->key, start_time);
-
-                // unlock the mutex of the ist
-                pthread_mutex_unlock(&ist[id]->m);
-                pthread_cond_signal(&ist[id]->c);
-
-                // control the bg
-                //   lock mutex
-                pthread_mutex_lock(&en_bg[id]->m);
-                // wait for the simulation done raising
-                pthread_cond_wait(&en_bg[id]->c, &en_bg[id]->m);
-                en_bg[id]->s = 'O';
-
-                // after fully opened, wait for 20 ms
-                usleep(20 * 1000);
-                // signal to lower the gates
-                pthread_cond_signal(&en_bg[id]->c);
-
-                // wait for the simulation done lowering
-                pthread_cond_wait(&en_bg[id]->c, &en_bg[id]->m);
-                en_bg[id]->s = 'C';
-                // unlock the mutex
-                pthread_mutex_unlock(&en_bg[id]->m);
-                pthread_cond_signal(&en_bg[id]->c);
-
-            } else {  // if full
-                ist[id]->s = 'F';
-                // unlock the mutex of the ist
-                pthread_mutex_unlock(&ist[id]->m);
-                pthread_cond_signal(&ist[id]->c);
-            }
-        } else {
-            // printf("%s can not be parked!\n", lpr->license);
-            // unlock the mutex
-            pthread_mutex_unlock(&en_lpr[id]->m);
-
-            pthread_mutex_lock(&en_bg[id]->m);
-            ist[id]->s = 'X';
-            // unlock the mutex
-            pthread_mutex_unlock(&en_bg[id]->m);
-            pthread_cond_signal(&ist[id]->c);
+        // wait for the lpr to read a plate
+        lpr_ring_wait(&rings->en[id]);
+        size_t n = lpr_ring_pop(&rings->en[id], batch, LPR_BATCH);
+        for (size_t k = 0; k < n; k++) {
+            entrance_read(id, &batch[k]);
         }
     }
 }
 
 // ---------------------- billing -----------------------------
 
-void add_bill_task(item_t *car) {
+// pre: mutex_cars is held AND car is inside AND it left by exit gate
+void add_bill_task(uint32_t car, uint64_t exit_ts, int gate) {
     bill_task_t *a_task;
     a_task = (bill_task_t *)malloc(sizeof(bill_task_t));
     if (!a_task) { /* malloc failed?? */
@@ -235,7 +541,13 @@ void add_bill_task(item_t *car) {
     /* lock the mutex, to assure exclusive access to the list */
     pthread_mutex_lock(&mutex_bill);
 
-    a_task->car = car;
+    strcpy(a_task->license, whitelist_plate(whitelist, car));
+    a_task->level = cars.assigned_lv[car];
+    a_task->entry_ts = cars.entry_ts[car];
+    a_task->exit_ts = exit_ts;
+    a_task->gate = gate;
+    a_task->overstayed = cars.overstayed[car];
+    a_task->next = NULL;
 
     /* add new car to the end of the list, updating list */
     /* pointers as required */
@@ -255,6 +567,9 @@ void add_bill_task(item_t *car) {
 
     /* signal the condition variable that the car is at the entrance */
     pthread_cond_signal(&cond_bill);
+    if (workers > 0) {
+        doorbell_ring(&rings->bell, BILL_BIT);
+    }
 }
 
 bill_task_t *get_bill() {
@@ -274,30 +589,33 @@ bill_task_t *get_bill() {
     return a_task;
 }
 
+// pre: mutex_bill is held, so the ledger and its index take lines in the same order
 void billing(bill_task_t *a_task) {
     // calculate the money
-    // open billing txt
-    FILE *fptr;
-    // billing.txt
-    fptr = fopen("billing.txt", "a");
-
-    item_t *car = a_task->car;
-
-    struct timeval start_time = car->start_time;
-    struct timeval current;
-    gettimeofday(&current, 0);
-    // bill
-    float bill = (floor((float)(current.tv_sec - start_time.tv_sec) * 1000.0f + (current.tv_usec - start_time.tv_usec) / 1000.0f)) * 0.05;
+    // the stay is measured on the monotonic clock, wall time only places it in the day
+    uint64_t entry_ms = ts_to_wall_ms(a_task->entry_ts);
+    uint64_t exit_ms = entry_ms + (a_task->exit_ts - a_task->entry_ts) / 1000000;
+    // bill in cents, at the rates of the level the car counted towards when it left
+    int64_t bill = tariff_fee(&tariff, a_task->level, entry_ms, exit_ms);
 
     revenue += bill;
-
-    // writing the license and the bill
-    fprintf(fptr, "%s $%.2f\n", car->key, bill);
-
-    // delete the car in h_billing after writing it out
-    htab_delete(&h_billing, car->key);
-
-    fclose(fptr);
+    cars_billed++;
+    PUBLISH(st->revenue = revenue);
+    trace(TRACE_BILL, TRACE_NONE, a_task->license, bill);
+
+    // writing the license, the bill and the visit to billing.txt, in the
+    // background, and the visit to the index straight away
+    ledger_rec_t rec = {.cents = bill, .entry_ms = entry_ms, .exit_ms = exit_ms, .level = a_task->level + 1, .gate = a_task->gate + 1};
+    memcpy(rec.plate, a_task->license, 6);
+    if (a_task->overstayed && exit_ms - entry_ms > overstay_ms) {
+        rec.overstay_ms = exit_ms - entry_ms - overstay_ms;
+    }
+    char line[LEDGER_LINE];
+    int len = ledger_format(line, sizeof(line), &rec);
+    int64_t offset = aio_write(&ledger, line, len);
+    if (bills != NULL && !billidx_add(bills, &rec, offset < 0 ? BILLIDX_NONE : (uint64_t)offset, len)) {
+        fprintf(stderr, "%s: no room, %s is not indexed\n", BILLIDX_FILE, rec.plate);
+    }
 }
 
 void *handle_billing(void *arg) {
@@ -322,172 +640,354 @@ void *handle_billing(void *arg) {
 
 // ---------------------- billing -----------------------------
 
-// control the exit lpr
+// handle a plate read at an exit
+void exit_read(int id, const lpr_event_t *ev) {
+    PUBLISH(memcpy(st->ex_plate[id], ev->license, 6));
+    trace(TRACE_LPR, TRACE_DEV(TRACE_EXIT, id), ev->license, ts_elapsed_ns(ev->ts));
+    // check the if license is whitelist
+    int car = whitelist_find(whitelist, ev->license);
+    if (car >= 0) {
+        // bill the car and take it off its level, if it came in
+        pthread_mutex_lock(&mutex_cars);
+        if (cars.status[car] == CAR_INSIDE) {
+            level_leave(car);
+            overstay_leave(car);
+            add_bill_task(car, ev->ts, id);
+            cars.status[car] = CAR_OUTSIDE;
+            PUBLISH(status_counts(st));
+        }
+        pthread_mutex_unlock(&mutex_cars);
+
+        // control the bg
+        raise_gate(&ex_bg_timer[id]);
+    }
+}
+
+// control the exit lpr, taking its reads from the ring in batches
 void *control_exit(void *arg) {
     int id = *((int *)arg);
+    lpr_event_t batch[LPR_BATCH];
 
     // printf("EXIT CREATED!\n");
-
     for (;;) {
-        // lock mutex
-        pthread_mutex_lock(&ex_lpr[id]->m);
-        // wait for the signal to start reading
-        pthread_cond_wait(&ex_lpr[id]->c, &ex_lpr[id]->m);
-
-        // check the if license is whitelist
-        item_t *found_car = htab_find(&h, ex_lpr[id]->license);
-        if (found_car != NULL) {
-            // printf("%s can be exited!\n", ex_lpr[id]->license);
-            // unlock the mutex
-            // get the car in h_billing
-            item_t *billing_car = htab_find(&h_billing, found_car->key);
-            add_bill_task(billing_car);
-            pthread_mutex_unlock(&ex_lpr[id]->m);
+        // wait for the lpr to read a plate
+        lpr_ring_wait(&rings->ex[id]);
+        size_t n = lpr_ring_pop(&rings->ex[id], batch, LPR_BATCH);
+        for (size_t k = 0; k < n; k++) {
+            exit_read(id, &batch[k]);
+        }
+    }
+}
 
-            // control the bg
-            pthread_cond_signal(&ex_bg[id]->c);
-            pthread_mutex_lock(&ex_bg[id]->m);
-            // printf("Exit %d: %c\n", id + 1, ex_bg[id]->s);
-            // while (ex_bg[id]->s == 'C') {
-            // wait for the simulation done raising
-            pthread_cond_wait(&ex_bg[id]->c, &ex_bg[id]->m);
-            // printf("Exit %d: %c\n", id + 1, ex_bg[id]->s);
-            ex_bg[id]->s = 'O';
-            // after fully opened, wait for 20 ms
-            usleep(20 * 1000);
-            // while (ex_bg[id]->s == 'O') {
-            pthread_cond_signal(&ex_bg[id]->c);
-            // }
-            // printf("Exit %d: %c\n", id + 1, ex_bg[id]->s);
-            // wait for the simulation done lowering
-            pthread_cond_wait(&ex_bg[id]->c, &ex_bg[id]->m);
-            ex_bg[id]->s = 'C';
-            // printf("Exit %d: %c\n", id + 1, ex_bg[id]->s);
-            pthread_cond_signal(&ex_bg[id]->c);
-            pthread_mutex_unlock(&ex_bg[id]->m);
-            // pthread_cond_signal(&ex_bg[id]->c);
-        } else {
-            // printf("%s can not be exited!", lpr->license);
-            // unlock the mutex
-            pthread_mutex_unlock(&ex_lpr[id]->m);
+// control the level lpr, taking its reads from the ring in batches
+// handle a batch of plate reads on a level
+// pre: 0 < n <= LPR_BATCH
+void level_reads(int id, const lpr_event_t *batch, size_t n) {
+    int car[LPR_BATCH];
+
+    // look the plates up before taking the lock, the whitelist never changes
+    for (size_t k = 0; k < n; k++) {
+        trace(TRACE_LPR, TRACE_DEV(TRACE_LEVEL, id), batch[k].license, ts_elapsed_ns(batch[k].ts));
+        car[k] = whitelist_find(whitelist, batch[k].license);
+    }
+
+    // a car not let in (or already gone) is not tracked, otherwise it
+    // moves to this level if there is room on it
+    pthread_mutex_lock(&mutex_cars);
+    for (size_t k = 0; k < n; k++) {
+        if (car[k] >= 0 && cars.status[car[k]] == CAR_INSIDE) {
+            level_seen(car[k], id);
         }
     }
+    PUBLISH(memcpy(st->lv_plate[id], batch[n - 1].license, 6); status_counts(st));
+    pthread_mutex_unlock(&mutex_cars);
 }
 
-// control the level lpr
 void *control_lv_lpr(void *arg) {
-    // struct LPR *lpr = arg;
     int id = *((int *)arg);
+    lpr_event_t batch[LPR_BATCH];
+
     // printf("LEVEL CREATED!\n");
     for (;;) {
-        // lock mutex
-        pthread_mutex_lock(&lv_lpr[id]->m);
-        // wait for the signal to start reading
-        pthread_cond_wait(&lv_lpr[id]->c, &lv_lpr[id]->m);
-
-        // printf("LEVEL HAS BEEN SIGNALED!\n");
-
-        // get the level of the car park
-        // int index = get_lv_lpr(lpr);
-        item_t *found_car = htab_find(&h, lv_lpr[id]->license);
-
-        // if the car is not in the car park, add it
-        if (htab_find(&h_lv[id], lv_lpr[id]->license) == NULL) {
-            // htab_add_level(&h_lv, found_car->key, id);
-            htab_add(&h_lv[id], found_car->key, 0);
-            total_cars++;
-            num_lv[id]++;
-            // htab_print(&h_lv);
-
-            // printf("CAR HAS BEEN PARKED!\n");
-            // htab_print(&h_billing);
-
-            // unlock the mutex
-            pthread_mutex_unlock(&lv_lpr[id]->m);
+        // wait for the lpr to read a plate
+        lpr_ring_wait(&rings->lv[id]);
+        size_t n = lpr_ring_pop(&rings->lv[id], batch, LPR_BATCH);
+        level_reads(id, batch, n);
+    }
+}
+
+// ---------------------- reactor -----------------------------
+// With PARK_WORKERS=N the manager runs a pool of N workers in place of the
+// threads per lpr, the billing threads and the alarm threads. Every source
+// of work has a bit in the rings' doorbell (see rings.c): the simulator
+// sets an lpr's bit when it pushes a read, and add_bill_task sets BILL_BIT.
+// A worker claims a bit, handles one batch from that source, and sets the
+// bit again if more is waiting. Only one worker handles a source at a time,
+// so each lpr's reads are still handled in order. The number of workers
+// does not depend on the number of devices. The main thread checks the
+// alarm flags instead, as it already wakes every millisecond.
+
+#define BILL_BATCH 16
+#define WORKERS_MAX 64
+
+int reactor_busy[BILL_BIT + 1];  // source claimed by a worker
+
+// bill up to max cars off the queue, as the billing threads do
+void bill_some(int max) {
+    pthread_mutex_lock(&mutex_bill);
+    for (int k = 0; k < max && num_bill_tasks > 0; k++) {
+        bill_task_t *a_task = get_bill();
+        billing(a_task);
+        free(a_task);
+    }
+    pthread_mutex_unlock(&mutex_bill);
+}
+
+// handle one batch from a source
+void reactor_handle(unsigned bit) {
+    lpr_event_t batch[LPR_BATCH];
+    size_t n;
+    if (bit < ENTRANCES) {
+        n = lpr_ring_pop(&rings->en[bit], batch, LPR_BATCH);
+        for (size_t k = 0; k < n; k++) {
+            entrance_read(bit, &batch[k]);
+        }
+    } else if (bit < ENTRANCES + EXITS) {
+        int id = bit - ENTRANCES;
+        n = lpr_ring_pop(&rings->ex[id], batch, LPR_BATCH);
+        for (size_t k = 0; k < n; k++) {
+            exit_read(id, &batch[k]);
+        }
+    } else if (bit < LPR_RINGS) {
+        int id = bit - ENTRANCES - EXITS;
+        n = lpr_ring_pop(&rings->lv[id], batch, LPR_BATCH);
+        if (n > 0) {
+            level_reads(id, batch, n);
+        }
+    } else {
+        bill_some(BILL_BATCH);
+    }
+}
+
+// whether a source has work waiting
+bool reactor_pending(unsigned bit) {
+    if (bit < ENTRANCES) {
+        return lpr_ring_depth(&rings->en[bit]) > 0;
+    } else if (bit < ENTRANCES + EXITS) {
+        return lpr_ring_depth(&rings->ex[bit - ENTRANCES]) > 0;
+    } else if (bit < LPR_RINGS) {
+        return lpr_ring_depth(&rings->lv[bit - ENTRANCES - EXITS]) > 0;
+    }
+    return __atomic_load_n(&num_bill_tasks, __ATOMIC_RELAXED) > 0;
+}
+
+void *reactor_worker(void *arg) {
+    unsigned next = 0;
+    for (;;) {
+        unsigned bit = doorbell_take(&rings->bell, &next);
+        int idle = 0;
+        if (bit > BILL_BIT || !__atomic_compare_exchange_n(&reactor_busy[bit], &idle, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+            // another worker has it, and looks again when it lets go
+            continue;
+        }
+        reactor_handle(bit);
+        __atomic_store_n(&reactor_busy[bit], 0, __ATOMIC_SEQ_CST);
+        if (reactor_pending(bit)) {
+            doorbell_ring(&rings->bell, bit);
         }
-        // else if
-        else {
-            // delete the car in h_lv
-            // htab_delete_level(&h_lv, found_car->key, id);
-            htab_delete(&h_lv[id], found_car->key);
-            num_lv[id]--;
-            total_cars--;
-            // htab_print(&h_lv);
-            // printf("CAR HAS BEEN EXITED!\n");
-            // unlock the mutex
-            pthread_mutex_unlock(&lv_lpr[id]->m);
+    }
+    return NULL;
+}
+
+// look for the fire alarm on every level
+void check_alarms() {
+    for (int i = 0; i < LEVELS; i++) {
+        if (lv[i]->sign == 1) {
+            alarm_active = 1;
         }
     }
 }
 
-// display the status and run in loop with 50ms sleep
+// context switches so far, for the metrics and the report on the way out
+void context_switches(long *voluntary, long *involuntary) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    *voluntary = ru.ru_nvcsw;
+    *involuntary = ru.ru_nivcsw;
+}
+// ---------------------- reactor -----------------------------
+
+// append to a status frame
+void frame_printf(char *frame, size_t *len, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(frame + *len, FRAME_SIZE - *len, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        *len += n;
+        if (*len >= FRAME_SIZE) {
+            *len = FRAME_SIZE - 1;
+        }
+    }
+}
+
+// display the status, drawn on every display tick
 void *display(void *arg) {
+    static char frame[FRAME_SIZE];
+    char stats[160];
+
     for (;;) {
-        system("clear");
-        // status of each lpr, bg and ist
+        // wait for the next tick from the timer wheel
         pthread_mutex_lock(&mutex_display);
+        pthread_cond_wait(&cond_display, &mutex_display);
 
-        // if (alarm_active) {
-        //     pthread_cond_wait(&cond_display, &mutex_display);
-        // }
+        // the frame is built in memory and written out in the background,
+        // starting with the escape codes that clear the screen
+        size_t len = 0;
+        frame_printf(frame, &len, "\033[H\033[2J");
 
-        printf("total cars: %d \t revenue:$%.2f", total_cars, revenue);
+        // status of each lpr, bg and ist, all from one snapshot
+        status_t st;
+        status_read(status_shared, &st);
+        frame_printf(frame, &len, "total cars: %d \t revenue:$%" PRId64 ".%02" PRId64, st.total_cars, st.revenue / 100, st.revenue % 100);
         for (int i = 0; i < 5; i++) {
-            printf("\n------------------------ \t\t\t\t\t\t\t  Car Park:\n");
-            printf("entrance %d status: lpr:%s \t boomgate: %c \t digital sign: %c \t", i + 1, en_lpr[i]->license, en_bg[i]->s, ist[i]->s);
-            printf(" \t ");
-            if (num_lv[i] > 0) {
-                for (int j = 0; j < num_lv[i] && j < 7; j++) {
-                    printf("|X");
+            frame_printf(frame, &len, "\n------------------------ \t\t\t\t\t\t\t  Car Park:\n");
+            frame_printf(frame, &len, "entrance %d status: lpr:%.6s \t boomgate: %c \t digital sign: %c \t", i + 1, st.en_plate[i], st.en_gate[i], st.sign[i]);
+            frame_printf(frame, &len, " \t ");
+            if (st.num_lv[i] > 0) {
+                for (int j = 0; j < st.num_lv[i] && j < 7; j++) {
+                    frame_printf(frame, &len, "|X");
                 }
-                printf("|");
+                frame_printf(frame, &len, "|");
             }
-            printf("\nexit %d status:     lpr:%s \t boomgate: %c \t \t \t \t \t ", i + 1, ex_lpr[i]->license, ex_bg[i]->s);
-            if (num_lv[i] > 7) {
-                for (int j = 7; j < num_lv[i] && j < 14; j++) {
-                    printf("|X");
+            frame_printf(frame, &len, "\nexit %d status:     lpr:%.6s \t boomgate: %c \t \t \t \t \t ", i + 1, st.ex_plate[i], st.ex_gate[i]);
+            if (st.num_lv[i] > 7) {
+                for (int j = 7; j < st.num_lv[i] && j < 14; j++) {
+                    frame_printf(frame, &len, "|X");
                 }
-                printf("|"); 
+                frame_printf(frame, &len, "|");
             }
-            printf("\nlevel %d status:    lpr:%s \t capacity: %d \t temp: %d°C \t alarm status: %d ", i + 1, lv_lpr[i]->license, num_lv[i], lv[i]->temp, lv[i]->sign);
-            if (num_lv[i] > 14){
-                for (int k = 14; k < num_lv[i]; k++) {
-                    printf("|X");
+            frame_printf(frame, &len, "\nlevel %d status:    lpr:%.6s \t capacity: %d \t temp: %d°C \t alarm status: %d ", i + 1, st.lv_plate[i], st.num_lv[i], st.temp[i], st.alarm[i]);
+            if (st.num_lv[i] > 14) {
+                for (int k = 14; k < st.num_lv[i]; k++) {
+                    frame_printf(frame, &len, "|X");
                 }
-                printf("|"); 
+                frame_printf(frame, &len, "|");
             }
-            printf("\n------------------------\n");
+            frame_printf(frame, &len, "\n------------------------\n");
         }
 
-        // htab_print(&h_billing);
+        frame_printf(frame, &len, "cars tracked inside: %d\n", st.tracked_cars);
+        if (overstay_ms > 0) {
+            frame_printf(frame, &len, "cars over the %.1f s limit: %d \t %lu in all", overstay_ms / 1e3, st.overstaying, st.overstays);
+            if (st.overstays > 0) {
+                frame_printf(frame, &len, " \t latest %.6s", st.overstay_plate);
+            }
+            frame_printf(frame, &len, "\n");
+        }
+
+        // how far behind the output is
+        aio_stats(&ledger, stats, sizeof(stats));
+        frame_printf(frame, &len, "%s\n", stats);
+        aio_stats(&screen, stats, sizeof(stats));
+        frame_printf(frame, &len, "%s\n", stats);
+
         pthread_mutex_unlock(&mutex_display);
-        usleep(50 * 1000);  // sleep for 50ms
+
+        aio_write(&screen, frame, len);
     }
 }
-// this is for emergency
-void *open_en_boomgate(void *arg) {
-    int id = *((int *)arg);
-    // printf("boomgate #%d is: %c\n", id, en_bg[id]->s);
-    for (;;) {
-        pthread_mutex_lock(&en_bg[id]->m);
-        pthread_cond_wait(&en_bg[id]->c, &en_bg[id]->m);
-        en_bg[id]->s = 'O';
-        // printf("boomgate #%d second is: %c\n", id, en_bg[id]->s);
-        pthread_mutex_unlock(&en_bg[id]->m);
-    }
+// a gate or sign state as a label value
+static char state_label(char s) {
+    return (s >= 32 && s < 127 && s != '"' && s != '\\') ? s : '?';
 }
 
-// this is for emergency
-void *open_ex_boomgate(void *arg) {
-    int id = *((int *)arg);
-    // printf("boomgate #%d is: %c\n", id, ex_bg[id]->s);
-    for (;;) {
-        pthread_mutex_lock(&ex_bg[id]->m);
-        pthread_cond_wait(&ex_bg[id]->c, &ex_bg[id]->m);
-        ex_bg[id]->s = 'O';
-        // printf("boomgate #%d second is: %c\n", id, ex_bg[id]->s);
-        pthread_mutex_unlock(&ex_bg[id]->m);
+// metrics in Prometheus text format, see metrics.c; reads the status snapshot
+// and queue depths, without any locks
+size_t collect_metrics(char *buf, size_t size) {
+    size_t len = 0;
+    status_t st;
+    status_read(status_shared, &st);
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+    metrics_printf(buf, size, &len, "# TYPE carpark_cars gauge\ncarpark_cars %d\n", st.total_cars);
+    metrics_printf(buf, size, &len, "# TYPE carpark_level_cars gauge\n");
+    for (int i = 0; i < LEVELS; i++) {
+        metrics_printf(buf, size, &len, "carpark_level_cars{level=\"%d\"} %d\n", i + 1, st.num_lv[i]);
+    }
+    metrics_printf(buf, size, &len, "# TYPE carpark_level_capacity gauge\n");
+    for (int i = 0; i < LEVELS; i++) {
+        metrics_printf(buf, size, &len, "carpark_level_capacity{level=\"%d\"} %d\n", i + 1, MAX_CAPACITY);
+    }
+    metrics_printf(buf, size, &len, "# TYPE carpark_revenue_cents_total counter\ncarpark_revenue_cents_total %" PRId64 "\n", st.revenue);
+
+    metrics_printf(buf, size, &len, "# TYPE carpark_gate_state gauge\n");
+    for (int i = 0; i < ENTRANCES; i++) {
+        metrics_printf(buf, size, &len, "carpark_gate_state{gate=\"entrance\",id=\"%d\",state=\"%c\"} 1\n", i + 1, state_label(st.en_gate[i]));
+    }
+    for (int i = 0; i < EXITS; i++) {
+        metrics_printf(buf, size, &len, "carpark_gate_state{gate=\"exit\",id=\"%d\",state=\"%c\"} 1\n", i + 1, state_label(st.ex_gate[i]));
+    }
+    metrics_printf(buf, size, &len, "# TYPE carpark_sign_state gauge\n");
+    for (int i = 0; i < ENTRANCES; i++) {
+        metrics_printf(buf, size, &len, "carpark_sign_state{id=\"%d\",state=\"%c\"} 1\n", i + 1, state_label(st.sign[i]));
+    }
+
+    metrics_printf(buf, size, &len, "# TYPE carpark_level_temperature_celsius gauge\n");
+    for (int i = 0; i < LEVELS; i++) {
+        metrics_printf(buf, size, &len, "carpark_level_temperature_celsius{level=\"%d\"} %d\n", i + 1, st.temp[i]);
+    }
+    metrics_printf(buf, size, &len, "# TYPE carpark_level_alarm gauge\n");
+    for (int i = 0; i < LEVELS; i++) {
+        metrics_printf(buf, size, &len, "carpark_level_alarm{level=\"%d\"} %d\n", i + 1, st.alarm[i]);
     }
+    metrics_printf(buf, size, &len, "# TYPE carpark_alarm_active gauge\ncarpark_alarm_active %d\n", st.alarm_active);
+
+    metrics_printf(buf, size, &len, "# TYPE carpark_lpr_queue_depth gauge\n");
+    for (int i = 0; i < ENTRANCES; i++) {
+        metrics_printf(buf, size, &len, "carpark_lpr_queue_depth{lpr=\"entrance\",id=\"%d\"} %u\n", i + 1, lpr_ring_depth(&rings->en[i]));
+    }
+    for (int i = 0; i < EXITS; i++) {
+        metrics_printf(buf, size, &len, "carpark_lpr_queue_depth{lpr=\"exit\",id=\"%d\"} %u\n", i + 1, lpr_ring_depth(&rings->ex[i]));
+    }
+    for (int i = 0; i < LEVELS; i++) {
+        metrics_printf(buf, size, &len, "carpark_lpr_queue_depth{lpr=\"level\",id=\"%d\"} %u\n", i + 1, lpr_ring_depth(&rings->lv[i]));
+    }
+    metrics_printf(buf, size, &len, "# TYPE carpark_lpr_full_total counter\n");
+    for (int i = 0; i < ENTRANCES; i++) {
+        metrics_printf(buf, size, &len, "carpark_lpr_full_total{lpr=\"entrance\",id=\"%d\"} %lu\n", i + 1, LOAD(rings->en[i].full));
+    }
+    for (int i = 0; i < EXITS; i++) {
+        metrics_printf(buf, size, &len, "carpark_lpr_full_total{lpr=\"exit\",id=\"%d\"} %lu\n", i + 1, LOAD(rings->ex[i].full));
+    }
+    for (int i = 0; i < LEVELS; i++) {
+        metrics_printf(buf, size, &len, "carpark_lpr_full_total{lpr=\"level\",id=\"%d\"} %lu\n", i + 1, LOAD(rings->lv[i].full));
+    }
+
+    metrics_printf(buf, size, &len, "# TYPE carpark_cars_tracked gauge\ncarpark_cars_tracked %d\n", st.tracked_cars);
+    metrics_printf(buf, size, &len, "# TYPE carpark_overstay_limit_seconds gauge\ncarpark_overstay_limit_seconds %.3f\n", overstay_ms / 1e3);
+    metrics_printf(buf, size, &len, "# TYPE carpark_cars_overstaying gauge\ncarpark_cars_overstaying %d\n", st.overstaying);
+    metrics_printf(buf, size, &len, "# TYPE carpark_overstays_total counter\ncarpark_overstays_total %lu\n", st.overstays);
+
+    metrics_printf(buf, size, &len, "# TYPE carpark_billing_queue_depth gauge\ncarpark_billing_queue_depth %d\n", LOAD(num_bill_tasks));
+    long voluntary, involuntary;
+    context_switches(&voluntary, &involuntary);
+    metrics_printf(buf, size, &len, "# TYPE carpark_manager_workers gauge\ncarpark_manager_workers %d\n", workers);
+    metrics_printf(buf, size, &len, "# TYPE carpark_context_switches_total counter\n");
+    metrics_printf(buf, size, &len, "carpark_context_switches_total{kind=\"voluntary\"} %ld\n", voluntary);
+    metrics_printf(buf, size, &len, "carpark_context_switches_total{kind=\"involuntary\"} %ld\n", involuntary);
+    metrics_printf(buf, size, &len, "# TYPE carpark_history_samples_total counter\ncarpark_history_samples_total %lu\n",
+                   LOAD(history_samples));
+    metrics_printf(buf, size, &len, "# TYPE carpark_history_bytes gauge\ncarpark_history_bytes %lu\n",
+                   history != NULL ? (unsigned long)tsdb_bytes(history) : 0UL);
+    metrics_printf(buf, size, &len, "# TYPE carpark_output_queue_depth gauge\n");
+    metrics_printf(buf, size, &len, "carpark_output_queue_depth{stream=\"ledger\"} %u\n", LOAD(ledger.depth));
+    metrics_printf(buf, size, &len, "carpark_output_queue_depth{stream=\"display\"} %u\n", LOAD(screen.depth));
+    metrics_printf(buf, size, &len, "# TYPE carpark_output_dropped_total counter\n");
+    metrics_printf(buf, size, &len, "carpark_output_dropped_total{stream=\"ledger\"} %lu\n", LOAD(ledger.dropped));
+    metrics_printf(buf, size, &len, "carpark_output_dropped_total{stream=\"display\"} %lu\n", LOAD(screen.dropped));
+#undef LOAD
+    return len;
 }
 
 void *check_temp(void *arg) {
@@ -507,8 +1007,6 @@ int main() {
     int en_id[ENTRANCES];
     int ex_id[EXITS];
     int lv_id[LEVELS];
-    int en_bg_id[ENTRANCES];
-    int ex_bg_id[EXITS];
 
     // threads for entrance
     pthread_t *entrance_threads;
@@ -523,19 +1021,51 @@ int main() {
     // thread for displaying
     pthread_t *display_thread;
 
+    // threads for the timer wheels
+    pthread_t wheel_thread;
+    pthread_t slow_wheel_thread;
+
     // thread for billing
     pthread_t *billing_thread;
 
     // for emergency
     pthread_t *check_temp_threads;
-    pthread_t *en_bg_threads;
-    pthread_t *ex_bg_threads;
 
-    // store plates from txt file
-    store_plates();
+    // pick the clock for entry and exit stamps
+    ts_init();
+    place_init("manager");
+    // threads started from here on inherit the display group's cpus, the
+    // device, billing and sensor threads are moved to theirs as they start
+    place_thread(pthread_self(), PLACE_DISPLAY);
+    trace_start("manager");
+
+    // a pool of workers instead of a thread per device?
+    char *pool = getenv("PARK_WORKERS");
+    if (pool != NULL) {
+        workers = atoi(pool);
+        workers = workers < 0 ? 0 : workers > WORKERS_MAX ? WORKERS_MAX : workers;
+    }
+
+    // map the plates from txt file, building the shared whitelist if no one has yet
+    whitelist = whitelist_open("plates.txt");
+    if (whitelist == NULL) {
+        exit(1);
+    }
+
+    // room for the state of every car that could come in
+    if (!cars_init(whitelist->count)) {
+        printf("failed to allocate the car state\n");
+        exit(1);
+    }
+
+    // how long a car can stay before it is flagged
+    overstay_init();
 
-    // init the hash for storing license plates of the parked car
-    create_hash_table();
+    // compile the pricing rules
+    if (!tariff_load(&tariff, "tariff.txt")) {
+        printf("failed to load tariff.txt, using the flat default rate\n");
+        tariff_default(&tariff);
+    }
 
     // create the segment
     shm_fd = shm_open(SHARE_NAME, O_CREAT | O_RDWR, S_IRWXU);
@@ -544,6 +1074,20 @@ int main() {
     // get the address and save it in the pointer
     ptr = (void *)mmap(0, SHARE_SIZE, PROT_WRITE | PROT_READ, MAP_SHARED, shm_fd, 0);
     // printf("%p\n", ptr);
+    // and the rings the simulation made next to it
+    rings = rings_open(false);
+    if (rings == NULL) {
+        exit(1);
+    }
+    // and the status snapshot for the display, metrics and tools
+    status_shm_t *status = status_open(true);
+    if (status == NULL) {
+        exit(1);
+    }
+    place_hot("PARKING", ptr, SHARE_SIZE, true);
+    place_hot(RINGS_NAME, rings, sizeof(rings_t), true);
+    place_hot(STATUS_NAME, status, sizeof(status_shm_t), true);
+    place_hot(WHITELIST_NAME, whitelist, whitelist->size, false);
 
     // create structure pthreads
     // create threads for entrances
@@ -564,6 +1108,28 @@ int main() {
     // 5 threads for checking the status of the temperature
     check_temp_threads = malloc(sizeof(pthread_t) * LEVELS);
 
+    // open the outputs, written in the background from here on
+    aio_init();
+    int ledger_fd = open("billing.txt", O_RDWR | O_CREAT, 0644);
+    if (ledger_fd < 0) {
+        perror("billing.txt");
+        exit(1);
+    }
+    // bring the index up to what the ledger has before anything is added to either
+    bills = billidx_open(BILLIDX_FILE, ledger_fd);
+    if (bills == NULL) {
+        fprintf(stderr, "%s: not kept this run, rebuild it with ./parkbills -R\n", BILLIDX_FILE);
+    }
+    // a bill is never dropped, a frame of the display can be
+    aio_open(&ledger, "ledger", ledger_fd, AIO_BLOCK);
+    aio_open(&screen, "display", STDOUT_FILENO, AIO_DROP);
+
+    // start the timer wheels before any thread schedules on them
+    tw_init(&wheel);
+    pthread_create(&wheel_thread, NULL, tw_run, &wheel);
+    tw_init(&slow_wheel);
+    pthread_create(&slow_wheel_thread, NULL, tw_run, &slow_wheel);
+
     // make sure the pthread mutex is sharable by creating attr
     pthread_mutexattr_init(&m_shared);
     pthread_mutexattr_setpshared(&m_shared, PTHREAD_PROCESS_SHARED);
@@ -596,56 +1162,87 @@ int main() {
 
         printf("\nCREATING #%d\n", i + 1);
 
-        // by default status is close
-        en_bg[i]->s = 'C';
-        ex_bg[i]->s = 'C';
+        // the gates start closed, the simulation set them up (see boomgate.c)
+        en_bg_timer[i].bg = en_bg[i];
+        en_bg_timer[i].trace_dev = TRACE_DEV(TRACE_ENTRANCE, i);
+        ex_bg_timer[i].bg = ex_bg[i];
+        ex_bg_timer[i].trace_dev = TRACE_DEV(TRACE_EXIT, i);
+        PUBLISH(st->sign[i] = ist[i]->s);
+
+        if (workers > 0) {
+            continue;  // the workers handle the devices, started below
+        }
 
         en_id[i] = i;
         // entrance threads
         pthread_create(entrance_threads + i, NULL, control_entrance, (void *)&en_id[i]);
+        place_thread(entrance_threads[i], PLACE_DEVICE);
 
         lv_id[i] = i;
         // lv threads
         pthread_create(lv_lpr_threads + i, NULL, control_lv_lpr, (void *)&lv_id[i]);
+        place_thread(lv_lpr_threads[i], PLACE_DEVICE);
 
         ex_id[i] = i;
         // exits threads
         pthread_create(exit_threads + i, NULL, control_exit, (void *)&ex_id[i]);
         pthread_create(billing_thread + i, NULL, handle_billing, NULL);
+        place_thread(exit_threads[i], PLACE_DEVICE);
+        place_thread(billing_thread[i], PLACE_BILLING);
 
         pthread_create(check_temp_threads + i, NULL, check_temp, (void *)&i);
+        place_thread(check_temp_threads[i], PLACE_SENSOR);
+    }
+
+    if (workers > 0) {
+        pthread_t worker;
+        for (int i = 0; i < workers; i++) {
+            pthread_create(&worker, NULL, reactor_worker, NULL);
+            place_thread(worker, PLACE_DEVICE);
+        }
+        // reads and bills that came in before the workers started
+        for (unsigned bit = 0; bit <= BILL_BIT; bit++) {
+            if (reactor_pending(bit)) {
+                doorbell_ring(&rings->bell, bit);
+            }
+        }
     }
 
     display_thread = malloc(sizeof(pthread_t));
     pthread_cond_init(&cond_display, &c_shared);
     pthread_create(display_thread, NULL, display, NULL);
+    tw_add(&slow_wheel, &display_timer, DISPLAY_TICK_MS, DISPLAY_TICK_MS, display_tick, NULL);
+    history_start();
+
+    // serve the metrics once the segment is mapped
+    metrics_start(collect_metrics);
+    if (place_requested()) {
+        place_report(stdout);
+    }
 
     *(char *)(ptr + 2919) = 0;
     // wait until the manager change the process of then we can stop the manager
 
     while ((*(char *)(ptr + 2919)) == 0) {
+        if (workers > 0) {
+            check_alarms();
+        }
         if (alarm_active) {
             fprintf(stderr, "*** ALARM ACTIVE ***\n");
+            trace(TRACE_ALARM, TRACE_NONE, NULL, 0);
             break;
         }
         usleep(1000);
     };
 
-    if (alarm_active){
-        en_bg_threads = malloc(sizeof(pthread_t) * ENTRANCES);
+    if (alarm_active) {
+        // open every gate, they are no longer lowered from here on
         for (int i = 0; i < ENTRANCES; i++) {
-            en_bg_id[i] = i;
-            printf("%d\n", en_bg_id[i]);
-            pthread_create(en_bg_threads + i, NULL, open_en_boomgate, (void *)&en_bg_id[i]);
+            bg_emergency_open(en_bg[i]);
         }
-
-        ex_bg_threads = malloc(sizeof(pthread_t) * ENTRANCES);
         for (int i = 0; i < EXITS; i++) {
-            ex_bg_id[i] = i;
-            printf("%d\n", en_bg_id[i]);
-            pthread_create(ex_bg_threads + i, NULL, open_ex_boomgate, (void *)&ex_bg_id[i]);
+            bg_emergency_open(ex_bg[i]);
         }
-
     }
 
 
@@ -660,14 +1257,47 @@ int main() {
     free(billing_thread);
     free(display_thread);
 
-    // destroy hash tables
-    htab_destroy(&h);
-    // htab_destroy(&h_lv);
-    htab_destroy(&h_billing);
-    for (int i = 0; i < 5; i++) {
-        htab_destroy(&h_lv[i]);
+    // how the threads got on
+    long voluntary, involuntary;
+    context_switches(&voluntary, &involuntary);
+    pthread_mutex_lock(&mutex_bill);
+    unsigned long billed = cars_billed;
+    pthread_mutex_unlock(&mutex_bill);
+    fprintf(stderr, "manager: %s \t %ld voluntary + %ld involuntary context switches \t %lu cars billed (%.1f per car)\n",
+            workers > 0 ? "worker pool" : "thread per device", voluntary, involuntary, billed,
+            billed > 0 ? (double)(voluntary + involuntary) / billed : 0.0);
+
+    // who stayed too long
+    if (overstay_ms > 0) {
+        pthread_mutex_lock(&mutex_cars);
+        fprintf(stderr, "manager: %lu cars stayed past the %.1f s limit, %d of them still inside\n", overstays, overstay_ms / 1e3,
+                overstaying);
+        pthread_mutex_unlock(&mutex_cars);
+    }
+
+    // what the history cost
+    if (history != NULL) {
+        tw_cancel(&slow_wheel, &history_timer);
+        unsigned long samples = __atomic_load_n(&history_samples, __ATOMIC_RELAXED);
+        uint64_t ns = __atomic_load_n(&history_ns, __ATOMIC_RELAXED);
+        fprintf(stderr, "manager: %lu history samples \t %.0f ns per sample \t %lu bytes in %s\n", samples,
+                samples > 0 ? (double)ns / samples : 0.0, (unsigned long)tsdb_bytes(history),
+                getenv("PARK_HISTORY") != NULL ? getenv("PARK_HISTORY") : TSDB_FILE);
+    }
+
+    // write out the bills still queued before the index that points at them
+    // is closed, billing stops here
+    pthread_mutex_lock(&mutex_bill);
+    if (!aio_drain(&ledger, LEDGER_DRAIN_NS)) {
+        fprintf(stderr, "manager: billing.txt is missing its last bills, %s will be rebuilt\n", BILLIDX_FILE);
+    }
+    if (bills != NULL) {
+        billidx_close(bills);
+        bills = NULL;
     }
+    aio_drain(&screen, SCREEN_DRAIN_NS);
 
-    // htab_destroy(&h_billing);
+    // keep whatever was traced
+    trace_flush();
     return 0;
 }
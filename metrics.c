@@ -0,0 +1,151 @@
+#ifndef METRICS_C
+#define METRICS_C
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* ----------Metrics exporter --------------*/
+// Serves the manager's metrics in Prometheus text format on a Unix domain
+// socket. A client that sends an HTTP GET gets an HTTP response, anything
+// else (e.g. socat - UNIX-CONNECT:/tmp/carpark.sock) gets the bare text.
+// If the socket cannot be bound the metrics are written to a file every
+// second instead, for a textfile collector to pick up.
+//
+// The text comes from a callback that must only read lock-free state, so a
+// scrape never waits on (or holds up) the car park's own locks.
+
+#define METRICS_SIZE 16384
+#define METRICS_SOCKET "/tmp/carpark.sock"
+#define METRICS_FILE "carpark.prom"
+#define METRICS_FILE_PERIOD_US (1000 * 1000)
+
+// writes the metrics into buf, returns the length
+typedef size_t (*metrics_fn)(char *buf, size_t size);
+
+static metrics_fn metrics_collect;
+static char metrics_path[108];
+
+// append to a metrics buffer
+void metrics_printf(char *buf, size_t size, size_t *len, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        *len += n;
+        if (*len >= size) {
+            *len = size - 1;
+        }
+    }
+}
+
+static void metrics_send(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void metrics_serve(int client, char *buf) {
+    char request[256];
+    struct pollfd p = {client, POLLIN, 0};
+    ssize_t n = 0;
+
+    // give an HTTP client a moment to send its request line
+    if (poll(&p, 1, 10) > 0) {
+        n = read(client, request, sizeof(request) - 1);
+    }
+    size_t len = metrics_collect(buf, METRICS_SIZE);
+    if (n >= 4 && strncmp(request, "GET ", 4) == 0) {
+        char header[128];
+        int h = snprintf(header, sizeof(header),
+                         "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+        metrics_send(client, header, h);
+    }
+    metrics_send(client, buf, len);
+}
+
+// fallback: rewrite the metrics file, atomically so a reader never sees half of it
+static void *metrics_file_run(void *arg) {
+    static char buf[METRICS_SIZE];
+    char tmp[sizeof(METRICS_FILE) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", METRICS_FILE);
+
+    for (;;) {
+        size_t len = metrics_collect(buf, METRICS_SIZE);
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0) {
+            metrics_send(fd, buf, len);
+            close(fd);
+            rename(tmp, METRICS_FILE);
+        }
+        usleep(METRICS_FILE_PERIOD_US);
+    }
+    return NULL;
+}
+
+static void *metrics_socket_run(void *arg) {
+    static char buf[METRICS_SIZE];
+    int server = *((int *)arg);
+
+    for (;;) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            continue;
+        }
+        metrics_serve(client, buf);
+        close(client);
+    }
+    return NULL;
+}
+
+// Start the exporter thread.
+// pre: collect only reads lock-free state
+// post: metrics are served on PARK_METRICS_SOCK (default METRICS_SOCKET),
+//       or written to METRICS_FILE if the socket cannot be used
+void metrics_start(metrics_fn collect) {
+    static int server;
+    struct sockaddr_un addr;
+    pthread_t thread;
+    char *path = getenv("PARK_METRICS_SOCK");
+
+    metrics_collect = collect;
+    snprintf(metrics_path, sizeof(metrics_path), "%s", path ? path : METRICS_SOCKET);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", metrics_path);
+
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(metrics_path);  // left behind by an earlier run
+    if (server >= 0 && bind(server, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(server, 8) == 0) {
+        pthread_create(&thread, NULL, metrics_socket_run, &server);
+        return;
+    }
+
+    fprintf(stderr, "metrics: cannot listen on %s (%s), writing %s instead\n", metrics_path, strerror(errno), METRICS_FILE);
+    if (server >= 0) {
+        close(server);
+    }
+    pthread_create(&thread, NULL, metrics_file_run, NULL);
+}
+/* ----------Metrics exporter --------------*/
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timestamp.c"
+#include "billidx.c"
+
+// Look up a plate's visits and what it paid through the billing index (see
+// billidx.c), check them against the ledger with -v, or build the index again
+// from the ledger with -R while the manager is not running.
+
+void usage() {
+    printf("Usage: ./parkbills [-i INDEX] [-l LEDGER] [-R] [-v] PLATE ...\n");
+    printf("  -i INDEX   use INDEX instead of %s\n", BILLIDX_FILE);
+    printf("  -l LEDGER  use LEDGER instead of billing.txt\n");
+    printf("  -R         build the index again from the ledger first\n");
+    printf("  -v         check each visit against its line in the ledger\n");
+    printf("  PLATE      print the plate's visits, oldest first, and totals\n");
+    printf("With no PLATE, print how much the index holds.\n");
+    exit(1);
+}
+
+void print_time(int64_t ms) {
+    if (ms == 0) {
+        printf("%-23s", "-");
+        return;
+    }
+    time_t sec = ms / 1000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%03d", buf, (int)(ms % 1000));
+}
+
+// whether the ledger's line for v says what v does
+bool matches(int ledger_fd, const billidx_visit_t *v) {
+    char line[LEDGER_LINE];
+    if (v->offset == BILLIDX_NONE || v->len > sizeof(line) || pread(ledger_fd, line, v->len, v->offset) != v->len) {
+        return false;
+    }
+    ledger_rec_t r;
+    bool ok;
+    return ledger_parse(line, line + v->len, &r, &ok) == line + v->len && ok && billidx_key(r.plate) == v->plate &&
+           r.cents == v->cents && r.entry_ms == v->entry_ms && r.exit_ms == v->exit_ms;
+}
+
+void print_plate(const billidx_t *idx, const char *plate, int ledger_fd) {
+    uint64_t start = ts_now();
+    // newest first through the index, printed the other way round
+    size_t n = 0, cap = 16;
+    const billidx_visit_t **visits = malloc(cap * sizeof(*visits));
+    for (const billidx_visit_t *v = billidx_find(idx, plate); v != NULL && visits != NULL; v = billidx_prev(idx, v)) {
+        if (n == cap) {
+            cap *= 2;
+            visits = realloc(visits, cap * sizeof(*visits));
+        }
+        if (visits != NULL) {
+            visits[n++] = v;
+        }
+    }
+    double lookup_ms = ts_elapsed_ns(start) / 1e6;
+    if (visits == NULL) {
+        fprintf(stderr, "parkbills: out of memory\n");
+        exit(1);
+    }
+
+    int64_t total = 0, stayed = 0;
+    unsigned long bad = 0;
+    for (size_t k = n; k-- > 0;) {
+        const billidx_visit_t *v = visits[k];
+        printf("%.6s  in ", plate);
+        print_time(v->entry_ms);
+        printf("  out ");
+        print_time(v->exit_ms);
+        char fee[LEDGER_CENTS];
+        ledger_cents(fee, sizeof(fee), v->cents);
+        printf("  level %d  exit %d  %s", v->level, v->gate, fee);
+        if (v->offset == BILLIDX_NONE) {
+            printf("  (not in the ledger)");
+        } else if (ledger_fd >= 0 && !matches(ledger_fd, v)) {
+            printf("  (ledger at %" PRIu64 " does not match)", v->offset);
+            bad++;
+        }
+        printf("\n");
+        total += v->cents;
+        stayed += v->exit_ms > v->entry_ms ? v->exit_ms - v->entry_ms : 0;
+    }
+    char fee[LEDGER_CENTS];
+    ledger_cents(fee, sizeof(fee), total);
+    printf("%.6s: %zu visits \t %s \t %.1f s parked \t found in %.3f ms", plate, n, fee, stayed / 1e3, lookup_ms);
+    if (ledger_fd >= 0) {
+        printf(" \t %lu not matching the ledger", bad);
+    }
+    printf("\n");
+    free(visits);
+}
+
+int main(int argc, char *argv[]) {
+    const char *index_path = BILLIDX_FILE;
+    const char *ledger_path = "billing.txt";
+    bool rebuild = false, verify = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:l:Rv")) != -1) {
+        switch (opt) {
+        case 'i':
+            index_path = optarg;
+            break;
+        case 'l':
+            ledger_path = optarg;
+            break;
+        case 'R':
+            rebuild = true;
+            break;
+        case 'v':
+            verify = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    ts_init();
+
+    int ledger_fd = -1;
+    if (rebuild || verify) {
+        ledger_fd = open(ledger_path, O_RDONLY);
+        if (ledger_fd < 0) {
+            perror(ledger_path);
+            return 1;
+        }
+    }
+    if (rebuild) {
+        uint64_t start = ts_now();
+        unlink(index_path);
+        billidx_t *idx = billidx_open(index_path, ledger_fd);
+        if (idx == NULL) {
+            return 1;
+        }
+        printf("%s: %" PRIu64 " visits of %u plates from %" PRIu64 " bytes of %s in %.1f ms\n", index_path, idx->header->visits,
+               idx->header->plates, idx->header->ledger_end, ledger_path, ts_elapsed_ns(start) / 1e6);
+        billidx_close(idx);
+    }
+
+    billidx_t *idx = billidx_read(index_path);
+    if (idx == NULL) {
+        return 1;
+    }
+    if (optind == argc && !rebuild) {
+        printf("%s: %" PRIu64 " visits of %u plates \t %u slots \t covers %" PRIu64 " bytes of the ledger\n", index_path,
+               idx->header->visits, idx->header->plates, idx->header->slots, idx->header->ledger_end);
+    }
+    for (int i = optind; i < argc; i++) {
+        if (strlen(argv[i]) != 6) {
+            printf("%s: not a plate\n", argv[i]);
+            continue;
+        }
+        print_plate(idx, argv[i], verify ? ledger_fd : -1);
+    }
+    billidx_close(idx);
+    return 0;
+}
@@ -0,0 +1,176 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tsdb.c"
+
+// Read the occupancy and temperature history the manager keeps (see tsdb.c):
+// the min, max and average of each series per minute (or per -b seconds),
+// the samples themselves with -r, or how much room each series takes with -i.
+
+#define MONTH_S (30 * 24 * 3600)
+
+void usage() {
+    printf("Usage: ./parkhist [-f FILE] [-s SERIES] [-F FROM] [-T TO] [-L SECONDS] [-b SECONDS] [-r] [-i]\n");
+    printf("  -f FILE     read FILE instead of %s\n", TSDB_FILE);
+    printf("  -s SERIES   only series whose name starts with SERIES, e.g. \"temperature 3\"\n");
+    printf("  -F FROM     from FROM, in seconds since the epoch\n");
+    printf("  -T TO       up to TO, in seconds since the epoch\n");
+    printf("  -L SECONDS  only the last SECONDS\n");
+    printf("  -b SECONDS  min, max and average per SECONDS (60 by default)\n");
+    printf("  -r          every sample instead\n");
+    printf("  -i          samples, blocks and bytes per series, and what a month of each would take\n");
+    exit(1);
+}
+
+void print_time(int64_t ms) {
+    time_t sec = ms / 1000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%s.%03d", buf, (int)(ms % 1000));
+}
+
+// per series sizes, and a month at the rate and compression seen so far
+void print_info(const tsdb_t *db) {
+    const tsdb_header_t *h = db->header;
+    uint64_t blocks = tsdb_blocks(db);
+    printf("%-16s %10s %8s %10s %12s %14s\n", "series", "samples", "blocks", "bytes", "bits/sample", "month (bytes)");
+    for (uint32_t s = 0; s < h->nseries; s++) {
+        uint64_t samples = 0, bits = 0, n = 0;
+        int64_t first = INT64_MAX, last = INT64_MIN;
+        for (uint64_t i = 1; i < blocks; i++) {
+            const tsdb_block_t *b = tsdb_block(db, i);
+            if (b->series != s) {
+                continue;
+            }
+            uint32_t count = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+            samples += count;
+            bits += b->bits + offsetof(tsdb_block_t, data) * 8;  // the header's fields count too
+            first = b->first_ts < first ? b->first_ts : first;
+            last = b->last_ts > last ? b->last_ts : last;
+            n++;
+        }
+        double per_sample = samples > 0 ? (double)bits / samples : 0;
+        double rate = last > first ? (samples - 1) * 1000.0 / (last - first) : 0;
+        printf("%-16.*s %10lu %8lu %10lu %12.2f %14.0f\n", TSDB_NAME, h->series[s], (unsigned long)samples, (unsigned long)n,
+               (unsigned long)(n * TSDB_BLOCK), per_sample, rate * MONTH_S * per_sample / 8);
+    }
+    printf("%lu bytes in use of %lu\n", (unsigned long)(blocks * TSDB_BLOCK), (unsigned long)(db->file_blocks * TSDB_BLOCK));
+}
+
+typedef struct bucket {
+    int64_t start;
+    int64_t min, max, sum;
+    long n;
+} bucket_t;
+
+void print_bucket(const char *name, const bucket_t *k) {
+    if (k->n == 0) {
+        return;
+    }
+    printf("%-16.*s ", TSDB_NAME, name);
+    print_time(k->start);
+    printf("  min %5ld  max %5ld  avg %8.2f  (%ld samples)\n", (long)k->min, (long)k->max, (double)k->sum / k->n, k->n);
+}
+
+// every sample of a series between from and to, raw or in buckets
+void scan(const tsdb_t *db, uint32_t s, int64_t from, int64_t to, int64_t bucket_ms, bool raw) {
+    const char *name = db->header->series[s];
+    uint64_t blocks = tsdb_blocks(db);
+    bucket_t k = {0};
+    for (uint64_t i = 1; i < blocks; i++) {
+        const tsdb_block_t *b = tsdb_block(db, i);
+        // a block's times only go forward, so most can be skipped on their header
+        if (b->series != s || b->last_ts < from || b->first_ts > to) {
+            continue;
+        }
+        tsdb_cursor_t c;
+        tsdb_cursor(&c, b);
+        int64_t ts, v;
+        while (tsdb_next(&c, &ts, &v)) {
+            if (ts < from || ts > to) {
+                continue;
+            }
+            if (raw) {
+                printf("%-16.*s ", TSDB_NAME, name);
+                print_time(ts);
+                printf("  %ld\n", (long)v);
+                continue;
+            }
+            int64_t start = ts - ((ts % bucket_ms) + bucket_ms) % bucket_ms;
+            if (k.n == 0 || start != k.start) {
+                print_bucket(name, &k);
+                k = (bucket_t){start, v, v, 0, 0};
+            }
+            k.min = v < k.min ? v : k.min;
+            k.max = v > k.max ? v : k.max;
+            k.sum += v;
+            k.n++;
+        }
+    }
+    print_bucket(name, &k);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = TSDB_FILE;
+    const char *prefix = "";
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    int64_t bucket_ms = 60000;
+    bool raw = false, info = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:s:F:T:L:b:ri")) != -1) {
+        switch (opt) {
+        case 'f':
+            path = optarg;
+            break;
+        case 's':
+            prefix = optarg;
+            break;
+        case 'F':
+            from = atoll(optarg) * 1000;
+            break;
+        case 'T':
+            to = atoll(optarg) * 1000;
+            break;
+        case 'L':
+            from = (int64_t)time(NULL) * 1000 - atoll(optarg) * 1000;
+            break;
+        case 'b':
+            bucket_ms = atoll(optarg) * 1000;
+            if (bucket_ms <= 0) {
+                usage();
+            }
+            break;
+        case 'r':
+            raw = true;
+            break;
+        case 'i':
+            info = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    tsdb_t *db = tsdb_open(path, false);
+    if (db == NULL) {
+        return 1;
+    }
+    if (info) {
+        print_info(db);
+    } else {
+        uint32_t nseries = __atomic_load_n(&db->header->nseries, __ATOMIC_ACQUIRE);
+        for (uint32_t s = 0; s < nseries; s++) {
+            if (strncmp(db->header->series[s], prefix, strlen(prefix)) == 0) {
+                scan(db, s, from, to, bucket_ms, raw);
+            }
+        }
+    }
+    tsdb_close(db);
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "timestamp.c"
+#include "whitelist.c"
+
+// Build the shared whitelist ahead of the car park, check plates against it,
+// or remove it. The manager and simulator build it themselves if it is
+// missing, so this is only needed to pay the cost up front or to start over.
+
+void usage() {
+    printf("Usage: ./parkplates [-f PLATES_FILE] [-u] [PLATE ...]\n");
+    printf("  -f FILE  build from FILE instead of plates.txt\n");
+    printf("  -u       remove the whitelist segment and exit\n");
+    printf("  PLATE    print the number of each PLATE on the whitelist, or -1\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = "plates.txt";
+    int opt;
+    while ((opt = getopt(argc, argv, "f:u")) != -1) {
+        switch (opt) {
+        case 'f':
+            path = optarg;
+            break;
+        case 'u':
+            if (shm_unlink(WHITELIST_NAME) != 0) {
+                perror(WHITELIST_NAME);
+                return 1;
+            }
+            return 0;
+        default:
+            usage();
+        }
+    }
+
+    ts_init();
+    uint64_t start = ts_now();
+    whitelist_t *w = whitelist_open(path);
+    if (w == NULL) {
+        return 1;
+    }
+    printf("%s: %u plates \t %u slots \t %lu bytes \t mapped in %.3f ms\n", WHITELIST_NAME, w->count, w->slots,
+           (unsigned long)w->size, (ts_now() - start) / 1e6);
+
+    for (int i = optind; i < argc; i++) {
+        if (strlen(argv[i]) != 6) {
+            printf("%s: not a plate\n", argv[i]);
+            continue;
+        }
+        printf("%s %d\n", argv[i], whitelist_find(w, argv[i]));
+    }
+    return 0;
+}
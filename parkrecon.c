@@ -0,0 +1,589 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hashtable.c"
+#include "tariff.c"
+#include "timestamp.c"
+#include "ledger.c"
+#include "billidx.c"
+
+// Reconcile a billing ledger: the total, per period and per plate totals, and
+// the lines that look wrong. The ledger is billing.txt or its index
+// billing.idx (see billidx.c), mapped and cut into one piece per thread on
+// line or visit boundaries. Each thread parses its piece into flat tables of
+// its own, keyed by number (a packed plate, a period), which take no locks
+// and no allocation per line; they are merged into hash tables at the end.
+//
+// Anomalies reported: lines that are not bills, negative fees, fees over
+// the -M limit, exits before entries, fees the tariff (-t) does not give for
+// the stay, and the same visit billed more than once.
+
+#define RECON_MAX_THREADS 256
+#define RECON_EXAMPLES 3  // of each kind of anomaly
+
+enum { BAD_LINE, NEGATIVE, TOO_HIGH, EXIT_FIRST, OFF_TARIFF, DUPLICATE, ANOMALIES };
+static const char *anomaly_names[ANOMALIES] = {"not a bill", "negative fee", "fee over the limit", "exit before entry",
+                                               "fee not the tariff's", "billed twice"};
+
+// a visit, for finding the ones billed twice; lines without times are left out
+typedef struct visit {
+    uint64_t plate;
+    int64_t entry_ms;
+    int64_t exit_ms;
+    int64_t cents;
+    uint64_t where;  // byte offset or visit number
+} visit_t;
+
+// a total and a count per key, open addressing, probed linearly
+typedef struct agg_slot {
+    uint64_t key;  // 0 for an empty slot
+    int64_t cents;
+    uint64_t count;
+} agg_slot_t;
+
+typedef struct agg {
+    agg_slot_t *slots;
+    size_t size;  // a power of two
+    size_t used;
+} agg_t;
+
+#define NO_EXIT UINT64_MAX  // the period key of lines without an exit time
+
+typedef struct piece {
+    pthread_t thread;
+    // input
+    const char *from;  // text: the first line
+    const char *to;    // text: lines starting before this are ours
+    uint64_t first, last;  // binary: visit numbers
+    // output
+    unsigned long bills;
+    unsigned long overstays;  // bills for stays past the manager's limit, text only
+    int64_t cents;
+    agg_t plates;   // by packed plate, see billidx_key()
+    agg_t periods;  // by period start + 1, or NO_EXIT
+    agg_slot_t *period;  // the last one added to, most lines fall in the same period
+    visit_t *visits;
+    size_t nvisits, visits_cap;
+    unsigned long anomalies[ANOMALIES];
+    uint64_t examples[ANOMALIES][RECON_EXAMPLES];
+    bool incomplete;  // the ledger ends part way through a line
+} piece_t;
+
+// the merged tables, keyed by plate and by period as text
+typedef struct totals {
+    htab_t plate_cents, plate_visits;
+    htab_t period_cents, period_bills;  // "-" for lines without an exit time
+    char *keys;  // the tables' keys
+    size_t keys_len, keys_cap;
+} totals_t;
+
+struct {
+    const char *path;
+    bool binary;
+    const char *map;
+    size_t size;
+    const billidx_t *idx;
+    int64_t period_ms;
+    int64_t max_cents;
+    tariff_t tariff;
+    bool check_tariff;
+} recon = {.period_ms = 86400000LL, .max_cents = 100000};
+
+void usage() {
+    printf("Usage: ./parkrecon [-j THREADS] [-p SECONDS] [-n TOP] [-M DOLLARS] [-t TARIFF] [-r DOLLARS] [LEDGER]\n");
+    printf("  LEDGER      billing.txt (the default) or a billing.idx\n");
+    printf("  -j THREADS  threads to use, one per cpu by default\n");
+    printf("  -p SECONDS  totals per SECONDS of exit time, a day by default\n");
+    printf("  -n TOP      show the TOP plates by fees, 10 by default\n");
+    printf("  -M DOLLARS  report fees over DOLLARS, 1000 by default\n");
+    printf("  -t TARIFF   report fees TARIFF would not have charged for the stay\n");
+    printf("  -r DOLLARS  the revenue the manager reported, to check the total against\n");
+    exit(1);
+}
+
+// "12.34" or "12" as cents, without going through a double
+bool parse_dollars(const char *s, int64_t *cents) {
+    const char *end = s + strlen(s);
+    bool negative = *s == '-';
+    s += negative;
+    int64_t dollars, frac = 0;
+    if (!ledger_digits(&s, end, &dollars)) {
+        return false;
+    }
+    if (*s == '.') {
+        const char *f = ++s;
+        if (!ledger_digits(&s, end, &frac) || s - f != 2) {
+            return false;
+        }
+    }
+    *cents = (dollars * 100 + frac) * (negative ? -1 : 1);
+    return s == end;
+}
+
+void print_cents(int64_t cents) {
+    char fee[LEDGER_CENTS];
+    ledger_cents(fee, sizeof(fee), cents);
+    fputs(fee, stdout);
+}
+
+void out_of_memory() {
+    fprintf(stderr, "parkrecon: out of memory\n");
+    exit(1);
+}
+
+// the slot for key, its own or the empty one it would go in
+static inline agg_slot_t *agg_slot(agg_slot_t *slots, size_t size, uint64_t key) {
+    for (size_t s = (key * 0x9E3779B97F4A7C15ULL) >> 40 & (size - 1);; s = (s + 1) & (size - 1)) {
+        if (slots[s].key == key || slots[s].key == 0) {
+            return &slots[s];
+        }
+    }
+}
+
+// key's slot, added if it is new
+agg_slot_t *agg_get(agg_t *a, uint64_t key) {
+    if (a->size == 0 || (a->used + 1) * 2 > a->size) {
+        size_t size = a->size ? a->size * 2 : 1024;
+        agg_slot_t *slots = calloc(size, sizeof(agg_slot_t));
+        if (slots == NULL) {
+            out_of_memory();
+        }
+        for (size_t i = 0; i < a->size; i++) {
+            if (a->slots[i].key != 0) {
+                *agg_slot(slots, size, a->slots[i].key) = a->slots[i];
+            }
+        }
+        free(a->slots);
+        a->slots = slots;
+        a->size = size;
+    }
+    agg_slot_t *s = agg_slot(a->slots, a->size, key);
+    if (s->key == 0) {
+        s->key = key;
+        a->used++;
+    }
+    return s;
+}
+
+// a NUL terminated copy of key, kept as long as the tables
+char *totals_key(totals_t *t, const char *key) {
+    size_t len = strlen(key);
+    if (t->keys_len + len + 1 > t->keys_cap) {
+        // a new block; the old ones stay where they are, the tables point into them
+        t->keys_cap = 1 << 20;
+        t->keys = malloc(t->keys_cap);
+        t->keys_len = 0;
+        if (t->keys == NULL) {
+            out_of_memory();
+        }
+    }
+    char *k = t->keys + t->keys_len;
+    memcpy(k, key, len + 1);
+    t->keys_len += len + 1;
+    return k;
+}
+
+// add a slot's total and count to key's in the hash tables a and b
+void tally(totals_t *t, htab_t *a, htab_t *b, const char *key, const agg_slot_t *s) {
+    item_t *i = htab_find(a, (char *)key);
+    if (i == NULL) {
+        char *k = totals_key(t, key);
+        if (!htab_add(a, k, 0) || !htab_add(b, k, 0)) {
+            out_of_memory();
+        }
+        i = htab_find(a, k);
+    }
+    i->value += s->cents;
+    htab_find(b, (char *)key)->value += s->count;
+}
+
+// how a merged table is holding up: its lookups cost about its chain lengths
+void print_table(const char *name, htab_t *h) {
+    htab_stats_t st;
+    htab_stats(h, &st);
+    printf("  %-10s %8zu items \t %8zu buckets \t load %.2f \t chain avg %.2f max %zu \t %lu rehashes, %.0f%% moved\n", name,
+           st.count, st.buckets, st.load, st.avg_chain, st.max_chain, st.rehashes, st.rehash_progress * 100);
+}
+
+void anomaly(piece_t *p, int kind, uint64_t where) {
+    if (p->anomalies[kind] < RECON_EXAMPLES) {
+        p->examples[kind][p->anomalies[kind]] = where;
+    }
+    p->anomalies[kind]++;
+}
+
+// count one bill
+void bill(piece_t *p, const ledger_rec_t *r, uint64_t where) {
+    p->bills++;
+    p->cents += r->cents;
+    p->overstays += r->overstay_ms > 0;
+    agg_slot_t *plate = agg_get(&p->plates, billidx_key(r->plate));
+    plate->cents += r->cents;
+    plate->count++;
+
+    uint64_t period = r->exit_ms > 0 ? r->exit_ms - r->exit_ms % recon.period_ms + 1 : NO_EXIT;
+    if (p->period == NULL || p->period->key != period) {
+        p->period = agg_get(&p->periods, period);
+    }
+    p->period->cents += r->cents;
+    p->period->count++;
+
+    if (r->cents < 0) {
+        anomaly(p, NEGATIVE, where);
+    } else if (r->cents > recon.max_cents) {
+        anomaly(p, TOO_HIGH, where);
+    }
+    if (r->entry_ms == 0 || r->exit_ms == 0) {
+        return;  // an old line, nothing more to check
+    }
+    if (r->exit_ms < r->entry_ms) {
+        anomaly(p, EXIT_FIRST, where);
+    } else if (recon.check_tariff && r->level >= 1 && r->level <= LEVELS &&
+               tariff_fee(&recon.tariff, r->level - 1, r->entry_ms, r->exit_ms) != r->cents) {
+        anomaly(p, OFF_TARIFF, where);
+    }
+    if (p->nvisits == p->visits_cap) {
+        p->visits_cap = p->visits_cap ? p->visits_cap * 2 : 4096;
+        p->visits = realloc(p->visits, p->visits_cap * sizeof(visit_t));
+        if (p->visits == NULL) {
+            out_of_memory();
+        }
+    }
+    p->visits[p->nvisits++] = (visit_t){plate->key, r->entry_ms, r->exit_ms, r->cents, where};
+}
+
+int by_visit(const void *a, const void *b) {
+    const visit_t *x = a;
+    const visit_t *y = b;
+    if (x->plate != y->plate) {
+        return x->plate < y->plate ? -1 : 1;
+    }
+    if (x->entry_ms != y->entry_ms) {
+        return x->entry_ms < y->entry_ms ? -1 : 1;
+    }
+    if (x->exit_ms != y->exit_ms) {
+        return x->exit_ms < y->exit_ms ? -1 : 1;
+    }
+    return (x->where > y->where) - (x->where < y->where);
+}
+
+void *run_piece(void *arg) {
+    piece_t *p = arg;
+    ledger_rec_t r;
+
+    if (recon.binary) {
+        for (uint64_t i = p->first; i < p->last; i++) {
+            const billidx_visit_t *v = billidx_visit(recon.idx, i);
+            r = (ledger_rec_t){.cents = v->cents, .entry_ms = v->entry_ms, .exit_ms = v->exit_ms, .level = v->level, .gate = v->gate};
+            memcpy(r.plate, &v->plate, 6);
+            bill(p, &r, i);
+        }
+    } else {
+        madvise((void *)((uintptr_t)p->from & ~4095UL), p->to - p->from + 4096, MADV_WILLNEED);
+        const char *end = recon.map + recon.size;
+        const char *line = p->from;
+        bool ok;
+        while (line < p->to) {
+            const char *next = ledger_parse(line, end, &r, &ok);
+            if (next == NULL) {
+                p->incomplete = true;
+                break;
+            }
+            if (ok) {
+                bill(p, &r, line - recon.map);
+            } else {
+                anomaly(p, BAD_LINE, line - recon.map);
+            }
+            line = next;
+        }
+    }
+    // sorted here, in parallel, and only merged at the end
+    qsort(p->visits, p->nvisits, sizeof(visit_t), by_visit);
+    return NULL;
+}
+
+// add a piece's tables into the totals
+void merge(totals_t *t, const piece_t *p) {
+    char key[24];
+    for (size_t i = 0; i < p->plates.size; i++) {
+        const agg_slot_t *s = &p->plates.slots[i];
+        if (s->key != 0) {
+            memcpy(key, &s->key, 6);
+            key[6] = '\0';
+            tally(t, &t->plate_cents, &t->plate_visits, key, s);
+        }
+    }
+    for (size_t i = 0; i < p->periods.size; i++) {
+        const agg_slot_t *s = &p->periods.slots[i];
+        if (s->key == NO_EXIT) {
+            tally(t, &t->period_cents, &t->period_bills, "-", s);
+        } else if (s->key != 0) {
+            snprintf(key, sizeof(key), "%" PRIu64, s->key - 1);
+            tally(t, &t->period_cents, &t->period_bills, key, s);
+        }
+    }
+}
+
+// every item of a table, for sorting
+item_t **items(htab_t *h) {
+    item_t **all = malloc((h->count + 1) * sizeof(item_t *));
+    size_t n = 0;
+    for (int table = 0; table < 2 && all != NULL; table++) {
+        item_t **buckets = table == 0 ? h->buckets : h->old;
+        size_t size = table == 0 ? h->size : h->old_size;
+        for (size_t b = (table == 0 ? 0 : h->migrated); buckets != NULL && b < size; b++) {
+            for (item_t *i = buckets[b]; i != NULL; i = i->next) {
+                all[n++] = i;
+            }
+        }
+    }
+    return all;
+}
+
+int by_value_desc(const void *a, const void *b) {
+    long double x = (*(item_t *const *)a)->value;
+    long double y = (*(item_t *const *)b)->value;
+    return (x < y) - (x > y);
+}
+
+int by_key(const void *a, const void *b) {
+    const char *x = (*(item_t *const *)a)->key;
+    const char *y = (*(item_t *const *)b)->key;
+    // periods are numbers, shorter is smaller; "-" goes last
+    if (x[0] == '-' || y[0] == '-') {
+        return (x[0] == '-') - (y[0] == '-');
+    }
+    size_t lx = strlen(x), ly = strlen(y);
+    return lx != ly ? (lx > ly) - (lx < ly) : strcmp(x, y);
+}
+
+// walk the pieces' sorted visits together, counting visits seen before
+void find_duplicates(piece_t *pieces, int n, piece_t *out) {
+    size_t at[RECON_MAX_THREADS] = {0};
+    const visit_t *prev = NULL;
+    for (;;) {
+        int best = -1;
+        for (int t = 0; t < n; t++) {
+            if (at[t] < pieces[t].nvisits && (best < 0 || by_visit(&pieces[t].visits[at[t]], &pieces[best].visits[at[best]]) < 0)) {
+                best = t;
+            }
+        }
+        if (best < 0) {
+            return;
+        }
+        const visit_t *v = &pieces[best].visits[at[best]++];
+        if (prev != NULL && prev->plate == v->plate && prev->entry_ms == v->entry_ms && prev->exit_ms == v->exit_ms) {
+            anomaly(out, DUPLICATE, v->where);
+        }
+        prev = v;
+    }
+}
+
+void print_period(const char *key) {
+    if (key[0] == '-') {
+        printf("%-19s", "no exit time");
+        return;
+    }
+    time_t sec = atoll(key) / 1000;
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), recon.period_ms % 86400000LL == 0 ? "%Y-%m-%d" : "%Y-%m-%d %H:%M:%S", &tm);
+    printf("%-19s", buf);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int top = 10;
+    bool expect = false;
+    int64_t expected = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:p:n:M:t:r:")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'p':
+            recon.period_ms = atoll(optarg) * 1000;
+            break;
+        case 'n':
+            top = atoi(optarg);
+            break;
+        case 'M':
+            if (!parse_dollars(optarg, &recon.max_cents)) {
+                usage();
+            }
+            break;
+        case 't':
+            if (!tariff_load(&recon.tariff, optarg)) {
+                fprintf(stderr, "parkrecon: cannot load the tariff %s\n", optarg);
+                return 1;
+            }
+            recon.check_tariff = true;
+            break;
+        case 'r':
+            if (!parse_dollars(optarg, &expected)) {
+                usage();
+            }
+            expect = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (threads < 1 || threads > RECON_MAX_THREADS || recon.period_ms <= 0) {
+        usage();
+    }
+    recon.path = optind < argc ? argv[optind] : "billing.txt";
+    ts_init();
+    uint64_t start = ts_now();
+
+    // an index is found by its magic, anything else is read as text
+    int fd = open(recon.path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(recon.path);
+        return 1;
+    }
+    uint32_t magic = 0;
+    recon.binary = pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && magic == BILLIDX_MAGIC;
+    close(fd);
+    uint64_t units;
+    if (recon.binary) {
+        recon.idx = billidx_read(recon.path);
+        if (recon.idx == NULL) {
+            return 1;
+        }
+        units = recon.idx->header->visits;
+    } else {
+        recon.size = st.st_size;
+        fd = open(recon.path, O_RDONLY);
+        recon.map = recon.size > 0 ? mmap(0, recon.size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+        close(fd);
+        if (recon.map == MAP_FAILED) {
+            perror(recon.path);
+            return 1;
+        }
+        madvise((void *)recon.map, recon.size, MADV_SEQUENTIAL);
+        units = recon.size;
+    }
+    if ((uint64_t)threads > units) {
+        threads = units > 0 ? units : 1;
+    }
+
+    // cut into pieces; text pieces start just after a newline
+    piece_t *pieces = calloc(threads, sizeof(piece_t));
+    for (int t = 0; t < threads; t++) {
+        uint64_t a = units * t / threads, b = units * (t + 1) / threads;
+        if (recon.binary) {
+            pieces[t].first = a;
+            pieces[t].last = b;
+            continue;
+        }
+        const char *end = recon.map + recon.size;
+        const char *from = recon.map + a;
+        if (t > 0 && from[-1] != '\n') {
+            from = memchr(from, '\n', end - from);
+            from = from != NULL ? from + 1 : end;
+        }
+        pieces[t].from = from;
+        pieces[t].to = recon.map + b;
+        if (t > 0) {
+            pieces[t - 1].to = from;
+        }
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&pieces[t].thread, NULL, run_piece, &pieces[t]);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(pieces[t].thread, NULL);
+    }
+    double parse_s = ts_elapsed_ns(start) / 1e9;
+
+    // merge
+    piece_t all = {0};
+    totals_t totals = {0};
+    htab_init(&totals.plate_cents, 4096);
+    htab_init(&totals.plate_visits, 4096);
+    htab_init(&totals.period_cents, 64);
+    htab_init(&totals.period_bills, 64);
+    for (int t = 0; t < threads; t++) {
+        piece_t *p = &pieces[t];
+        all.bills += p->bills;
+        all.cents += p->cents;
+        all.overstays += p->overstays;
+        merge(&totals, p);
+        for (int k = 0; k < ANOMALIES; k++) {
+            for (unsigned long e = 0; e < p->anomalies[k] && e < RECON_EXAMPLES; e++) {
+                anomaly(&all, k, p->examples[k][e]);
+            }
+            all.anomalies[k] += p->anomalies[k] > RECON_EXAMPLES ? p->anomalies[k] - RECON_EXAMPLES : 0;
+        }
+        all.incomplete |= p->incomplete;
+    }
+    find_duplicates(pieces, threads, &all);
+    double total_s = ts_elapsed_ns(start) / 1e9;
+
+    printf("%s: %s, %" PRIu64 " %s on %d threads \t parsed in %.3f s (%.0f MB/s) \t %.3f s in all\n", recon.path,
+           recon.binary ? "index" : "text", units, recon.binary ? "visits" : "bytes", threads, parse_s,
+           recon.binary ? units * sizeof(billidx_visit_t) / 1e6 / parse_s : units / 1e6 / parse_s, total_s);
+    printf("total: %lu bills \t ", all.bills);
+    print_cents(all.cents);
+    if (expect) {
+        printf(" \t manager reported ");
+        print_cents(expected);
+        printf(" \t difference ");
+        print_cents(all.cents - expected);
+    }
+    if (!recon.binary) {
+        printf(" \t %lu past the overstay limit", all.overstays);
+    }
+    printf("\n");
+
+    printf("\nper period:\n");
+    item_t **periods = items(&totals.period_cents);
+    qsort(periods, totals.period_cents.count, sizeof(item_t *), by_key);
+    for (size_t i = 0; i < totals.period_cents.count; i++) {
+        printf("  ");
+        print_period(periods[i]->key);
+        printf(" %10.0Lf bills \t ", htab_find(&totals.period_bills, periods[i]->key)->value);
+        print_cents(periods[i]->value);
+        printf("\n");
+    }
+
+    printf("\ntop %d of %zu plates:\n", top, totals.plate_cents.count);
+    item_t **plates = items(&totals.plate_cents);
+    qsort(plates, totals.plate_cents.count, sizeof(item_t *), by_value_desc);
+    for (size_t i = 0; i < totals.plate_cents.count && i < (size_t)top; i++) {
+        printf("  %s %10.0Lf visits \t ", plates[i]->key, htab_find(&totals.plate_visits, plates[i]->key)->value);
+        print_cents(plates[i]->value);
+        printf("\n");
+    }
+
+    printf("\nanomalies:\n");
+    for (int k = 0; k < ANOMALIES; k++) {
+        if (k == OFF_TARIFF && !recon.check_tariff) {
+            continue;
+        }
+        printf("  %-22s %8lu", anomaly_names[k], all.anomalies[k]);
+        for (unsigned long e = 0; e < all.anomalies[k] && e < RECON_EXAMPLES; e++) {
+            printf("%s%s %" PRIu64, e == 0 ? " \t e.g. at " : ",", recon.binary ? "visit" : "byte", all.examples[k][e]);
+        }
+        printf("\n");
+    }
+    if (all.incomplete) {
+        printf("  the ledger ends part way through a line\n");
+    }
+
+    printf("\ntables:\n");
+    print_table("by plate", &totals.plate_cents);
+    print_table("by period", &totals.period_cents);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "snapshot.c"
+
+// Print the car park's status from the manager's snapshot, once or every
+// -w milliseconds. Reading never blocks the manager.
+
+void print_status(const status_t *st) {
+    printf("cars %d \t revenue $%" PRId64 ".%02" PRId64 " \t alarm %d\n", st->total_cars, st->revenue / 100, st->revenue % 100, st->alarm_active);
+    for (int i = 0; i < ENTRANCES; i++) {
+        printf("entrance %d: lpr %.6s \t gate %c \t sign %c\n", i + 1, st->en_plate[i], st->en_gate[i], st->sign[i]);
+    }
+    for (int i = 0; i < EXITS; i++) {
+        printf("exit %d:     lpr %.6s \t gate %c\n", i + 1, st->ex_plate[i], st->ex_gate[i]);
+    }
+    for (int i = 0; i < LEVELS; i++) {
+        printf("level %d:    lpr %.6s \t cars %d/%d \t temp %d \t alarm %d\n", i + 1, st->lv_plate[i], st->num_lv[i], MAX_CAPACITY, st->temp[i], st->alarm[i]);
+    }
+    printf("cars tracked inside: %d\n", st->tracked_cars);
+    printf("cars overstaying: %d \t %lu in all", st->overstaying, st->overstays);
+    if (st->overstays > 0) {
+        printf(" \t latest %.6s", st->overstay_plate);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    int every_ms = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:")) != -1) {
+        if (opt != 'w') {
+            printf("Usage: ./parkstatus [-w MILLISECONDS]\n");
+            return 1;
+        }
+        every_ms = atoi(optarg);
+    }
+
+    status_shm_t *s = status_open(false);
+    if (s == NULL) {
+        return 1;
+    }
+    for (;;) {
+        status_t st;
+        status_read(s, &st);
+        print_status(&st);
+        if (every_ms <= 0) {
+            return 0;
+        }
+        printf("\n");
+        usleep(every_ms * 1000);
+    }
+}
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.c"
+
+// Turn a trace file written by the car park (see trace.c) into a timeline,
+// or into Chrome trace JSON for chrome://tracing or Perfetto with -j.
+
+typedef struct traced {
+    uint64_t wall_ns;
+    int32_t pid;
+    char process[16];  // as in the chunk, not always terminated, print with %.16s
+    trace_event_t ev;
+} traced_t;
+
+const char *trace_names[TRACE_TYPES] = {"?", "lpr", "sign", "gate", "bill", "alarm", "arrive", "overstay"};
+
+void usage() {
+    printf("Usage: ./parktrace [-j] [TRACE_FILE]\n");
+    printf("  -j  write Chrome trace JSON instead of a timeline\n");
+    exit(1);
+}
+
+int by_time(const void *a, const void *b) {
+    const traced_t *x = a;
+    const traced_t *y = b;
+    return (x->wall_ns > y->wall_ns) - (x->wall_ns < y->wall_ns);
+}
+
+void device_name(uint16_t device, char *out, size_t size) {
+    const char *kinds[] = {"-", "entrance", "exit", "level"};
+    int kind = device >> 8;
+    if (kind == TRACE_NONE || kind > TRACE_LEVEL) {
+        snprintf(out, size, "-");
+    } else {
+        snprintf(out, size, "%s %d", kinds[kind], (device & 0xff) + 1);
+    }
+}
+
+void detail(const trace_event_t *e, char *out, size_t size) {
+    switch (e->type) {
+    case TRACE_LPR:
+        snprintf(out, size, "waited %.1f us", e->arg / 1e3);
+        break;
+    case TRACE_SIGN:
+        snprintf(out, size, "shows '%c'", (char)e->arg);
+        break;
+    case TRACE_GATE:
+        snprintf(out, size, "%c -> %c", (char)(e->arg >> 8), (char)e->arg);
+        break;
+    case TRACE_BILL:
+        snprintf(out, size, "$%lu.%02lu", (unsigned long)(e->arg / 100), (unsigned long)(e->arg % 100));
+        break;
+    case TRACE_OVERSTAY:
+        snprintf(out, size, "inside %.1f s", e->arg / 1e3);
+        break;
+    default:
+        out[0] = '\0';
+    }
+}
+
+// read every chunk in the file, returns the events in time order
+traced_t *load(FILE *f, size_t *n) {
+    size_t cap = 4096;
+    traced_t *all = malloc(cap * sizeof(traced_t));
+    trace_chunk_t chunk;
+    *n = 0;
+    while (all != NULL && fread(&chunk, sizeof(chunk), 1, f) == 1) {
+        if (chunk.magic != TRACE_MAGIC || chunk.version != TRACE_VERSION || chunk.event_size != sizeof(trace_event_t)) {
+            fprintf(stderr, "parktrace: not a trace chunk at offset %ld\n", ftell(f) - (long)sizeof(chunk));
+            break;
+        }
+        for (uint32_t i = 0; i < chunk.count; i++) {
+            if (*n == cap) {
+                traced_t *more = realloc(all, cap * 2 * sizeof(traced_t));
+                if (more == NULL) {
+                    fprintf(stderr, "parktrace: out of memory after %zu events\n", *n);
+                    goto done;
+                }
+                all = more;
+                cap *= 2;
+            }
+            traced_t *t = &all[*n];
+            if (fread(&t->ev, sizeof(trace_event_t), 1, f) != 1) {
+                fprintf(stderr, "parktrace: file ends inside a chunk\n");
+                goto done;
+            }
+            t->wall_ns = chunk.wall_base + (t->ev.ts - chunk.mono_base);
+            t->pid = chunk.pid;
+            memcpy(t->process, chunk.process, sizeof(t->process));
+            (*n)++;
+        }
+    }
+done:
+    if (all != NULL) {
+        qsort(all, *n, sizeof(traced_t), by_time);
+    }
+    return all;
+}
+
+void print_timeline(const traced_t *all, size_t n) {
+    char dev[16];
+    char more[32];
+    for (size_t i = 0; i < n; i++) {
+        const traced_t *t = &all[i];
+        time_t sec = t->wall_ns / 1000000000ULL;
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        device_name(t->ev.device, dev, sizeof(dev));
+        detail(&t->ev, more, sizeof(more));
+        printf("%02d:%02d:%02d.%06lu  +%10.3f ms  %.16s[%d/%u]  %-10s  %-6s  %-6.6s  %s\n", tm.tm_hour, tm.tm_min, tm.tm_sec,
+               (unsigned long)(t->wall_ns % 1000000000ULL / 1000), (t->wall_ns - all[0].wall_ns) / 1e6, t->process, t->pid,
+               t->ev.tid, dev, t->ev.type < TRACE_TYPES ? trace_names[t->ev.type] : "?", t->ev.plate[0] ? t->ev.plate : "", more);
+    }
+}
+
+void print_chrome(const traced_t *all, size_t n) {
+    char dev[16];
+    char more[32];
+    printf("{\"traceEvents\":[\n");
+    for (size_t i = 0; i < n; i++) {
+        const traced_t *t = &all[i];
+        device_name(t->ev.device, dev, sizeof(dev));
+        detail(&t->ev, more, sizeof(more));
+        printf("{\"name\":\"%s %s\",\"cat\":\"%.16s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u,"
+               "\"args\":{\"plate\":\"%.6s\",\"detail\":\"%s\"}}%s\n",
+               t->ev.type < TRACE_TYPES ? trace_names[t->ev.type] : "?", dev, t->process, (t->wall_ns - all[0].wall_ns) / 1e3,
+               t->pid, t->ev.tid, t->ev.plate, more, i + 1 < n ? "," : "");
+    }
+    printf("],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+int main(int argc, char *argv[]) {
+    bool chrome = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "j")) != -1) {
+        if (opt != 'j') {
+            usage();
+        }
+        chrome = true;
+    }
+    const char *path = optind < argc ? argv[optind] : TRACE_FILE;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return 1;
+    }
+    size_t n;
+    traced_t *all = load(f, &n);
+    fclose(f);
+    if (all == NULL) {
+        fprintf(stderr, "parktrace: out of memory\n");
+        return 1;
+    }
+    if (chrome) {
+        print_chrome(all, n);
+    } else {
+        print_timeline(all, n);
+    }
+    free(all);
+    return 0;
+}
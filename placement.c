@@ -0,0 +1,329 @@
+#ifndef PLACEMENT_C
+#define PLACEMENT_C
+
+// includers define _GNU_SOURCE before their first include, for the affinity calls
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* ----------Placement --------------*/
+// Where threads run and how hot memory is backed, set at startup:
+//
+//     PARK_CPUS="device=0-3;billing=4;display=5;sensor=6,7"
+//         pin each group of threads to a set of CPUs. Groups left out float
+//         as before. Every thread is created first and pinned after, so the
+//         code that starts threads decides its group.
+//     PARK_HUGEPAGES=1
+//         back the internal pools with huge pages (hugetlbfs if the system
+//         has some reserved, else transparent huge pages) and ask for
+//         transparent huge pages on the shared segments. Shared memory only
+//         gets them if the kernel's shmem_enabled setting allows it.
+//     PARK_MLOCK=1
+//         fault the hot memory in up front and lock it, so a page fault
+//         never lands on the hot path. Only the regions given to
+//         place_hot() and place_alloc() are locked, not the whole process,
+//         so the thread stacks do not count against RLIMIT_MEMLOCK.
+//
+// place_report() shows what each process actually got, read back from the
+// kernel: each pinned thread's CPUs, and each hot region's resident, huge
+// and locked sizes. A shared page counts towards locked in proportion to the
+// processes mapping it, as it does in /proc/PID/smaps.
+
+#define PLACE_MAX_REGIONS 32
+
+typedef enum place_group {
+    PLACE_DEVICE,   // lpr, gate and car threads, the manager's workers
+    PLACE_BILLING,
+    PLACE_DISPLAY,  // display, timer wheel, output and metrics
+    PLACE_SENSOR,   // temperature sensors and the fire alarm
+    PLACE_GROUPS
+} place_group_t;
+
+static const char *place_group_names[PLACE_GROUPS] = {"device", "billing", "display", "sensor"};
+
+typedef struct place_region {
+    const char *name;
+    void *addr;
+    size_t len;
+    const char *backing;  // what was asked for
+    int lock_errno;       // 0 if locked or not asked to
+} place_region_t;
+
+static struct {
+    char process[16];
+    bool hugepages;
+    bool mlock;
+    bool cpus_set[PLACE_GROUPS];
+    cpu_set_t cpus[PLACE_GROUPS];
+    int pinned[PLACE_GROUPS];  // threads pinned
+    int pin_failed[PLACE_GROUPS];
+    place_region_t regions[PLACE_MAX_REGIONS];
+    int nregions;
+    pthread_mutex_t lock;
+} place = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// parse a CPU list like 0-3,8
+static bool place_parse_cpus(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list != '\0') {
+        char *end;
+        long lo = strtol(list, &end, 10);
+        long hi = lo;
+        if (end == list || lo < 0) {
+            return false;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            hi = strtol(list, &end, 10);
+            if (end == list || hi < lo) {
+                return false;
+            }
+        }
+        for (long c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+            CPU_SET(c, set);
+        }
+        list = *end == ',' ? end + 1 : end;
+        if (*end != ',' && *end != '\0') {
+            return false;
+        }
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+static bool place_env_flag(const char *name) {
+    char *v = getenv(name);
+    return v != NULL && atoi(v) != 0;
+}
+
+// Read the placement options.
+// pre: true
+// post: place_thread(), place_hot() and place_alloc() follow them, bad
+//       groups are reported and left floating
+void place_init(const char *process) {
+    snprintf(place.process, sizeof(place.process), "%s", process);
+    place.hugepages = place_env_flag("PARK_HUGEPAGES");
+    place.mlock = place_env_flag("PARK_MLOCK");
+
+    char *spec = getenv("PARK_CPUS");
+    if (spec == NULL) {
+        return;
+    }
+    char *copy = strdup(spec);
+    char *save;
+    for (char *item = strtok_r(copy, "; ", &save); item != NULL; item = strtok_r(NULL, "; ", &save)) {
+        char *eq = strchr(item, '=');
+        int g = 0;
+        if (eq != NULL) {
+            *eq = '\0';
+            while (g < PLACE_GROUPS && strcmp(item, place_group_names[g]) != 0) {
+                g++;
+            }
+        }
+        if (eq == NULL || g == PLACE_GROUPS || !place_parse_cpus(eq + 1, &place.cpus[g])) {
+            fprintf(stderr, "%s: PARK_CPUS: cannot use '%s', expected GROUP=CPUS with GROUP one of device, billing, display, sensor\n",
+                    place.process, item);
+            continue;
+        }
+        place.cpus_set[g] = true;
+    }
+    free(copy);
+}
+
+// Pin a thread to its group's CPUs, if the group has any.
+// pre: place_init()
+// post: the thread only runs on the group's CPUs, or floats as before
+void place_thread(pthread_t thread, place_group_t group) {
+    if (!place.cpus_set[group]) {
+        return;
+    }
+    int err = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &place.cpus[group]);
+    pthread_mutex_lock(&place.lock);
+    if (err == 0) {
+        place.pinned[group]++;
+    } else {
+        place.pin_failed[group]++;
+    }
+    pthread_mutex_unlock(&place.lock);
+}
+
+static void place_remember(const char *name, void *addr, size_t len, const char *backing, int lock_errno) {
+    pthread_mutex_lock(&place.lock);
+    if (place.nregions < PLACE_MAX_REGIONS) {
+        place.regions[place.nregions++] = (place_region_t){name, addr, len, backing, lock_errno};
+    }
+    pthread_mutex_unlock(&place.lock);
+}
+
+// fault a region in and lock it, returns 0 or the errno of the lock
+static int place_lock(void *addr, size_t len, bool writable) {
+    if (!place.mlock) {
+        return 0;
+    }
+    // mlock faults every page in, read only mappings included
+    if (mlock(addr, len) != 0) {
+        int err = errno;
+        // not allowed to lock it, fault it in at least
+        volatile char *p = addr;
+        long page = sysconf(_SC_PAGESIZE);
+        for (size_t off = 0; off < len; off += page) {
+            if (writable) {
+                p[off] = p[off];
+            } else {
+                (void)p[off];
+            }
+        }
+        return err;
+    }
+    return 0;
+}
+
+// Ask for huge pages on, and fault in and lock, a mapped region such as a
+// shared segment.
+// pre: place_init() AND addr is page aligned
+// post: the region is remembered for place_report()
+void place_hot(const char *name, void *addr, size_t len, bool writable) {
+    const char *backing = "4k pages";
+    if (place.hugepages) {
+        backing = madvise(addr, len, MADV_HUGEPAGE) == 0 ? "thp asked" : "4k pages (no thp)";
+    }
+    place_remember(name, addr, len, backing, place_lock(addr, len, writable));
+}
+
+// Allocate an internal pool, zeroed, on huge pages if asked and there are
+// any, faulted in and locked if asked.
+// pre: place_init()
+// post: (return == NULL AND the pool could not be allocated)
+//       OR return is the pool, remembered for place_report()
+void *place_alloc(const char *name, size_t len) {
+    const char *backing = "4k pages";
+    void *p = MAP_FAILED;
+    if (place.hugepages) {
+        size_t huge = (len + (2 << 20) - 1) & ~(size_t)((2 << 20) - 1);
+        p = mmap(NULL, huge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            backing = "hugetlb";
+            len = huge;
+        }
+    }
+    if (p == MAP_FAILED) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return NULL;
+        }
+        if (place.hugepages) {
+            backing = madvise(p, len, MADV_HUGEPAGE) == 0 ? "thp asked" : "4k pages (no thp)";
+        }
+    }
+    place_remember(name, p, len, backing, place_lock(p, len, true));
+    return p;
+}
+
+// sizes in kB of the mapping at addr from /proc/self/smaps
+static void place_smaps(void *addr, long *rss, long *huge, long *locked) {
+    *rss = *huge = *locked = -1;
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if (f == NULL) {
+        return;
+    }
+    char line[256];
+    bool in = false;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long lo, hi;
+        // a mapping's first line starts lo-hi, the lines about it start Name:
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            if (in) {
+                break;
+            }
+            in = (uintptr_t)addr >= lo && (uintptr_t)addr < hi;
+            continue;
+        }
+        long kb;
+        if (!in) {
+            continue;
+        }
+        if (sscanf(line, "Rss: %ld kB", &kb) == 1) {
+            *rss = kb;
+        } else if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1 || sscanf(line, "ShmemPmdMapped: %ld kB", &kb) == 1 ||
+                   sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1) {
+            *huge = (*huge < 0 ? 0 : *huge) + kb;
+        } else if (sscanf(line, "Locked: %ld kB", &kb) == 1) {
+            *locked = kb;
+        }
+    }
+    fclose(f);
+}
+
+static void place_print_cpus(FILE *out, const cpu_set_t *set) {
+    const char *sep = "";
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, set)) {
+            continue;
+        }
+        int hi = c;
+        while (hi + 1 < CPU_SETSIZE && CPU_ISSET(hi + 1, set)) {
+            hi++;
+        }
+        fprintf(out, hi > c ? "%s%d-%d" : "%s%d", sep, c, hi);
+        sep = ",";
+        c = hi;
+    }
+}
+
+// Show where this process's threads and hot memory ended up.
+// pre: place_init()
+// post: the report is written to out
+void place_report(FILE *out) {
+    cpu_set_t all;
+    sched_getaffinity(0, sizeof(all), &all);
+    fprintf(out, "%s placement: %ld cpus online, process may run on ", place.process, sysconf(_SC_NPROCESSORS_ONLN));
+    place_print_cpus(out, &all);
+    fprintf(out, "\n");
+    for (int g = 0; g < PLACE_GROUPS; g++) {
+        fprintf(out, "  %-8s ", place_group_names[g]);
+        if (!place.cpus_set[g]) {
+            fprintf(out, "floating\n");
+            continue;
+        }
+        fprintf(out, "cpus ");
+        place_print_cpus(out, &place.cpus[g]);
+        fprintf(out, " \t %d threads pinned", place.pinned[g]);
+        if (place.pin_failed[g] > 0) {
+            fprintf(out, ", %d could not be", place.pin_failed[g]);
+        }
+        fprintf(out, "\n");
+    }
+    pthread_mutex_lock(&place.lock);
+    for (int i = 0; i < place.nregions; i++) {
+        place_region_t *r = &place.regions[i];
+        long rss, huge, locked;
+        place_smaps(r->addr, &rss, &huge, &locked);
+        fprintf(out, "  %-18s %9zu bytes \t %-18s \t resident %ld kB \t huge %ld kB \t locked %ld kB", r->name, r->len,
+                r->backing, rss, huge < 0 ? 0 : huge, locked);
+        if (r->lock_errno != 0) {
+            fprintf(out, " \t (mlock: %s)", strerror(r->lock_errno));
+        }
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&place.lock);
+    fflush(out);
+}
+
+// whether any placement option is set, i.e. whether a report is worth printing
+bool place_requested() {
+    for (int g = 0; g < PLACE_GROUPS; g++) {
+        if (place.cpus_set[g]) {
+            return true;
+        }
+    }
+    return place.hugepages || place.mlock;
+}
+/* ----------Placement --------------*/
+
+#endif
@@ -1,30 +1,105 @@
+#ifndef RANDOM_STRING_C
+#define RANDOM_STRING_C
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* ----------Random plates --------------*/
+// License plates are 6 characters, 3 digits then 3 letters, and are not NUL
+// terminated. Plates are written straight into storage the caller owns, so
+// generating one never allocates.
+
+#define PLATE_LEN 6
+// plates refilled at a time in a plate ring, a multiple of 4
+#define PLATE_RING 256
 
 const char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 const char number[] = "1234567890";
 
-static char *rand_string(char *str, size_t size) {
-    if (size) {
-        --size;
-        for (size_t n = 0; n < 3; n++) {
-            int key = rand() % (int)(sizeof number - 1);
-            str[n] = number[key];
-        }
-        for (size_t n = 0; n < 3; n++) {
-            int key = rand() % (int)(sizeof charset - 1);
-            str[n + 3] = charset[key];
-        }
+// a ring of pregenerated random plates, refilled in bulk when used up
+typedef struct plate_ring {
+    char plates[PLATE_RING][PLATE_LEN];
+    unsigned next;
+    uint64_t rng;
+} plate_ring_t;
+
+// xorshift64*, the caller keeps one state per thread
+static inline uint64_t rand_u64(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// write one random plate, each character from its own 10 random bits
+static inline void rand_plate(char *plate, uint64_t *rng) {
+    uint64_t r = rand_u64(rng);
+    for (size_t n = 0; n < 3; n++) {
+        plate[n] = number[((r & 0x3ff) * (sizeof number - 1)) >> 10];
+        r >>= 10;
+    }
+    for (size_t n = 0; n < 3; n++) {
+        plate[n + 3] = charset[((r & 0x3ff) * (sizeof charset - 1)) >> 10];
+        r >>= 10;
     }
-    return str;
 }
 
-// random license plate
-char *rand_string_alloc(size_t size) {
-    char *s = malloc(size);
-    if (s) {
-        rand_string(s, size);
+// Write n random plates back to back into plates (n * PLATE_LEN bytes).
+// With SSE2 four plates (24 characters) are made at once from 16 bit random
+// lanes: a multiply-high scales each lane to 0-9 or 0-25 and an add turns it
+// into a digit or letter.
+void rand_plates(char *plates, size_t n, uint64_t *rng) {
+    size_t i = 0;
+#ifdef __SSE2__
+    // lane k of the 24 is a digit when k % 6 < 3
+#define D 10
+#define L 26
+    const __m128i mul0 = _mm_setr_epi16(D, D, D, L, L, L, D, D);
+    const __m128i mul1 = _mm_setr_epi16(D, L, L, L, D, D, D, L);
+    const __m128i mul2 = _mm_setr_epi16(L, L, D, D, D, L, L, L);
+#undef D
+#undef L
+#define D '0'
+#define L 'A'
+    const __m128i add0 = _mm_setr_epi16(D, D, D, L, L, L, D, D);
+    const __m128i add1 = _mm_setr_epi16(D, L, L, L, D, D, D, L);
+    const __m128i add2 = _mm_setr_epi16(L, L, D, D, D, L, L, L);
+#undef D
+#undef L
+    for (; i + 4 <= n; i += 4) {
+        __m128i r0 = _mm_set_epi64x(rand_u64(rng), rand_u64(rng));
+        __m128i r1 = _mm_set_epi64x(rand_u64(rng), rand_u64(rng));
+        __m128i r2 = _mm_set_epi64x(rand_u64(rng), rand_u64(rng));
+        __m128i c0 = _mm_add_epi16(_mm_mulhi_epu16(r0, mul0), add0);
+        __m128i c1 = _mm_add_epi16(_mm_mulhi_epu16(r1, mul1), add1);
+        __m128i c2 = _mm_add_epi16(_mm_mulhi_epu16(r2, mul2), add2);
+        char *out = plates + i * PLATE_LEN;
+        _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(c0, c1));
+        _mm_storel_epi64((__m128i *)(out + 16), _mm_packus_epi16(c2, c2));
     }
-    return s;
-}
\ No newline at end of file
+#endif
+    for (; i < n; i++) {
+        rand_plate(plates + i * PLATE_LEN, rng);
+    }
+}
+
+// Take the next plate from the ring, refilling it when it runs out.
+// pre: the ring was zeroed and ring->rng seeded with a non zero value
+// post: return points at PLATE_LEN characters valid until the ring refills
+static inline const char *plate_ring_next(plate_ring_t *ring) {
+    if (ring->next == 0) {
+        rand_plates(ring->plates[0], PLATE_RING, &ring->rng);
+        ring->next = PLATE_RING;
+    }
+    return ring->plates[--ring->next];
+}
+/* ----------Random plates --------------*/
+
+#endif
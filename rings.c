@@ -0,0 +1,340 @@
+#ifndef RINGS_C
+#define RINGS_C
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "header.h"
+#include "timestamp.c"
+
+/* ----------Device rings --------------*/
+// The devices hand their readings to the manager through bounded rings in a
+// second shared segment; the PARKING segment keeps the layout from the spec.
+//
+// Each LPR has a single-producer single-consumer ring of plate reads. The
+// simulator writes an event and moves head on, the manager copies events out
+// and moves tail on, so a read is never overwritten before it is consumed and
+// a burst of cars waits in the ring instead of being lost. head and tail are
+// also futex words: the consumer sleeps on head while the ring is empty and
+// the producer sleeps on tail while it is full, and each side only makes the
+// wake syscall when the other has said it is asleep.
+//
+// There must only be one producer per ring at a time; the simulator holds the
+// LPR's mutex while it pushes.
+//
+// Every push also rings a doorbell shared by all the LPR rings: it sets the
+// ring's bit in a ready bitmap and wakes a sleeping worker, if any. A pool of
+// workers can then wait for any ring at all on one futex, and claim the rings
+// with work one bit at a time (see the manager's reactor mode), instead of
+// having a thread asleep on each ring. Bits past the LPR rings are free for
+// the consumer's own sources.
+//
+// Each level's temperature sensor publishes into a sample ring instead. A
+// sensor never waits, so it overwrites the oldest sample when the ring is
+// full; a reader that falls a whole ring behind skips to the oldest sample
+// still there and counts the ones it missed. Each slot has a version that is
+// odd while it is being written, so a sample is never read half written.
+
+#define RINGS_NAME "PARKING_RINGS"
+#define LPR_RING_SIZE 64  // a power of two
+#define LPR_BATCH 16      // events the manager takes from a ring at a time
+#define TEMP_RING_SIZE 256  // a power of two
+#define LPR_RINGS (ENTRANCES + EXITS + LEVELS)  // doorbell bits 0 to LPR_RINGS - 1
+
+typedef struct lpr_event {
+    uint64_t seq;  // 0, 1, 2 ... per lpr
+    uint64_t ts;   // ts_now() when the plate was read
+    char license[6];
+} lpr_event_t;
+
+typedef struct lpr_ring {
+    // written by the producer
+    uint32_t head __attribute__((aligned(64)));  // events pushed
+    uint32_t producer_waiting;
+    uint64_t seq;
+    unsigned long full;  // times the producer waited for room
+    uint32_t bell_bit;   // the ring's bit in the doorbell, set when the segment is made
+    int64_t bell_off;    // where the doorbell is, from the ring
+    // written by the consumer
+    uint32_t tail __attribute__((aligned(64)));  // events popped
+    uint32_t consumer_waiting;
+    lpr_event_t ev[LPR_RING_SIZE] __attribute__((aligned(64)));
+} lpr_ring_t;
+
+typedef struct temp_sample {
+    uint64_t seq;  // 0, 1, 2 ... per sensor
+    uint64_t ts;   // ts_now() when it was taken
+    unsigned short temp;
+} temp_sample_t;
+
+typedef struct temp_slot {
+    uint32_t version;  // odd while the sample is being written
+    temp_sample_t sample;
+} temp_slot_t;
+
+typedef struct temp_ring {
+    uint32_t head __attribute__((aligned(64)));  // samples published, also the readers' futex
+    uint32_t readers_waiting;
+    uint64_t seq;
+    temp_slot_t slot[TEMP_RING_SIZE] __attribute__((aligned(64)));
+} temp_ring_t;
+
+typedef struct lpr_doorbell {
+    uint64_t ready __attribute__((aligned(64)));  // a bit for each source with work waiting
+    uint32_t seq;       // moved on by every wake, the workers' futex
+    uint32_t sleepers;  // workers asleep on seq
+} lpr_doorbell_t;
+
+typedef struct rings {
+    lpr_doorbell_t bell;
+    lpr_ring_t en[ENTRANCES];
+    lpr_ring_t ex[EXITS];
+    lpr_ring_t lv[LEVELS];
+    temp_ring_t temp[LEVELS];
+} rings_t;
+
+static inline void ring_futex_wait(uint32_t *addr, uint32_t val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static inline void ring_futex_wake(uint32_t *addr, int waiters) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, waiters, NULL, NULL, 0);
+}
+
+// Map the rings segment.
+// pre: create is only true in the process that starts first (the simulator)
+// post: (return == NULL AND the segment could not be mapped)
+//       OR (return points at the rings, emptied if create)
+rings_t *rings_open(bool create) {
+    int fd = shm_open(RINGS_NAME, O_CREAT | O_RDWR, S_IRWXU);
+    if (fd < 0 || ftruncate(fd, sizeof(rings_t)) != 0) {
+        perror(RINGS_NAME);
+        return NULL;
+    }
+    rings_t *r = mmap(0, sizeof(rings_t), PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r == MAP_FAILED) {
+        perror(RINGS_NAME);
+        return NULL;
+    }
+    if (create) {
+        memset(r, 0, sizeof(rings_t));
+        // entrances, then exits, then levels
+        for (uint32_t i = 0; i < LPR_RINGS; i++) {
+            lpr_ring_t *lpr = i < ENTRANCES ? &r->en[i]
+                              : i < ENTRANCES + EXITS ? &r->ex[i - ENTRANCES]
+                                                      : &r->lv[i - ENTRANCES - EXITS];
+            lpr->bell_bit = i;
+            lpr->bell_off = (char *)&r->bell - (char *)lpr;
+        }
+    }
+    return r;
+}
+
+// Mark a source ready and wake a worker to take it.
+// pre: bit < 64
+// post: the bit is set and a sleeping worker has been woken, unless the bit
+//       was already set, in which case whoever set it did
+void doorbell_ring(lpr_doorbell_t *b, unsigned bit) {
+    uint64_t mask = 1ULL << bit;
+    if (__atomic_fetch_or(&b->ready, mask, __ATOMIC_SEQ_CST) & mask) {
+        return;
+    }
+    if (__atomic_load_n(&b->sleepers, __ATOMIC_SEQ_CST)) {
+        __atomic_fetch_add(&b->seq, 1, __ATOMIC_SEQ_CST);
+        ring_futex_wake(&b->seq, 1);
+    }
+}
+
+// Wait until a source is ready and claim it, clearing its bit. Callers take
+// turns round the bits, so a busy source cannot starve the others.
+// pre: *next is the caller's own, 0 to start with
+// post: return is a bit this caller cleared, *next is past it
+unsigned doorbell_take(lpr_doorbell_t *b, unsigned *next) {
+    for (;;) {
+        uint64_t ready = __atomic_load_n(&b->ready, __ATOMIC_ACQUIRE);
+        while (ready != 0) {
+            uint64_t after = ready & (~0ULL << (*next & 63));
+            unsigned bit = __builtin_ctzll(after != 0 ? after : ready);
+            uint64_t mask = 1ULL << bit;
+            uint64_t was = __atomic_fetch_and(&b->ready, ~mask, __ATOMIC_SEQ_CST);
+            if (was & mask) {
+                *next = bit + 1;
+                // more to do than this caller can take, pass it on
+                if ((was & ~mask) && __atomic_load_n(&b->sleepers, __ATOMIC_SEQ_CST)) {
+                    __atomic_fetch_add(&b->seq, 1, __ATOMIC_SEQ_CST);
+                    ring_futex_wake(&b->seq, 1);
+                }
+                return bit;
+            }
+            ready = was & ~mask;
+        }
+
+        uint32_t seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+        __atomic_fetch_add(&b->sleepers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&b->ready, __ATOMIC_SEQ_CST) == 0) {
+            ring_futex_wait(&b->seq, seq);
+        }
+        __atomic_fetch_sub(&b->sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Push a plate read, waiting for room if the ring is full.
+// pre: the caller is the ring's only producer
+// post: the event is in the ring and the consumer has been woken if asleep
+void lpr_ring_push(lpr_ring_t *r, const char license[6]) {
+    uint32_t head = r->head;
+    uint32_t tail;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LPR_RING_SIZE) {
+        r->full++;  // once per push, however often it wakes before there is room
+    }
+    while (head - (tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == LPR_RING_SIZE) {
+        __atomic_store_n(&r->producer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == tail) {
+            ring_futex_wait(&r->tail, tail);
+        }
+        __atomic_store_n(&r->producer_waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    lpr_event_t *ev = &r->ev[head & (LPR_RING_SIZE - 1)];
+    ev->seq = r->seq++;
+    ev->ts = ts_now();
+    memcpy(ev->license, license, 6);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    // pairs with the fence in lpr_ring_wait
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->consumer_waiting, __ATOMIC_RELAXED)) {
+        ring_futex_wake(&r->head, 1);
+    }
+    doorbell_ring((lpr_doorbell_t *)((char *)r + r->bell_off), r->bell_bit);
+}
+
+// Wait until the ring has an event.
+// pre: the caller is the ring's only consumer
+// post: the ring is not empty
+void lpr_ring_wait(lpr_ring_t *r) {
+    uint32_t head;
+    while ((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == r->tail) {
+        __atomic_store_n(&r->consumer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == head) {
+            ring_futex_wait(&r->head, head);
+        }
+        __atomic_store_n(&r->consumer_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Take up to max events from the ring, oldest first, without waiting.
+// pre: the caller is the ring's only consumer
+// post: return events were copied to out and removed from the ring
+size_t lpr_ring_pop(lpr_ring_t *r, lpr_event_t *out, size_t max) {
+    uint32_t tail = r->tail;
+    uint32_t n = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+    if (n > max) {
+        n = max;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        out[i] = r->ev[(tail + i) & (LPR_RING_SIZE - 1)];
+    }
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+
+    // pairs with the fence in lpr_ring_push
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (n > 0 && __atomic_load_n(&r->producer_waiting, __ATOMIC_RELAXED)) {
+        ring_futex_wake(&r->tail, 1);
+    }
+    return n;
+}
+
+// events waiting in the ring, for the status and metrics
+static inline uint32_t lpr_ring_depth(lpr_ring_t *r) {
+    return __atomic_load_n(&r->head, __ATOMIC_RELAXED) - __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+}
+
+// Publish a temperature sample, overwriting the oldest if the ring is full.
+// pre: the caller is the ring's only producer
+// post: the sample is in the ring and waiting readers have been woken
+void temp_ring_publish(temp_ring_t *r, unsigned short temp) {
+    uint32_t head = r->head;
+    temp_slot_t *slot = &r->slot[head & (TEMP_RING_SIZE - 1)];
+
+    __atomic_store_n(&slot->version, slot->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->sample.seq = r->seq++;
+    slot->sample.ts = ts_now();
+    slot->sample.temp = temp;
+    __atomic_store_n(&slot->version, slot->version + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->readers_waiting, __ATOMIC_RELAXED)) {
+        ring_futex_wake(&r->head, INT_MAX);
+    }
+}
+
+// the sequence number the next sample will get, where a new reader starts
+static inline uint64_t temp_ring_head(temp_ring_t *r) {
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+// Wait until the sensor has published sample next.
+// pre: true
+// post: the ring's head has passed next
+void temp_ring_wait(temp_ring_t *r, uint64_t next) {
+    uint32_t head;
+    while ((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == (uint32_t)next) {
+        __atomic_fetch_add(&r->readers_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == head) {
+            ring_futex_wait(&r->head, head);
+        }
+        __atomic_fetch_sub(&r->readers_waiting, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Read up to max samples from *next on, oldest first, without waiting.
+// Readers keep their own position, so any number of them can follow a ring.
+// pre: true
+// post: return samples were copied to out in sequence order, *next is the
+//       sample after the last one, and samples overwritten before they could
+//       be read were added to *lost
+size_t temp_ring_read(temp_ring_t *r, uint64_t *next, temp_sample_t *out, size_t max, unsigned long *lost) {
+    size_t n = 0;
+    while (n < max) {
+        uint32_t behind = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - (uint32_t)*next;
+        if (behind == 0) {
+            break;
+        }
+        if (behind > TEMP_RING_SIZE) {
+            // lapped, skip to the oldest sample still in the ring
+            *lost += behind - TEMP_RING_SIZE;
+            *next += behind - TEMP_RING_SIZE;
+        }
+
+        temp_slot_t *slot = &r->slot[*next & (TEMP_RING_SIZE - 1)];
+        uint32_t v1 = __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE);
+        out[n] = slot->sample;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t v2 = __atomic_load_n(&slot->version, __ATOMIC_RELAXED);
+        if ((v1 & 1) || v1 != v2 || (uint32_t)out[n].seq != (uint32_t)*next) {
+            continue;  // overwritten while reading it, the next pass skips ahead
+        }
+        (*next)++;
+        n++;
+    }
+    return n;
+}
+/* ----------Device rings --------------*/
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -13,6 +14,12 @@
 #include <unistd.h>
 
 #include "./header.h"
+#include "generator.c"
+#include "lanes.c"
+#include "rings.c"
+#include "boomgate.c"
+#include "trace.c"
+#include "placement.c"
 
 #define SHARE_NAME "PARKING"
 #define SHARE_SIZE 2920
@@ -36,11 +43,12 @@ info_sign_t *ist[5];
 // lv
 lv_t *lv[5];
 
-// for creating random liceneses
-const char charset[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-const char number[] = "1234567890";
-char temp[6];
-char *license_plate[100];
+// plate reads for the manager, see rings.c
+rings_t *rings;
+
+// whitelisted licenses, shared with the manager (see whitelist.c), random
+// ones come from random_string.c
+whitelist_t *whitelist;
 
 // for simulation thread pool
 pthread_mutex_t mutex_car;
@@ -49,19 +57,11 @@ car_t *cars = NULL;     /* head of linked list of requests. */
 car_t *last_car = NULL; /* pointer to last request.         */
 int num_car = 0;
 
-// for queuing cars at the entrance
-int num_car_entrance[5];
-car_t *cars_en[5];
-car_t *last_car_en[5];
-pthread_mutex_t mutex_car_en[5];
-pthread_cond_t cond_car_en[5];
-
-// for queuing cars at the exit
-int num_car_exit[5];
-car_t *cars_ex[5];
-car_t *last_car_ex[5];
-pthread_mutex_t mutex_car_ex[5];
-pthread_cond_t cond_car_ex[5];
+// cars queuing at the entrances and exits, and how they pick one, see lanes.c
+lane_t lane_en[ENTRANCES];
+lane_t lane_ex[EXITS];
+lane_router_t route_en = {ROUTE_WEIGHTED};  // the road is the generator's -W
+lane_router_t route_ex = {ROUTE_UNIFORM};
 
 // for temperature
 int lv_id[5];
@@ -70,141 +70,21 @@ int temp_type;
 pthread_t *check_temp_threads;
 int alarm_active = 0;
 
-// initalize hash tables for storing plates from txt
-bool store_plates()
-{
-    FILE *f = fopen("plates.txt", "r");
-    int i = 0;
-    // put value in array char
-    while (fgets(temp, 8, f))
-    {
-        temp[strcspn(temp, "\n")] = 0;
-        license_plate[i] = malloc(7);
-        strcpy(license_plate[i], temp);
-        i++;
-    }
-    fclose(f);
-    return EXIT_SUCCESS;
-}
-
-static char *rand_string(char *str, size_t size)
-{
-    if (size)
-    {
-        --size;
-        for (size_t n = 0; n < 3; n++)
-        {
-            int key = rand() % (int)(sizeof number - 1);
-            str[n] = number[key];
-        }
-        for (size_t n = 0; n < 3; n++)
-        {
-            int key = rand() % (int)(sizeof charset - 1);
-            str[n + 3] = charset[key];
-        }
-    }
-    return str;
-}
-
-// random license plate
-char *rand_string_alloc(size_t size)
-{
-    char *s = malloc(size);
-    if (s)
-    {
-        rand_string(s, size);
-    }
-    return s;
-}
-
-char *random_cars(bool flag)
-{
-    // create car
-    char *rand_license = malloc(sizeof(char[6]));
-    // random license
-    // if flag false, create a random license plate
-    if (flag == false)
-    {
-        char *license = rand_string_alloc(6);
-        strcpy(rand_license, license);
-    }
-    // if true, get the license plate that is allowed
-    else
-    {
-        int i = rand() % 100;
-        char *license = license_plate[i];
-        strcpy(rand_license, license);
-    }
-
-    return rand_license;
-}
-
 //--------------------exit threads function ------------------
-void queue_car_exit(car_t *added_car, int exit_id)
+// a parked car joins the queue for an exit; it cannot just vanish, so if
+// the lane is full it waits, or goes to another exit when diverting and
+// waits only if every exit is full
+lane_policy_t exit_policy()
 {
-    car_t *a_car; /* pointer to newly added request.     */
-
-    /* create structure with new request */
-    a_car = (struct car *)malloc(sizeof(struct car));
-    if (!a_car)
-    { /* malloc failed?? */
-        fprintf(stderr, "queue car: out of memory\n");
-        exit(1);
-    }
-
-    /* lock the mutex, to assure exclusive access to the list */
-    pthread_mutex_lock(&mutex_car_ex[exit_id]);
-
-    memcpy(a_car->license, added_car->license, 6);
-
-    /* add new car to the end of the list, updating list */
-    /* pointers as required */
-    if (num_car_exit[exit_id] == 0)
-    { /* special case - list is empty */
-        cars_ex[exit_id] = a_car;
-        last_car_ex[exit_id] = a_car;
-    }
-    else
-    {
-        last_car_ex[exit_id]->next = a_car;
-        last_car_ex[exit_id] = a_car;
-    }
-
-    /* increase total number of pending cars by one. */
-    num_car_exit[exit_id]++;
-
-    /* unlock mutex */
-    pthread_mutex_unlock(&mutex_car_ex[exit_id]);
-
-    /* signal the condition variable that the car is at the entrance */
-    pthread_cond_signal(&cond_car_ex[exit_id]);
+    return lane_policy == LANE_DIVERT ? LANE_DIVERT_OR_BLOCK : LANE_BLOCK;
 }
 
-struct car *get_car_exit(int exit_id)
+void queue_car_exit(car_t *added_car, int exit_id)
 {
-    struct car *a_car; /* pointer to car.                 */
-
-    if (num_car_exit[exit_id] > 0)
-    {
-        a_car = cars_ex[exit_id];
-        cars_ex[exit_id] = a_car->next;
-        if (cars_ex[exit_id] == NULL)
-        { /* this was the last car on the list */
-            last_car_ex[exit_id] = NULL;
-        }
-        /* decrease the total number of pending cars */
-        num_car_exit[exit_id]--;
-    }
-    else
-    { /* cars list is empty */
-        a_car = NULL;
-    }
-
-    /* return the car to the caller. */
-    return a_car;
+    lane_push(lane_ex, EXITS, exit_id, added_car->license, added_car->lv, exit_policy());
 }
 
-void simulate_car_exiting(car_t *car, int exit_id)
+void simulate_car_exiting(const lane_car_t *car, int exit_id)
 {
     pthread_mutex_lock(&ex_lpr[exit_id]->m);
     usleep(10 * 1000); // take 10ms to get to the exit
@@ -213,70 +93,33 @@ void simulate_car_exiting(car_t *car, int exit_id)
     memcpy(ex_lpr[exit_id]->license, car->license, 6);
     // wait 2ms for the lpr exit to read
     usleep(2 * 1000);
+    // hand the read to the manager
+    uint32_t opens = bg_opens(ex_bg[exit_id]);
+    trace(TRACE_ARRIVE, TRACE_DEV(TRACE_EXIT, exit_id), car->license, 0);
+    lpr_ring_push(&rings->ex[exit_id], car->license);
     pthread_mutex_unlock(&ex_lpr[exit_id]->m);
-    // signal the lpr exit to read
-    pthread_cond_signal(&ex_lpr[exit_id]->c);
 
-    // usleep(30 * 1000);
-    // sleep(1);
-
-    // simulate the boomgate
-    pthread_mutex_lock(&ex_bg[exit_id]->m);
-    pthread_cond_wait(&ex_bg[exit_id]->c, &ex_bg[exit_id]->m);
-    // printf("Exit %d: %c\n", exit_id + 1, ex_bg[exit_id]->s);
-    // printf("Exit %d is raising the boomgate!\n", exit_id + 1);
-    // raising for 10 ms
-    ex_bg[exit_id]->s = 'R';
-
-    usleep(10 * 1000);
-    pthread_cond_signal(&ex_bg[exit_id]->c);
-
-    // wait for the manager tells to close
-    pthread_cond_wait(&ex_bg[exit_id]->c, &ex_bg[exit_id]->m);
-    // printf("Exit %d: %c\n", exit_id + 1, ex_bg[exit_id]->s);
-    // lowering for 10 ms
-    // printf("Exit %d is lowering the boomgate!\n", exit_id + 1);
-    ex_bg[exit_id]->s = 'L';
-    usleep(10 * 1000);
-    // signal finish lowering
-    pthread_cond_signal(&ex_bg[exit_id]->c);
-    pthread_cond_wait(&ex_bg[exit_id]->c, &ex_bg[exit_id]->m);
-    // printf("Exit %d: %c\n", exit_id + 1, ex_bg[exit_id]->s);
-
-    pthread_mutex_unlock(&ex_bg[exit_id]->m);
+    // leave once the manager has had the gate raised for this car, see boomgate.c
+    bg_wait_open(ex_bg[exit_id], opens);
 }
 
 void *simulate_car_exiting_handler(void *arg)
 {
-    car_t *a_car;
+    lane_car_t a_car;
     int id = *((int *)arg);
 
-    pthread_mutex_lock(&mutex_car_ex[id]);
-
     // do forever
     for (;;)
     {
-        if (num_car_exit[id] > 0)
-        {
-            a_car = get_car_exit(id);
-            if (a_car)
-            {
-                pthread_mutex_unlock(&mutex_car_ex[id]);
-                simulate_car_exiting(a_car, id);
-                free(a_car);
-                pthread_mutex_lock(&mutex_car_ex[id]);
-            }
-        }
-        else
-        {
-            // wait for cars
-            pthread_cond_wait(&cond_car_ex[id], &mutex_car_ex[id]);
-        }
+        // wait for cars
+        lane_pop(&lane_ex[id], &a_car);
+        simulate_car_exiting(&a_car, id);
+        lane_done(&lane_ex[id]);
     }
 }
 //--------------------exit threads function ------------------
 
-void add_car_simulation(car_t *added_car, int lv, pthread_mutex_t *p_mutex,
+void add_car_simulation(const char license[6], int lv, pthread_mutex_t *p_mutex,
                         pthread_cond_t *p_cond_var)
 {
     car_t *a_car; /* pointer to newly added request.     */
@@ -295,7 +138,7 @@ void add_car_simulation(car_t *added_car, int lv, pthread_mutex_t *p_mutex,
     // strcpy(a_car->license, license);
     // a_car->exit_id = exit_id;
     // a_car->lv = lv;
-    memcpy(a_car->license, added_car->license, 6);
+    memcpy(a_car->license, license, 6);
     a_car->lv = lv;
 
     /* add new car to the end of the list, updating list */
@@ -347,18 +190,21 @@ struct car *get_car_simulation()
 
 void handle_a_car_simulation(car_t *car)
 {
-    int lv_addr = ((car->lv - 49) * sizeof(lv_t)) + 2400;
+    int id = car->lv - 49;
+    int lv_addr = (id * sizeof(lv_t)) + 2400;
     LPR_t *lv_lpr = ptr + lv_addr;
 
     // take 10 ms to get to the lv
     usleep(10 * 1000);
 
-    // signal the lv lpr for the first time to enter
+    // pass the lv lpr for the first time to enter, the lpr's mutex keeps
+    // the cars passing it to one at a time
     pthread_mutex_lock(&lv_lpr->m);
     // printf("%s signaled lpr first time!\n", car->license);
     memcpy(lv_lpr->license, car->license, 6);
     usleep(2 * 1000); // 2 ms for the lpr to read
-    pthread_cond_signal(&lv_lpr->c);
+    trace(TRACE_ARRIVE, TRACE_DEV(TRACE_LEVEL, id), car->license, 0);
+    lpr_ring_push(&rings->lv[id], car->license);
     pthread_mutex_unlock(&lv_lpr->m);
 
     // park there for random time
@@ -366,22 +212,18 @@ void handle_a_car_simulation(car_t *car)
 
     usleep(rd_time);
 
-    // signal for the second time
+    // pass the lpr for the second time on the way out
     pthread_mutex_lock(&lv_lpr->m);
-    // printf("%s signaled lpr first time!\n", car->license);
+    // printf("%s signaled lpr again\n", car->license);
     memcpy(lv_lpr->license, car->license, 6);
     usleep(2 * 1000); // 2 ms for the lpr to read
-    pthread_cond_signal(&lv_lpr->c);
+    trace(TRACE_ARRIVE, TRACE_DEV(TRACE_LEVEL, id), car->license, 0);
+    lpr_ring_push(&rings->lv[id], car->license);
     pthread_mutex_unlock(&lv_lpr->m);
 
-    pthread_mutex_lock(&lv_lpr->m);
-    // printf("%s signaled lpr again\n", car->license);
-
-    // random exit
-    int exit_id = rand() % (int)5;
+    // head for an exit
+    int exit_id = lane_route(lane_ex, EXITS, &route_ex, lane_arrival(&route_ex, EXITS));
     queue_car_exit(car, exit_id);
-    pthread_mutex_unlock(&lv_lpr->m);
-    pthread_cond_signal(&lv_lpr->c);
 }
 
 void *simulate_car_handler(void *arg)
@@ -418,6 +260,7 @@ void *simulate_temp(void *arg)
     int id = (*(int *)arg);
     int count = 1;
     int base_temp = 20;
+    unsigned short temp;
     for (;;)
     {
         if (temp_type == 2)
@@ -426,23 +269,26 @@ void *simulate_temp(void *arg)
             {
                 base_temp = base_temp + (rand() % 2);
             }
-            lv[id]->temp = (rand() % 4) + base_temp;
+            temp = (rand() % 4) + base_temp;
         }
         else if (temp_type == 3)
         {
             if (count >= 3000)
             {
-                lv[id]->temp = (rand() % 15) + base_temp;
+                temp = (rand() % 15) + base_temp;
             }
             else
             {
-                lv[id]->temp = (rand() % 8) + base_temp;
+                temp = (rand() % 8) + base_temp;
             }
         }
         else
         {
-            lv[id]->temp = (rand() % 8) + base_temp;
+            temp = (rand() % 8) + base_temp;
         }
+        // the sensor's field is kept for the display, the fire alarm reads every sample from the ring
+        lv[id]->temp = temp;
+        temp_ring_publish(&rings->temp[id], temp);
         count++;
         usleep((rand() % 5) * 1000);
         //printf("%d\n", lv[id]->temp);
@@ -450,71 +296,7 @@ void *simulate_temp(void *arg)
 }
 
 //--------------------entrance threads function ------------------
-void queue_car_entrance(char license[6], int entrance_id)
-{
-    car_t *a_car; /* pointer to newly added request.     */
-
-    /* create structure with new request */
-    a_car = (struct car *)malloc(sizeof(struct car));
-    if (!a_car)
-    { /* malloc failed?? */
-        fprintf(stderr, "queue car: out of memory\n");
-        exit(1);
-    }
-
-    /* lock the mutex, to assure exclusive access to the list */
-    pthread_mutex_lock(&mutex_car_en[entrance_id]);
-
-    memcpy(a_car->license, license, 6);
-
-    /* add new car to the end of the list, updating list */
-    /* pointers as required */
-    if (num_car_entrance[entrance_id] == 0)
-    { /* special case - list is empty */
-        cars_en[entrance_id] = a_car;
-        last_car_en[entrance_id] = a_car;
-    }
-    else
-    {
-        last_car_en[entrance_id]->next = a_car;
-        last_car_en[entrance_id] = a_car;
-    }
-
-    /* increase total number of pending cars by one. */
-    num_car_entrance[entrance_id]++;
-
-    /* unlock mutex */
-    pthread_mutex_unlock(&mutex_car_en[entrance_id]);
-
-    /* signal the condition variable that the car is at the entrance */
-    pthread_cond_signal(&cond_car_en[entrance_id]);
-}
-
-struct car *get_car_entrance(int entrance_id)
-{
-    struct car *a_car; /* pointer to car.                 */
-
-    if (num_car_entrance[entrance_id] > 0)
-    {
-        a_car = cars_en[entrance_id];
-        cars_en[entrance_id] = a_car->next;
-        if (cars_en[entrance_id] == NULL)
-        { /* this was the last car on the list */
-            last_car_en[entrance_id] = NULL;
-        }
-        /* decrease the total number of pending cars */
-        num_car_entrance[entrance_id]--;
-    }
-    else
-    { /* cars list is empty */
-        a_car = NULL;
-    }
-
-    /* return the car to the caller. */
-    return a_car;
-}
-
-void simulate_car_entering(car_t *car, int entrance_id)
+void simulate_car_entering(const lane_car_t *car, int entrance_id)
 {
     pthread_mutex_lock(&en_lpr[entrance_id]->m);
     // printf("#%s is at the entrance %d\n", car->license, entrance_id + 1);
@@ -522,11 +304,15 @@ void simulate_car_entering(car_t *car, int entrance_id)
     memcpy(en_lpr[entrance_id]->license, car->license, 6);
     // wait 2ms for the lpr entrance to read
     usleep(2 * 1000);
-    pthread_mutex_unlock(&en_lpr[entrance_id]->m);
-    // signal the lpr entrance to read
-    pthread_cond_signal(&en_lpr[entrance_id]->c);
 
+    // hand the read to the manager while holding the ist, so the answer
+    // cannot be signalled before this car waits for it
     pthread_mutex_lock(&ist[entrance_id]->m);
+    uint32_t opens = bg_opens(en_bg[entrance_id]);
+    trace(TRACE_ARRIVE, TRACE_DEV(TRACE_ENTRANCE, entrance_id), car->license, 0);
+    lpr_ring_push(&rings->en[entrance_id], car->license);
+    pthread_mutex_unlock(&en_lpr[entrance_id]->m);
+
     //  wait for the ist
     pthread_cond_wait(&ist[entrance_id]->c, &ist[entrance_id]->m);
     if (ist[entrance_id]->s == 'X')
@@ -534,38 +320,27 @@ void simulate_car_entering(car_t *car, int entrance_id)
         // printf("ist says: %c\n", ist[entrance_id]->s);
         // this car is removed
         pthread_mutex_unlock(&ist[entrance_id]->m);
+        __atomic_fetch_add(&gen_refused[entrance_id], 1, __ATOMIC_RELAXED);
     }
     else if (ist[entrance_id]->s == 'F')
     {
         // printf("ist says: %c\n", ist[entrance_id]->s);
         // this car is removed
         pthread_mutex_unlock(&ist[entrance_id]->m);
+        __atomic_fetch_add(&gen_refused[entrance_id], 1, __ATOMIC_RELAXED);
     }
     else if (ist[entrance_id]->s > 48 && ist[entrance_id]->s < 54)
     {
         // printf("this car can be parked on level %c! \n", ist[entrance_id]->s);
+        // keep the level, the manager blanks the sign again later
+        char level = ist[entrance_id]->s;
         pthread_mutex_unlock(&ist[entrance_id]->m);
+        __atomic_fetch_add(&gen_admitted[entrance_id], 1, __ATOMIC_RELAXED);
 
-        pthread_mutex_lock(&en_bg[entrance_id]->m);
-        // printf("Entrance %d is raising the boomgate!\n", entrance_id + 1);
-        // raising for 10 ms
-        en_bg[entrance_id]->s = 'R';
-        usleep(10 * 1000);
-        pthread_cond_signal(&en_bg[entrance_id]->c);
-
-        // wait for the manager tells to close
-        pthread_cond_wait(&en_bg[entrance_id]->c, &en_bg[entrance_id]->m);
-        // lowering for 10 ms
-        // printf("Entrance %d is lowering the boomgate!\n", entrance_id + 1);
-        en_bg[entrance_id]->s = 'L';
-        usleep(10 * 1000);
-        pthread_cond_signal(&en_bg[entrance_id]->c);
-
-        // wait for the gate to fully close
-        pthread_cond_wait(&en_bg[entrance_id]->c, &en_bg[entrance_id]->m);
-        add_car_simulation(car, ist[entrance_id]->s, &mutex_car, &cond_car);
+        // drive in once the manager has had the gate raised for this car, see boomgate.c
+        bg_wait_open(en_bg[entrance_id], opens);
+        add_car_simulation(car->license, level, &mutex_car, &cond_car);
         // printf("Entrance  %d: %c\n", entrance_id + 1, en_bg[entrance_id]->s);
-        pthread_mutex_unlock(&en_bg[entrance_id]->m);
     }
     else
     {
@@ -575,30 +350,21 @@ void simulate_car_entering(car_t *car, int entrance_id)
 
 void *simulate_car_entering_handler(void *arg)
 {
-    car_t *a_car;
+    lane_car_t a_car;
     int id = *((int *)arg);
 
-    pthread_mutex_lock(&mutex_car_en[id]);
-
     // do forever
     for (;;)
     {
-        if (num_car_entrance[id] > 0 && !alarm_active)
-        {
-            a_car = get_car_entrance(id);
-            if (a_car)
-            {
-                pthread_mutex_unlock(&mutex_car_en[id]);
-                simulate_car_entering(a_car, id);
-                free(a_car);
-                pthread_mutex_lock(&mutex_car_en[id]);
-            }
-        }
-        else
+        // no one goes in once the alarm is on, the cars are left queuing
+        while (alarm_active)
         {
-            // wait for cars
-            pthread_cond_wait(&cond_car_en[id], &mutex_car_en[id]);
+            usleep(10 * 1000);
         }
+        // wait for cars
+        lane_pop(&lane_en[id], &a_car);
+        simulate_car_entering(&a_car, id);
+        lane_done(&lane_en[id]);
     }
 }
 
@@ -615,46 +381,115 @@ void *check_temp(void *arg) {
 }
 //--------------------entrance threads function ------------------
 
-void *generate_car_handler(void *arg)
+// called by the generator threads for every arriving car, which picks an
+// entrance by the route and joins its queue as the lane policy allows
+void arrive_car(const char *plate, int entrance_id)
 {
-    bool flag = true;
-    // do forever
-    for (;;)
-    {
-        // create a car
-        char *rand_license = random_cars(flag);
-        // assign cars to the entrance
-        int entrance_id = rand() % (int)(5);
-        queue_car_entrance(rand_license, entrance_id);
-
-        flag = !flag;
-        // sleep(1);
-        usleep((rand() % 100) * 1000);
-    }
+    lane_push(lane_en, ENTRANCES, lane_route(lane_en, ENTRANCES, &route_en, entrance_id), plate, 0, lane_policy);
+}
+
+void usage()
+{
+    printf("Usage: ./simulator [OPTIONS] [SIMULATION TIME (in seconds)] [TEMP TYPE (1, 2 or 3)]\n");
+    printf("  -p poisson|burst|fixed  arrival profile (default poisson)\n");
+    printf("  -r RATE                 arrivals per second (default 20)\n");
+    printf("  -w RATIO                share of whitelisted plates, 0 to 1 (default 0.5)\n");
+    printf("  -W W1,W2,W3,W4,W5       relative weight of each entrance (default 1,1,1,1,1)\n");
+    printf("  -t THREADS              generator threads (default 1)\n");
+    printf("  -q CARS                 cars each entrance and exit lane holds (default %d)\n", LANE_DEFAULT_CAP);
+    printf("  -f block|drop|divert    what a car does when its entrance lane is full (default block),\n");
+    printf("                          one leaving waits for its exit unless diverting\n");
+    printf("  -R ROUTE                how arrivals pick an entrance: uniform, weighted (by -W, the default),\n");
+    printf("                          jsq (shortest queue) or p2c (shorter of two)\n");
+    printf("  -X ROUTE                how leaving cars pick an exit, as -R (default uniform)\n");
+    printf("  -E E1,E2,E3,E4,E5       relative weight of each exit (default 1,1,1,1,1)\n");
+    exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc < 3)
+    double exit_weight[EXITS] = {1, 1, 1, 1, 1};
+    int opt;
+    while ((opt = getopt(argc, argv, "p:r:w:W:t:q:f:R:X:E:")) != -1)
     {
-        printf("Usage: ./simulator [SIMULATION TIME (in seconds)] [TEMP TYPE (1, 2 or 3)]\n");
-        exit(1);
+        switch (opt)
+        {
+        case 'p':
+            if ((int)(gen_cfg.profile = gen_parse_profile(optarg)) < 0)
+            {
+                usage();
+            }
+            break;
+        case 'r':
+            gen_cfg.rate = atof(optarg);
+            break;
+        case 'w':
+            gen_cfg.whitelist_ratio = atof(optarg);
+            break;
+        case 'W':
+            if (!gen_parse_weights(optarg, gen_cfg.weight))
+            {
+                usage();
+            }
+            break;
+        case 't':
+            gen_cfg.threads = atoi(optarg);
+            break;
+        case 'q':
+            if (atoi(optarg) < 1)
+            {
+                usage();
+            }
+            lane_cap = atoi(optarg);
+            break;
+        case 'f':
+            if ((int)(lane_policy = lane_parse_policy(optarg)) < 0)
+            {
+                usage();
+            }
+            break;
+        case 'R':
+            if ((int)(route_en.route = lane_parse_route(optarg)) < 0)
+            {
+                usage();
+            }
+            break;
+        case 'X':
+            if ((int)(route_ex.route = lane_parse_route(optarg)) < 0)
+            {
+                usage();
+            }
+            break;
+        case 'E':
+            if (!gen_parse_weights(optarg, exit_weight))
+            {
+                usage();
+            }
+            break;
+        default:
+            usage();
+        }
     }
-
-    temp_type = atoi(argv[2]);
+    if (argc - optind < 2 || !lane_router_weights(&route_ex, exit_weight, EXITS))
+    {
+        usage();
+    }
+    char *sim_time = argv[optind];
+    temp_type = atoi(argv[optind + 1]);
+    ts_init();
+    trace_start("simulator");
+    place_init("simulator");
 
     // attributes for mutex and cond
     pthread_mutexattr_t m_shared;
     pthread_condattr_t c_shared;
 
-    // for creating random liceneses
-    pthread_t *generate_car;
     pthread_t *simulate_car;
     pthread_t *queuing_cars_entrance;
     pthread_t *queuing_cars_exit;
     pthread_t *temp_threads;
+    pthread_t gate_threads[ENTRANCES + EXITS];
 
-    int generate_id = 1;
     int thread_id = 1;
     int en_id[ENTRANCES];
     int ex_id[EXITS];
@@ -670,9 +505,22 @@ int main(int argc, char *argv[])
     ftruncate(shm_fd, SHARE_SIZE);
     // get the address and save it in the pointer
     ptr = (void *)mmap(0, SHARE_SIZE, PROT_WRITE | PROT_READ, MAP_SHARED, shm_fd, 0);
+    // and the segment for the device rings
+    rings = rings_open(true);
+    if (rings == NULL)
+    {
+        exit(1);
+    }
 
-    // store plates
-    store_plates();
+    // map the plates, building the shared whitelist if no one has yet
+    whitelist = whitelist_open("plates.txt");
+    if (whitelist == NULL)
+    {
+        exit(1);
+    }
+    place_hot("PARKING", ptr, SHARE_SIZE, true);
+    place_hot(RINGS_NAME, rings, sizeof(rings_t), true);
+    place_hot(WHITELIST_NAME, whitelist, whitelist->size, false);
 
     // make sure the pthread mutex is sharable by creating attr
     pthread_mutexattr_init(&m_shared);
@@ -719,24 +567,20 @@ int main(int argc, char *argv[])
         pthread_cond_init(&ex_lpr[i]->c, &c_shared);
         pthread_cond_init(&lv_lpr[i]->c, &c_shared);
 
-        // mutexes and cond for bg
-        pthread_mutex_init(&en_bg[i]->m, &m_shared);
-        pthread_mutex_init(&ex_bg[i]->m, &m_shared);
-
-        pthread_cond_init(&en_bg[i]->c, &c_shared);
-        pthread_cond_init(&ex_bg[i]->c, &c_shared);
+        // the gates start closed
+        bg_init(en_bg[i], &m_shared, &c_shared);
+        bg_init(ex_bg[i], &m_shared, &c_shared);
 
         // mutexes and cond for ist
         pthread_mutex_init(&ist[i]->m, &m_shared);
         pthread_cond_init(&ist[i]->c, &c_shared);
 
-        // mutexes and conds for queuing the entrance
-        pthread_mutex_init(&mutex_car_en[i], &m_shared);
-        pthread_cond_init(&cond_car_en[i], &c_shared);
-
-        // mutexes and conds for queuing the entrance
-        pthread_mutex_init(&mutex_car_ex[i], &m_shared);
-        pthread_cond_init(&cond_car_ex[i], &c_shared);
+        // the lanes queuing at the entrance and the exit
+        if (!lane_init(&lane_en[i], lane_cap, &m_shared, &c_shared) || !lane_init(&lane_ex[i], lane_cap, &m_shared, &c_shared))
+        {
+            fprintf(stderr, "lanes: out of memory\n");
+            exit(1);
+        }
     }
 
     *(char *)(ptr + 2919) = 1;
@@ -746,12 +590,25 @@ int main(int argc, char *argv[])
     {
     };
 
+    // the gates themselves
+    for (int i = 0; i < ENTRANCES; i++)
+    {
+        pthread_create(&gate_threads[i], NULL, bg_run, en_bg[i]);
+        place_thread(gate_threads[i], PLACE_DEVICE);
+    }
+    for (int i = 0; i < EXITS; i++)
+    {
+        pthread_create(&gate_threads[ENTRANCES + i], NULL, bg_run, ex_bg[i]);
+        place_thread(gate_threads[ENTRANCES + i], PLACE_DEVICE);
+    }
+
     queuing_cars_exit = malloc(sizeof(pthread_t) * 5);
     // create threads for queuing cars at the entrance
     for (int i = 0; i < LEVELS; i++)
     {
         ex_id[i] = i;
         pthread_create(queuing_cars_exit + i, NULL, simulate_car_exiting_handler, (void *)&ex_id[i]);
+        place_thread(queuing_cars_exit[i], PLACE_DEVICE);
     }
 
     simulate_car = malloc(sizeof(pthread_t) * NUM_HANDLER_THREADS);
@@ -759,6 +616,7 @@ int main(int argc, char *argv[])
     for (int i = 0; i < NUM_HANDLER_THREADS; i++)
     {
         pthread_create(simulate_car, NULL, simulate_car_handler, (void *)&thread_id);
+        place_thread(*simulate_car, PLACE_DEVICE);
         thread_id++;
     }
 
@@ -768,6 +626,7 @@ int main(int argc, char *argv[])
     {
         lv_id[i] = i;
         pthread_create(temp_threads + i, NULL, simulate_temp, (void *)&lv_id[i]);
+        place_thread(temp_threads[i], PLACE_SENSOR);
     }
 
     queuing_cars_entrance = malloc(sizeof(pthread_t) * LEVELS);
@@ -777,17 +636,35 @@ int main(int argc, char *argv[])
         en_id[i] = i;
         pthread_create(queuing_cars_entrance + i, NULL, simulate_car_entering_handler, (void *)&en_id[i]);
         pthread_create(check_temp_threads + i, NULL, check_temp, (void *)&i);
+        place_thread(queuing_cars_entrance[i], PLACE_DEVICE);
+        place_thread(check_temp_threads[i], PLACE_SENSOR);
     }
 
-    generate_car = malloc(sizeof(pthread_t) * 1);
-    generate_id = 1;
-    pthread_create(generate_car, NULL, generate_car_handler, (void *)&generate_id);
-    // }
+    // start generating cars
+    gen_cfg.arrive = arrive_car;
+    gen_cfg.whitelist = whitelist;
+    if (!gen_start())
+    {
+        usage();
+    }
+    for (int i = 0; i < gen_cfg.threads; i++)
+    {
+        place_thread(gen_threads[i].thread, PLACE_DEVICE);
+    }
+    if (place_requested())
+    {
+        place_report(stdout);
+    }
 
-    sleep(atoi(argv[1]));
+    sleep(atoi(sim_time));
     // sleep(40);
     *(char *)(ptr + 2919) = 1;
 
+    gen_report(stdout);
+    lane_report(stdout, "entrance", lane_en, ENTRANCES, lane_policy, &route_en);
+    lane_report(stdout, "exit", lane_ex, EXITS, exit_policy(), &route_ex);
+    trace_flush();
+
     // destroy the segment
     if (munmap(ptr, SHARE_SIZE) != 0)
     {
@@ -797,8 +674,9 @@ int main(int argc, char *argv[])
     {
         perror("shm_unlink() failed");
     }
+    munmap(rings, sizeof(rings_t));
+    shm_unlink(RINGS_NAME);
 
-    free(generate_car);
     free(simulate_car);
     free(queuing_cars_entrance);
     free(queuing_cars_exit);
@@ -0,0 +1,124 @@
+#ifndef SNAPSHOT_C
+#define SNAPSHOT_C
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "header.h"
+#include "timestamp.c"
+
+/* ----------Status snapshot --------------*/
+// The manager's threads publish what they change (plates read, gates, signs,
+// counts, revenue) into one status record, and readers take a copy of the
+// whole record that is never half updated, without taking any device lock or
+// holding up a writer.
+//
+// The record is double buffered behind a sequence number in its own shared
+// segment, so tools outside the manager can read it as well. A publish
+// makes seq odd, writes the spare buffer, then makes seq even again, which
+// swaps the buffers. A reader copies the buffer seq points at and checks seq
+// afterwards: the copy is only torn if a writer got back round to that buffer
+// (seq moved on by 3 or more), in which case it copies again. Writers take
+// turns through a mutex private to the manager.
+
+#define STATUS_NAME "PARKING_STATUS"
+
+typedef struct status {
+    uint64_t ts;  // ts_now() when it was published
+    int total_cars;
+    int num_lv[LEVELS];
+    int64_t revenue;  // in cents
+    char en_plate[ENTRANCES][6];
+    char ex_plate[EXITS][6];
+    char lv_plate[LEVELS][6];
+    char en_gate[ENTRANCES];
+    char ex_gate[EXITS];
+    char sign[ENTRANCES];
+    unsigned short temp[LEVELS];
+    char alarm[LEVELS];
+    int alarm_active;
+    int tracked_cars;         // cars the manager holds state for as inside, sampled each display tick
+    int overstaying;          // cars inside past the overstay limit
+    unsigned long overstays;  // cars ever flagged as overstaying
+    char overstay_plate[6];   // the latest flagged
+} status_t;
+
+typedef struct status_shm {
+    uint32_t seq;  // odd while a publish is in progress
+    status_t buf[2] __attribute__((aligned(64)));
+} status_shm_t;
+
+static status_shm_t *status_shared;
+static status_t status_working;  // the writers' copy
+static pthread_mutex_t status_writer = PTHREAD_MUTEX_INITIALIZER;
+
+// Map the status segment.
+// pre: create is only true in the manager
+// post: (return == NULL AND the segment could not be mapped)
+//       OR (return points at the snapshot, emptied if create)
+status_shm_t *status_open(bool create) {
+    int fd = shm_open(STATUS_NAME, create ? O_CREAT | O_RDWR : O_RDONLY, S_IRWXU);
+    if (fd < 0 || (create && ftruncate(fd, sizeof(status_shm_t)) != 0)) {
+        perror(STATUS_NAME);
+        return NULL;
+    }
+    status_shm_t *s = mmap(0, sizeof(status_shm_t), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        perror(STATUS_NAME);
+        return NULL;
+    }
+    if (create) {
+        memset(s, 0, sizeof(status_shm_t));
+        status_shared = s;
+    }
+    return s;
+}
+
+// Start a change to the status.
+// pre: status_open(true) AND the caller does not already have a change open
+// post: the caller has the writers' copy to change, until status_publish()
+status_t *status_begin() {
+    pthread_mutex_lock(&status_writer);
+    return &status_working;
+}
+
+// Publish the writers' copy.
+// pre: status_begin()
+// post: readers see the change, the writers' copy is released
+void status_publish() {
+    status_shm_t *s = status_shared;
+    uint32_t seq = s->seq;
+
+    status_working.ts = ts_now();
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->buf[((seq + 2) >> 1) & 1] = status_working;
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&status_writer);
+}
+
+// Copy a consistent status.
+// pre: s was mapped with status_open()
+// post: *out is the status as of one publish
+void status_read(const status_shm_t *s, status_t *out) {
+    for (;;) {
+        uint32_t seq1 = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        *out = s->buf[(seq1 >> 1) & 1];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint32_t seq2 = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+        if (seq2 - (seq1 & ~1u) <= 2) {
+            return;
+        }
+    }
+}
+/* ----------Status snapshot --------------*/
+
+#endif
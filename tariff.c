@@ -0,0 +1,173 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "header.h"
+
+/* ----------Tariff engine --------------*/
+// The tariff file is compiled at startup into a per-minute table for every
+// level. Each minute holds its rate and the charge accumulated since midnight,
+// so the fee for any stay is a couple of table lookups and integer maths.
+//
+// Charges are kept in "cent-ms per hour" units (cents per hour * ms), which
+// keeps every sum exact; it is divided down to cents once, at the very end.
+
+#define TARIFF_MINUTES 1440
+#define TARIFF_MS_PER_MIN 60000ULL
+#define TARIFF_MS_PER_HOUR 3600000ULL
+#define TARIFF_MS_PER_DAY 86400000ULL
+
+typedef struct tariff {
+    uint64_t rate[LEVELS][TARIFF_MINUTES];     // cents per hour during that minute
+    uint64_t cum[LEVELS][TARIFF_MINUTES + 1];  // charge from midnight to the start of the minute
+    uint64_t day[LEVELS];                      // charge for a whole day (capped)
+    uint64_t grace_ms;                         // stays shorter than this are free
+    uint64_t cap;                              // most charged per 24 hours, 0 = no cap
+    int64_t tz_ms;                             // offset of local time from UTC
+} tariff_t;
+
+// parse "HH:MM" into minutes since midnight, "24:00" is allowed as an end
+static int tariff_minute(const char *s) {
+    int hh, mm;
+    if (sscanf(s, "%d:%d", &hh, &mm) != 2 || hh < 0 || mm < 0 || mm > 59 || hh * 60 + mm > TARIFF_MINUTES) {
+        return -1;
+    }
+    return hh * 60 + mm;
+}
+
+// build the per-level rate and cumulative tables from the per-minute base rates
+static void tariff_compile(tariff_t *t, const uint64_t *base, const unsigned *percent) {
+    for (int l = 0; l < LEVELS; l++) {
+        t->cum[l][0] = 0;
+        for (int m = 0; m < TARIFF_MINUTES; m++) {
+            t->rate[l][m] = base[m] * percent[l] / 100;
+            t->cum[l][m + 1] = t->cum[l][m] + t->rate[l][m] * TARIFF_MS_PER_MIN;
+        }
+        t->day[l] = t->cum[l][TARIFF_MINUTES];
+        if (t->cap && t->day[l] > t->cap) {
+            t->day[l] = t->cap;
+        }
+    }
+}
+
+// the tariff used when no file is given: a flat 5 cents per millisecond
+void tariff_default(tariff_t *t) {
+    static uint64_t base[TARIFF_MINUTES];
+    unsigned percent[LEVELS];
+
+    for (int m = 0; m < TARIFF_MINUTES; m++) {
+        base[m] = 5 * TARIFF_MS_PER_HOUR;
+    }
+    for (int l = 0; l < LEVELS; l++) {
+        percent[l] = 100;
+    }
+    t->grace_ms = 0;
+    t->cap = 0;
+    t->tz_ms = 0;
+    tariff_compile(t, base, percent);
+}
+
+// Load and compile a tariff definition file.
+// pre: true
+// post: (return == false AND the file could not be read or parsed)
+//       OR (t holds the compiled tariff)
+bool tariff_load(tariff_t *t, const char *path) {
+    static uint64_t base[TARIFF_MINUTES];
+    unsigned percent[LEVELS];
+    char line[128];
+    int line_no = 0;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    memset(base, 0, sizeof(base));
+    for (int l = 0; l < LEVELS; l++) {
+        percent[l] = 100;
+    }
+    t->grace_ms = 0;
+    t->cap = 0;
+    t->tz_ms = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        char key[16], a[16], b[16];
+        uint64_t value;
+        int n;
+
+        line_no++;
+        line[strcspn(line, "#\n")] = 0;
+        n = sscanf(line, "%15s", key);
+        if (n != 1) {
+            continue;  // blank or comment
+        }
+
+        if (strcmp(key, "band") == 0 && sscanf(line, "%*s %15s %15s %" SCNu64, a, b, &value) == 3) {
+            int from = tariff_minute(a);
+            int to = tariff_minute(b);
+            if (from < 0 || from == TARIFF_MINUTES || to < 0 || from == to) {
+                goto bad;
+            }
+            // a band may wrap past midnight, e.g. 22:00 06:00
+            int len = (to - from + TARIFF_MINUTES) % TARIFF_MINUTES;
+            if (len == 0) {
+                len = TARIFF_MINUTES;  // 00:00 24:00
+            }
+            for (int m = 0; m < len; m++) {
+                base[(from + m) % TARIFF_MINUTES] = value;
+            }
+        } else if (strcmp(key, "level") == 0 && sscanf(line, "%*s %d %" SCNu64, &n, &value) == 2) {
+            if (n < 1 || n > LEVELS) {
+                goto bad;
+            }
+            percent[n - 1] = value;
+        } else if (strcmp(key, "grace") == 0 && sscanf(line, "%*s %" SCNu64, &value) == 1) {
+            t->grace_ms = value;
+        } else if (strcmp(key, "cap") == 0 && sscanf(line, "%*s %" SCNu64, &value) == 1) {
+            t->cap = value * TARIFF_MS_PER_HOUR;
+        } else if (strcmp(key, "tz") == 0 && sscanf(line, "%*s %d", &n) == 1 && n > -1440 && n < 1440) {
+            t->tz_ms = (int64_t)n * (int64_t)TARIFF_MS_PER_MIN;
+        } else {
+            goto bad;
+        }
+    }
+    fclose(f);
+    tariff_compile(t, base, percent);
+    return true;
+
+bad:
+    fprintf(stderr, "%s:%d: bad tariff line\n", path, line_no);
+    fclose(f);
+    return false;
+}
+
+// charge from local midnight up to ms into the day
+static inline uint64_t tariff_charge(const tariff_t *t, int level, uint64_t ms) {
+    uint64_t m = ms / TARIFF_MS_PER_MIN;
+    return t->cum[level][m] + t->rate[level][m] * (ms - m * TARIFF_MS_PER_MIN);
+}
+
+// Fee in cents for a stay on level (0 based) between two wall clock times in
+// ms since the epoch. Constant time: whole days are charged at the (capped)
+// daily amount and the remainder is the difference of two table lookups.
+static inline int64_t tariff_fee(const tariff_t *t, int level, uint64_t entry_ms, uint64_t exit_ms) {
+    if (exit_ms <= entry_ms || exit_ms - entry_ms < t->grace_ms) {
+        return 0;
+    }
+    uint64_t stay = exit_ms - entry_ms;
+    uint64_t days = stay / TARIFF_MS_PER_DAY;
+    uint64_t from = (entry_ms + TARIFF_MS_PER_DAY + t->tz_ms) % TARIFF_MS_PER_DAY;
+    uint64_t to = (exit_ms + TARIFF_MS_PER_DAY + t->tz_ms) % TARIFF_MS_PER_DAY;
+
+    uint64_t part = tariff_charge(t, level, to) - tariff_charge(t, level, from);
+    if (to < from) {  // the remainder runs past midnight
+        part += t->cum[level][TARIFF_MINUTES];
+    }
+    if (t->cap && part > t->cap) {
+        part = t->cap;
+    }
+    return (int64_t)((days * t->day[level] + part) / TARIFF_MS_PER_HOUR);
+}
+/* ----------Tariff engine --------------*/
@@ -0,0 +1,64 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tariff.c"
+
+// microbenchmark for the tariff engine: how many fees per second it can price
+// usage: ./tariff_bench [TARIFF FILE] [NUMBER OF STAYS]
+
+#define DEFAULT_STAYS 10000000
+
+typedef struct stay {
+    uint64_t entry_ms;
+    uint64_t exit_ms;
+    int level;
+} stay_t;
+
+static double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = argc > 1 ? argv[1] : "tariff.txt";
+    long n = argc > 2 ? atol(argv[2]) : DEFAULT_STAYS;
+    static tariff_t tariff;
+
+    if (!tariff_load(&tariff, path)) {
+        printf("failed to load %s, using the flat default rate\n", path);
+        tariff_default(&tariff);
+    }
+
+    stay_t *stays = malloc(sizeof(stay_t) * n);
+    if (!stays) {
+        fprintf(stderr, "tariff_bench: out of memory\n");
+        exit(1);
+    }
+
+    // stays from a few ms up to three days, starting anywhere in a week
+    srand(403);
+    uint64_t base = 1660000000000ULL;
+    for (long i = 0; i < n; i++) {
+        uint64_t start = base + ((uint64_t)rand() * 7919) % (7 * TARIFF_MS_PER_DAY);
+        uint64_t length = ((uint64_t)rand() * rand()) % (3 * TARIFF_MS_PER_DAY);
+        stays[i].entry_ms = start;
+        stays[i].exit_ms = start + length;
+        stays[i].level = rand() % LEVELS;
+    }
+
+    double start = now_sec();
+    int64_t total = 0;
+    for (long i = 0; i < n; i++) {
+        total += tariff_fee(&tariff, stays[i].level, stays[i].entry_ms, stays[i].exit_ms);
+    }
+    double elapsed = now_sec() - start;
+
+    printf("%ld fees in %.3f s: %.1f M fees/s (%.2f ns/fee)\n", n, elapsed, n / elapsed / 1e6, elapsed * 1e9 / n);
+    printf("total billed: $%" PRId64 ".%02" PRId64 "\n", total / 100, total % 100);
+
+    free(stays);
+    return 0;
+}
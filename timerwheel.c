@@ -0,0 +1,194 @@
+#ifndef TIMERWHEEL_C
+#define TIMERWHEEL_C
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "timestamp.c"
+
+/* ----------Timer wheel --------------*/
+// Hierarchical timing wheel with 1 ms ticks for the manager's scheduled
+// actions. Threads register a deadline and carry on; the wheel thread runs
+// the callback when it is due. Level 0 has a slot per tick for the next 64 ms,
+// each level above covers 64 times as much, so 4 levels reach about 4.6 hours.
+// Timers further out wait in the top level and are placed again as it turns.
+//
+// Timers are owned by the caller (no allocation) and callbacks run on the
+// wheel thread without the wheel locked, so they may add or cancel timers.
+// Callbacks run one after another, so one that waits delays every timer due
+// after it on the same wheel. A callback may take a lock, but timers that
+// must not wait behind others' locks go on a wheel of their own: the
+// manager's gate wheel runs only close_gate(), which takes just its gate's.
+
+#define TW_BITS 6
+#define TW_SLOTS (1 << TW_BITS)
+#define TW_LEVELS 4
+#define TW_TICK_NS 1000000ULL
+#define TW_RANGE (1ULL << (TW_BITS * TW_LEVELS))
+
+typedef void (*tw_fn)(void *arg);
+
+typedef struct tw_timer tw_timer_t;
+struct tw_timer {
+    tw_timer_t *next;
+    tw_timer_t *prev;
+    tw_timer_t **slot;  // slot it is in while pending
+    uint64_t expires;  // tick it is due on
+    uint64_t period;   // ticks between runs, 0 for a one shot
+    tw_fn fn;
+    void *arg;
+    bool pending;
+};
+
+typedef struct timer_wheel {
+    pthread_mutex_t m;
+    tw_timer_t *slots[TW_LEVELS][TW_SLOTS];
+    uint64_t now;      // last tick processed
+    uint64_t base_ns;  // ts_now() at tick 0
+    unsigned long fired;
+} timer_wheel_t;
+
+// put a timer in the slot for its deadline, wheel locked
+static void tw_place(timer_wheel_t *tw, tw_timer_t *t) {
+    if (t->expires < tw->now) {
+        t->expires = tw->now;  // due now, runs this tick
+    }
+    uint64_t delta = t->expires - tw->now;
+    uint64_t at = t->expires;
+    int level = 0;
+
+    if (delta >= TW_RANGE) {
+        at = tw->now + TW_RANGE - 1;  // park it as far out as the wheel reaches
+    }
+    while (level < TW_LEVELS - 1 && (at - tw->now) >= (1ULL << (TW_BITS * (level + 1)))) {
+        level++;
+    }
+    tw_timer_t **slot = &tw->slots[level][(at >> (TW_BITS * level)) & (TW_SLOTS - 1)];
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot) {
+        (*slot)->prev = t;
+    }
+    *slot = t;
+    t->pending = true;
+}
+
+// take a timer out of its slot, wheel locked
+static void tw_unlink(timer_wheel_t *tw, tw_timer_t *t) {
+    if (t->prev) {
+        t->prev->next = t->next;
+    } else {
+        *t->slot = t->next;
+    }
+    if (t->next) {
+        t->next->prev = t->prev;
+    }
+    t->next = t->prev = NULL;
+    t->slot = NULL;
+    t->pending = false;
+}
+
+// Initialise the wheel at tick 0.
+// pre: ts_init()
+// post: the wheel is empty
+void tw_init(timer_wheel_t *tw) {
+    memset(tw, 0, sizeof(*tw));
+    pthread_mutex_init(&tw->m, NULL);
+    tw->base_ns = ts_now();
+}
+
+// (Re)arm a timer to call fn(arg) in delay_ms, then every period_ms if not 0.
+// pre: true
+// post: the timer is pending, any earlier deadline it had is replaced
+void tw_add(timer_wheel_t *tw, tw_timer_t *t, uint64_t delay_ms, uint64_t period_ms, tw_fn fn, void *arg) {
+    pthread_mutex_lock(&tw->m);
+    if (t->pending) {
+        tw_unlink(tw, t);
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->period = period_ms;
+    t->expires = tw->now + (delay_ms ? delay_ms : 1);
+    tw_place(tw, t);
+    pthread_mutex_unlock(&tw->m);
+}
+
+// Cancel a timer.
+// pre: true
+// post: (return == true AND the timer was pending and will not run)
+//       OR (return == false AND the timer was not pending)
+bool tw_cancel(timer_wheel_t *tw, tw_timer_t *t) {
+    bool was_pending;
+    pthread_mutex_lock(&tw->m);
+    was_pending = t->pending;
+    if (was_pending) {
+        tw_unlink(tw, t);
+    }
+    pthread_mutex_unlock(&tw->m);
+    return was_pending;
+}
+
+// Run everything due up to and including tick.
+// pre: true
+// post: tw->now == tick AND every timer due by tick has run
+void tw_advance(timer_wheel_t *tw, uint64_t tick) {
+    pthread_mutex_lock(&tw->m);
+    while (tw->now < tick) {
+        tw->now++;
+
+        // when a level wraps, spread the next slot of the level above down
+        for (int l = 1; l < TW_LEVELS; l++) {
+            if ((tw->now & ((1ULL << (TW_BITS * l)) - 1)) != 0) {
+                break;
+            }
+            tw_timer_t **slot = &tw->slots[l][(tw->now >> (TW_BITS * l)) & (TW_SLOTS - 1)];
+            tw_timer_t *t;
+            while ((t = *slot) != NULL) {
+                tw_unlink(tw, t);
+                tw_place(tw, t);
+            }
+        }
+
+        // the slot stays the only list of what is due, so timers in it can
+        // still be cancelled or re-armed while a callback runs unlocked
+        tw_timer_t **slot = &tw->slots[0][tw->now & (TW_SLOTS - 1)];
+        tw_timer_t *t;
+        while ((t = *slot) != NULL) {
+            tw_unlink(tw, t);
+            if (t->expires > tw->now) {
+                tw_place(tw, t);  // parked beyond the wheel's reach
+                continue;
+            }
+            if (t->period) {
+                t->expires = tw->now + t->period;
+                tw_place(tw, t);
+            }
+            tw_fn fn = t->fn;
+            void *arg = t->arg;
+            tw->fired++;
+            pthread_mutex_unlock(&tw->m);
+            fn(arg);
+            pthread_mutex_lock(&tw->m);
+        }
+    }
+    pthread_mutex_unlock(&tw->m);
+}
+
+// the wheel thread, ticks every ms
+void *tw_run(void *arg) {
+    timer_wheel_t *tw = arg;
+    for (;;) {
+        uint64_t next = tw->base_ns + (tw->now + 1) * TW_TICK_NS;
+        struct timespec until = {next / 1000000000ULL, next % 1000000000ULL};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+        tw_advance(tw, (ts_now() - tw->base_ns) / TW_TICK_NS);
+    }
+    return NULL;
+}
+/* ----------Timer wheel --------------*/
+
+#endif
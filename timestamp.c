@@ -0,0 +1,93 @@
+#ifndef TIMESTAMP_C
+#define TIMESTAMP_C
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+/* ----------Timestamps --------------*/
+// All hot-path stamps are nanoseconds on the monotonic clock, so they never
+// jump when NTP steps the wall clock. Set PARK_TSC=1 to read the CPU's
+// invariant TSC instead, scaled to nanoseconds by a calibration at startup.
+// Wall clock time is only worked out when it is needed, e.g. for the ledger.
+
+static uint64_t ts_mono_base;  // monotonic ns at ts_init()
+static uint64_t ts_wall_base;  // realtime ns at the same moment
+static bool ts_use_tsc = false;
+static uint64_t ts_tsc_base;
+static uint64_t ts_tsc_mult;  // ns per cycle, 32.32 fixed point
+
+static inline uint64_t ts_clock(clockid_t clock) {
+    struct timespec t;
+    clock_gettime(clock, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// current monotonic time in ns
+static inline uint64_t ts_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (ts_use_tsc) {
+        uint64_t cycles = __rdtsc() - ts_tsc_base;
+        return ts_mono_base + (uint64_t)(((unsigned __int128)cycles * ts_tsc_mult) >> 32);
+    }
+#endif
+    return ts_clock(CLOCK_MONOTONIC);
+}
+
+// ns since an earlier stamp, for latency measurements
+static inline uint64_t ts_elapsed_ns(uint64_t since) {
+    return ts_now() - since;
+}
+
+// wall clock ms since the epoch for a stamp, for the ledger only
+static inline uint64_t ts_to_wall_ms(uint64_t ts) {
+    return (ts_wall_base + (ts - ts_mono_base)) / 1000000;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// the TSC is only usable as a clock if it ticks at a constant rate in all states
+static bool ts_tsc_invariant() {
+    unsigned a, b, c, d;
+    if (!__get_cpuid(0x80000007, &a, &b, &c, &d)) {
+        return false;
+    }
+    return (d >> 8) & 1;
+}
+
+// measure the TSC against the monotonic clock over about 20 ms
+static void ts_tsc_calibrate() {
+    struct timespec pause = {0, 20 * 1000 * 1000};
+    uint64_t ns0 = ts_clock(CLOCK_MONOTONIC);
+    uint64_t tsc0 = __rdtsc();
+    nanosleep(&pause, NULL);
+    uint64_t ns1 = ts_clock(CLOCK_MONOTONIC);
+    uint64_t tsc1 = __rdtsc();
+
+    ts_tsc_mult = ((ns1 - ns0) << 32) / (tsc1 - tsc0);
+    ts_tsc_base = tsc1;
+    ts_mono_base = ns1;
+}
+#endif
+
+// Pick the clock source and record the monotonic/wall clock pair.
+// pre: true
+// post: ts_now() and ts_to_wall_ms() are usable
+void ts_init() {
+    ts_mono_base = ts_clock(CLOCK_MONOTONIC);
+#if defined(__x86_64__) || defined(__i386__)
+    char *tsc = getenv("PARK_TSC");
+    if (tsc != NULL && atoi(tsc) && ts_tsc_invariant()) {
+        ts_tsc_calibrate();
+        ts_use_tsc = true;
+    }
+#endif
+    ts_wall_base = ts_clock(CLOCK_REALTIME) - (ts_clock(CLOCK_MONOTONIC) - ts_mono_base);
+}
+/* ----------Timestamps --------------*/
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef TRACE_C
+#define TRACE_C
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "timestamp.c"
+
+/* ----------Event trace --------------*/
+// A flight recorder for the hot paths. Each thread writes fixed size binary
+// events (time, device, plate, what happened) into a ring of its own, so
+// tracing takes no lock and never waits; when a ring is full the oldest
+// events are overwritten. The rings are written to a file on request, and
+// parktrace turns the file into a timeline or a Chrome trace.
+//
+// Tracing is off unless PARK_TRACE names the file at startup. SIGUSR1
+// turns it on or off while running and SIGUSR2 appends what the rings hold
+// to the file (PARK_TRACE, or TRACE_FILE if that is not set); trace_flush()
+// does the same from the code, e.g. on the way out.
+//
+// Each flush appends one chunk: a header saying which process wrote it and
+// how its clock maps to the wall clock, then the events. Chunks from several
+// processes can go into the same file.
+
+#define TRACE_FILE "carpark.trace"
+#define TRACE_MAGIC 0x52544b50  // "PKTR"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE 4096  // events per thread, a power of two
+#define TRACE_MAX_THREADS 128
+
+// what happened
+enum {
+    TRACE_LPR = 1,  // manager took a plate read off a ring, arg = ns it waited there
+    TRACE_SIGN,     // manager set an entrance sign, arg = the character shown
+    TRACE_GATE,     // a gate changed state, arg = from << 8 | to
+    TRACE_BILL,     // manager billed a car, arg = cents
+    TRACE_ALARM,    // manager saw the fire alarm
+    TRACE_ARRIVE,   // simulator: a car reached an lpr
+    TRACE_OVERSTAY, // manager: a car is still inside past the limit, arg = ms it has been in
+    TRACE_TYPES
+};
+
+// where it happened
+enum {
+    TRACE_NONE = 0,
+    TRACE_ENTRANCE,
+    TRACE_EXIT,
+    TRACE_LEVEL
+};
+#define TRACE_DEV(kind, i) ((uint16_t)((kind) << 8 | (i)))
+
+typedef struct trace_event {
+    uint64_t ts;  // ts_now()
+    uint64_t arg;
+    uint32_t tid;
+    uint16_t type;
+    uint16_t device;  // TRACE_DEV(kind, index)
+    char plate[6];
+    char pad[2];
+} trace_event_t;
+
+typedef struct trace_chunk {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t event_size;  // sizeof(trace_event_t)
+    int32_t pid;
+    uint32_t count;        // events after this header
+    char process[16];
+    uint64_t wall_base;    // ns since the epoch at mono_base
+    uint64_t mono_base;    // ts_now() at wall_base
+} trace_chunk_t;
+
+typedef struct trace_ring {
+    uint64_t head;     // events written
+    uint64_t flushed;  // events already in the file, only the flusher uses it
+    uint32_t tid;
+    trace_event_t ev[TRACE_RING_SIZE] __attribute__((aligned(64)));
+} trace_ring_t;
+
+static int trace_on;
+static __thread trace_ring_t *trace_self;
+static trace_ring_t *trace_rings[TRACE_MAX_THREADS];
+static int trace_nrings;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;  // rings list and the file
+static sem_t trace_requests;
+static int trace_toggles;  // SIGUSR1s not yet acted on
+static int trace_flushes;  // SIGUSR2s not yet acted on
+static const char *trace_path = TRACE_FILE;
+static char trace_process[16];
+
+// give the calling thread a ring, NULL once TRACE_MAX_THREADS have one
+static trace_ring_t *trace_attach() {
+    trace_ring_t *r = NULL;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_nrings < TRACE_MAX_THREADS && posix_memalign((void **)&r, 64, sizeof(trace_ring_t)) == 0) {
+        memset(r, 0, sizeof(trace_ring_t));
+        r->tid = syscall(SYS_gettid);
+        trace_rings[trace_nrings] = r;
+        __atomic_store_n(&trace_nrings, trace_nrings + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    trace_self = r;
+    return r;
+}
+
+// Record an event, if tracing is on.
+// pre: plate is NULL or 6 characters
+// post: the event is in the calling thread's ring
+static inline void trace(uint16_t type, uint16_t device, const char *plate, uint64_t arg) {
+    if (!__atomic_load_n(&trace_on, __ATOMIC_RELAXED)) {
+        return;
+    }
+    trace_ring_t *r = trace_self;
+    if (r == NULL && (r = trace_attach()) == NULL) {
+        return;
+    }
+    uint64_t head = r->head;
+    trace_event_t *e = &r->ev[head & (TRACE_RING_SIZE - 1)];
+    e->ts = ts_now();
+    e->arg = arg;
+    e->tid = r->tid;
+    e->type = type;
+    e->device = device;
+    if (plate != NULL) {
+        memcpy(e->plate, plate, 6);
+    } else {
+        memset(e->plate, 0, 6);
+    }
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// copy the events of r not yet flushed, oldest first, returns how many
+static size_t trace_collect(trace_ring_t *r, trace_event_t *out) {
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t from = r->flushed;
+    if (head - from > TRACE_RING_SIZE) {
+        from = head - TRACE_RING_SIZE;
+    }
+    for (uint64_t i = from; i < head; i++) {
+        out[i - from] = r->ev[i & (TRACE_RING_SIZE - 1)];
+    }
+    // anything the writer got back round to while it was copied is dropped;
+    // the slot of the event it writes next is already suspect
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t now = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    uint64_t valid = now + 1 > TRACE_RING_SIZE ? now + 1 - TRACE_RING_SIZE : 0;
+    size_t skip = valid > from ? valid - from : 0;
+    r->flushed = head;
+    if (skip >= head - from) {
+        return 0;
+    }
+    memmove(out, out + skip, (head - from - skip) * sizeof(trace_event_t));
+    return head - from - skip;
+}
+
+// Append every ring's new events to the trace file as one chunk.
+// pre: true
+// post: (return == -1 AND the file could not be written)
+//       OR return events were appended, none and no chunk if there were none
+int trace_flush() {
+    pthread_mutex_lock(&trace_lock);
+    int n = __atomic_load_n(&trace_nrings, __ATOMIC_ACQUIRE);
+    trace_event_t *events = malloc(sizeof(trace_event_t) * TRACE_RING_SIZE * (n > 0 ? n : 1));
+    if (events == NULL) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+    size_t count = 0;
+    for (int i = 0; i < n; i++) {
+        count += trace_collect(trace_rings[i], events + count);
+    }
+    if (count == 0) {
+        free(events);
+        pthread_mutex_unlock(&trace_lock);
+        return 0;
+    }
+
+    trace_chunk_t chunk = {TRACE_MAGIC, TRACE_VERSION, sizeof(trace_event_t), getpid(), count};
+    memcpy(chunk.process, trace_process, sizeof(chunk.process));
+    chunk.wall_base = ts_wall_base;
+    chunk.mono_base = ts_mono_base;
+    struct iovec iov[2] = {{&chunk, sizeof(chunk)}, {events, count * sizeof(trace_event_t)}};
+
+    int written = -1;
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0) {
+        // one write per chunk, so chunks from different processes do not interleave
+        if (writev(fd, iov, 2) == (ssize_t)(iov[0].iov_len + iov[1].iov_len)) {
+            written = count;
+        }
+        close(fd);
+    }
+    free(events);
+    pthread_mutex_unlock(&trace_lock);
+    return written;
+}
+
+static void trace_signal(int sig) {
+    __atomic_fetch_add(sig == SIGUSR1 ? &trace_toggles : &trace_flushes, 1, __ATOMIC_RELAXED);
+    sem_post(&trace_requests);
+}
+
+// acts on SIGUSR1 and SIGUSR2 outside the signal handler; signals that came
+// in together are taken together, every toggle but one flush for them all
+static void *trace_run(void *arg) {
+    for (;;) {
+        while (sem_wait(&trace_requests) != 0 && errno == EINTR) {
+        }
+        for (int t = __atomic_exchange_n(&trace_toggles, 0, __ATOMIC_RELAXED); t > 0; t--) {
+            int on = !__atomic_load_n(&trace_on, __ATOMIC_RELAXED);
+            __atomic_store_n(&trace_on, on, __ATOMIC_RELAXED);
+            fprintf(stderr, "%s: tracing %s\n", trace_process, on ? "on" : "off");
+        }
+        if (__atomic_exchange_n(&trace_flushes, 0, __ATOMIC_RELAXED) > 0) {
+            int n = trace_flush();
+            fprintf(stderr, "%s: %d trace events appended to %s\n", trace_process, n, trace_path);
+        }
+    }
+    return NULL;
+}
+
+// Set up tracing for this process.
+// pre: ts_init()
+// post: tracing is on if PARK_TRACE is set, SIGUSR1 and SIGUSR2 control it
+void trace_start(const char *process) {
+    char *path = getenv("PARK_TRACE");
+    snprintf(trace_process, sizeof(trace_process), "%s", process);
+    if (path != NULL && *path != '\0') {
+        trace_path = path;
+        trace_on = 1;
+    }
+
+    pthread_t thread;
+    sem_init(&trace_requests, 0, 0);
+    pthread_create(&thread, NULL, trace_run, NULL);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = trace_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+}
+/* ----------Event trace --------------*/
+
+#endif
@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trace.c"
+
+// microbenchmark for the event trace: cost of one hot-path event, on and off
+// usage: PARK_TSC=1 ./trace_bench [NUMBER OF EVENTS]
+
+int main(int argc, char *argv[]) {
+    long n = argc > 1 ? atol(argv[1]) : 10000000;
+    const char plate[6] = {'0', '2', '9', 'M', 'Z', 'H'};
+
+    ts_init();
+
+    for (int on = 0; on <= 1; on++) {
+        trace_on = on;
+        uint64_t start = ts_clock(CLOCK_MONOTONIC);
+        for (long i = 0; i < n; i++) {
+            trace(TRACE_LPR, TRACE_DEV(TRACE_ENTRANCE, i & 3), plate, i);
+        }
+        uint64_t elapsed = ts_clock(CLOCK_MONOTONIC) - start;
+        printf("tracing %s (%s): %ld events, %.2f ns/event\n", on ? "on" : "off", ts_use_tsc ? "tsc" : "clock_gettime", n,
+               (double)elapsed / n);
+    }
+    return 0;
+}
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timestamp.c"
+
+// microbenchmark for the timestamp source: cost of one hot-path stamp
+// usage: PARK_TSC=1 ./ts_bench [NUMBER OF STAMPS]
+
+int main(int argc, char *argv[]) {
+    long n = argc > 1 ? atol(argv[1]) : 10000000;
+
+    ts_init();
+
+    uint64_t sink = 0;
+    uint64_t start = ts_clock(CLOCK_MONOTONIC);
+    for (long i = 0; i < n; i++) {
+        sink += ts_now();
+    }
+    uint64_t elapsed = ts_clock(CLOCK_MONOTONIC) - start;
+
+    printf("%s: %ld stamps, %.2f ns/stamp (%lu)\n", ts_use_tsc ? "tsc" : "clock_gettime", n, (double)elapsed / n, sink & 1);
+    printf("wall clock now: %lu ms\n", ts_to_wall_ms(ts_now()));
+    return 0;
+}
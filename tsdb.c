@@ -0,0 +1,327 @@
+#ifndef TSDB_C
+#define TSDB_C
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* ----------History store --------------*/
+// Occupancy and temperature history, kept for weeks in one memory mapped,
+// append only file. The file is a header block and then fixed size blocks,
+// each holding a run of samples from one series (one level's occupancy, one
+// sensor's temperature) compressed the way Gorilla does it:
+//
+//   - a block's first sample is kept whole in the block's header
+//   - each time after that as the change in its distance from the one
+//     before, 0 most of the time for a fixed rate, which takes one bit
+//   - each value as its difference from the one before, zigzagged so small
+//     changes either way take few bits, 0 for no change in one bit
+//
+// so a sample at a steady rate with no change costs 2 bits. Both fields use
+// a short prefix saying how many bits follow (see tsdb_put_varbits()).
+//
+// Only the manager writes the file. Samples are written before the block's
+// count is moved on, and a block before the header's count of blocks, so a
+// reader mapping the file at the same time only ever sees whole samples.
+// A manager that starts on an existing file leaves its blocks as they are and
+// starts new ones.
+
+#define TSDB_FILE "carpark.tsdb"
+#define TSDB_MAGIC 0x42445354  // "TSDB"
+#define TSDB_VERSION 1
+#define TSDB_BLOCK 4096
+#define TSDB_GROW 256                // blocks added to the file at a time
+#define TSDB_MAP_MAX (1ULL << 34)    // address space kept for the file to grow into
+#define TSDB_MAX_SERIES 64
+#define TSDB_NAME 32
+#define TSDB_SAMPLE_BITS (4 + 64 + 4 + 64)  // the most a sample can take
+
+typedef struct tsdb_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t block_size;
+    uint32_t nseries;
+    uint32_t reserved;
+    uint64_t blocks;  // in use, this one included
+    char series[TSDB_MAX_SERIES][TSDB_NAME];
+} tsdb_header_t;
+
+typedef struct tsdb_block {
+    uint16_t series;
+    uint16_t reserved;
+    uint32_t count;  // samples, the first in the fields below
+    uint32_t bits;   // of data in use
+    uint32_t reserved2;
+    int64_t first_ts;  // ms since the epoch
+    int64_t first_value;
+    int64_t last_ts;
+    int64_t last_value;
+    int64_t last_delta;  // between the last two times
+    int64_t min;
+    int64_t max;
+    uint8_t data[TSDB_BLOCK - 72];
+} tsdb_block_t;
+
+typedef struct tsdb {
+    int fd;
+    bool writable;
+    char *base;
+    tsdb_header_t *header;
+    uint64_t file_blocks;              // the file's size in blocks
+    uint64_t open[TSDB_MAX_SERIES];    // each series' block being filled, 0 for none
+} tsdb_t;
+
+// prefix lengths and the bits after them, per field, see tsdb_put_varbits()
+static const int tsdb_dod_bits[4] = {7, 12, 20, 64};
+static const int tsdb_value_bits[4] = {4, 10, 20, 64};
+
+static inline tsdb_block_t *tsdb_block(const tsdb_t *db, uint64_t i) {
+    return (tsdb_block_t *)(db->base + i * TSDB_BLOCK);
+}
+
+static inline uint64_t tsdb_zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t tsdb_unzigzag(uint64_t z) {
+    return (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+}
+
+// append the low n bits of v to the block's data, most significant first
+static void tsdb_put_bits(tsdb_block_t *b, uint64_t v, int n) {
+    uint32_t at = b->bits;
+    while (n > 0) {
+        int room = 8 - (at & 7);
+        int take = n < room ? n : room;
+        uint8_t part = (v >> (n - take)) & ((1u << take) - 1);
+        b->data[at >> 3] |= part << (room - take);
+        at += take;
+        n -= take;
+    }
+    b->bits = at;
+}
+
+// '0' for zero, else 1 to 4 ones (a 0 after fewer than 4) and the zigzagged
+// number in widths[ones - 1] bits
+static void tsdb_put_varbits(tsdb_block_t *b, int64_t v, const int widths[4]) {
+    uint64_t z = tsdb_zigzag(v);
+    if (z == 0) {
+        tsdb_put_bits(b, 0, 1);
+        return;
+    }
+    int k = 0;
+    while (k < 3 && z >= 1ULL << widths[k]) {
+        k++;
+    }
+    // k + 1 ones, then a 0 unless it is the last width
+    tsdb_put_bits(b, k < 3 ? (1u << (k + 2)) - 2 : 0xf, k < 3 ? k + 2 : 4);
+    tsdb_put_bits(b, z, widths[k]);
+}
+
+// Open the store at path, making it if it is not there and writable.
+// pre: only one process at a time opens a store writable
+// post: (return == NULL AND the file could not be opened, made or mapped)
+//       OR return is the store
+tsdb_t *tsdb_open(const char *path, bool writable) {
+    int fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (writable && st.st_size == 0 && ftruncate(fd, TSDB_BLOCK * TSDB_GROW) != 0)) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    // the mapping is as big as the file can grow to, so it never moves
+    char *base = mmap(0, TSDB_MAP_MAX, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    tsdb_t *db = calloc(1, sizeof(tsdb_t));
+    db->fd = fd;
+    db->writable = writable;
+    db->base = base;
+    db->header = (tsdb_header_t *)base;
+    db->file_blocks = st.st_size > 0 ? st.st_size / TSDB_BLOCK : TSDB_GROW;
+
+    tsdb_header_t *h = db->header;
+    if (writable && st.st_size == 0) {
+        h->version = TSDB_VERSION;
+        h->block_size = TSDB_BLOCK;
+        h->blocks = 1;
+        __atomic_store_n(&h->magic, TSDB_MAGIC, __ATOMIC_RELEASE);
+    }
+    if (db->file_blocks == 0 || __atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != TSDB_MAGIC || h->version != TSDB_VERSION ||
+        h->block_size != TSDB_BLOCK) {
+        fprintf(stderr, "%s: not a history store\n", path);
+        munmap(base, TSDB_MAP_MAX);
+        close(fd);
+        free(db);
+        return NULL;
+    }
+    return db;
+}
+
+void tsdb_close(tsdb_t *db) {
+    munmap(db->base, TSDB_MAP_MAX);
+    close(db->fd);
+    free(db);
+}
+
+// blocks a reader can look at, the header included
+static inline uint64_t tsdb_blocks(const tsdb_t *db) {
+    uint64_t n = __atomic_load_n(&db->header->blocks, __ATOMIC_ACQUIRE);
+    return n < db->file_blocks ? n : db->file_blocks;
+}
+
+// Find a series by name, adding it if the store is writable.
+// pre: true
+// post: (return == -1 AND there is no such series and it could not be added)
+//       OR return is the series' number
+int tsdb_series(tsdb_t *db, const char *name) {
+    tsdb_header_t *h = db->header;
+    for (uint32_t i = 0; i < h->nseries; i++) {
+        if (strncmp(h->series[i], name, TSDB_NAME) == 0) {
+            return i;
+        }
+    }
+    if (!db->writable || h->nseries == TSDB_MAX_SERIES) {
+        return -1;
+    }
+    snprintf(h->series[h->nseries], TSDB_NAME, "%s", name);
+    __atomic_store_n(&h->nseries, h->nseries + 1, __ATOMIC_RELEASE);
+    return h->nseries - 1;
+}
+
+// Make room in the file for n more blocks, so the next n tsdb_append()s,
+// which start a block at most each, cannot fail.
+// pre: db is writable AND n <= TSDB_GROW
+// post: (return == false AND the file could not grow) OR it has the room
+bool tsdb_reserve(tsdb_t *db, int n) {
+    uint64_t i = db->header->blocks;
+    if (i + n > db->file_blocks) {
+        uint64_t more = db->file_blocks + TSDB_GROW;
+        if (more * TSDB_BLOCK > TSDB_MAP_MAX || ftruncate(db->fd, more * TSDB_BLOCK) != 0) {
+            return false;
+        }
+        db->file_blocks = more;
+    }
+    return true;
+}
+
+// start a block for a series with its first sample, growing the file if need be
+static bool tsdb_start_block(tsdb_t *db, int series, int64_t ts, int64_t value) {
+    if (!tsdb_reserve(db, 1)) {
+        return false;
+    }
+    uint64_t i = db->header->blocks;
+    tsdb_block_t *b = tsdb_block(db, i);
+    memset(b, 0, sizeof(tsdb_block_t));
+    b->series = series;
+    b->first_ts = b->last_ts = ts;
+    b->first_value = b->last_value = b->min = b->max = value;
+    b->count = 1;
+    __atomic_store_n(&db->header->blocks, i + 1, __ATOMIC_RELEASE);
+    db->open[series] = i;
+    return true;
+}
+
+// Record a sample.
+// pre: db is writable AND series came from tsdb_series(db, ...)
+// post: (return == false AND the file could not grow) OR the sample is stored
+bool tsdb_append(tsdb_t *db, int series, int64_t ts, int64_t value) {
+    tsdb_block_t *b = db->open[series] != 0 ? tsdb_block(db, db->open[series]) : NULL;
+    if (b == NULL || b->bits + TSDB_SAMPLE_BITS > sizeof(b->data) * 8) {
+        return tsdb_start_block(db, series, ts, value);
+    }
+    int64_t delta = ts - b->last_ts;
+    tsdb_put_varbits(b, delta - b->last_delta, tsdb_dod_bits);
+    tsdb_put_varbits(b, value - b->last_value, tsdb_value_bits);
+    b->last_delta = delta;
+    b->last_ts = ts;
+    b->last_value = value;
+    b->min = value < b->min ? value : b->min;
+    b->max = value > b->max ? value : b->max;
+    // the bits are in before the sample is counted
+    __atomic_store_n(&b->count, b->count + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// reads a block's samples back, oldest first
+typedef struct tsdb_cursor {
+    const tsdb_block_t *b;
+    uint32_t count;  // samples in the block when the cursor started
+    uint32_t read;
+    uint32_t at;     // next bit
+    int64_t ts;
+    int64_t value;
+    int64_t delta;
+} tsdb_cursor_t;
+
+static uint64_t tsdb_get_bits(tsdb_cursor_t *c, int n) {
+    uint64_t v = 0;
+    while (n > 0) {
+        int room = 8 - (c->at & 7);
+        int take = n < room ? n : room;
+        uint8_t byte = c->b->data[c->at >> 3];
+        v = (v << take) | ((byte >> (room - take)) & ((1u << take) - 1));
+        c->at += take;
+        n -= take;
+    }
+    return v;
+}
+
+static int64_t tsdb_get_varbits(tsdb_cursor_t *c, const int widths[4]) {
+    int k = 0;
+    while (k < 4 && tsdb_get_bits(c, 1) == 1) {
+        k++;
+    }
+    return k == 0 ? 0 : tsdb_unzigzag(tsdb_get_bits(c, widths[k - 1]));
+}
+
+void tsdb_cursor(tsdb_cursor_t *c, const tsdb_block_t *b) {
+    memset(c, 0, sizeof(tsdb_cursor_t));
+    c->b = b;
+    c->count = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+}
+
+// Read the next sample.
+// pre: tsdb_cursor(c, b)
+// post: (return == false AND every sample counted when the cursor started
+//       has been read) OR *ts and *value are the next sample
+bool tsdb_next(tsdb_cursor_t *c, int64_t *ts, int64_t *value) {
+    if (c->read == c->count) {
+        return false;
+    }
+    if (c->read == 0) {
+        c->ts = c->b->first_ts;
+        c->value = c->b->first_value;
+    } else {
+        c->delta += tsdb_get_varbits(c, tsdb_dod_bits);
+        c->ts += c->delta;
+        c->value += tsdb_get_varbits(c, tsdb_value_bits);
+    }
+    c->read++;
+    *ts = c->ts;
+    *value = c->value;
+    return true;
+}
+
+// bytes of the file in use
+static inline uint64_t tsdb_bytes(const tsdb_t *db) {
+    return tsdb_blocks(db) * TSDB_BLOCK;
+}
+/* ----------History store --------------*/
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef WHITELIST_C
+#define WHITELIST_C
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* ----------Whitelist segment --------------*/
+// The plates allowed into the car park, parsed from plates.txt once per host
+// into a shared segment that every process maps read only.
+//
+// The segment holds a header, the plates (each 6 characters and a NUL,
+// padded to 8 bytes) and an open addressing index of plate number + 1, 0 for
+// an empty slot, probed linearly. Everything is found by its offset from the
+// header, never by a pointer, so the segment means the same wherever it is
+// mapped. A plate's number is its position in the list, 0 to count - 1.
+//
+// The first process to need the segment builds it; one that finds it being
+// built waits for the header's magic to be set. The segment remembers the
+// size and modification time of the file it came from and is rebuilt when
+// the file changes. Processes that already had the old one mapped keep it.
+
+#define WHITELIST_NAME "PARKING_WHITELIST"
+#define WHITELIST_MAGIC 0x57484c31  // "WHL1", set last, once the index is complete
+#define WHITELIST_PLATE 8           // bytes per plate in the segment
+#define WHITELIST_WAIT_MS 5000      // how long to wait for another process to build it
+
+typedef struct whitelist {
+    uint32_t magic;
+    uint32_t count;        // plates
+    uint32_t slots;        // index slots, a power of two at least twice count
+    uint32_t reserved;
+    int64_t src_size;      // plates.txt the segment was built from
+    int64_t src_mtime_ns;
+    uint64_t plates_off;   // char[count][WHITELIST_PLATE]
+    uint64_t index_off;    // uint32_t[slots]
+    uint64_t size;         // of the whole segment
+} whitelist_t;
+
+// the plate with number id, NUL terminated
+static inline const char *whitelist_plate(const whitelist_t *w, uint32_t id) {
+    return (const char *)w + w->plates_off + (size_t)id * WHITELIST_PLATE;
+}
+
+static inline const uint32_t *whitelist_index(const whitelist_t *w) {
+    return (const uint32_t *)((const char *)w + w->index_off);
+}
+
+// first slot to probe for a plate
+static inline uint32_t whitelist_slot(const char plate[6], uint32_t slots) {
+    uint64_t key = 0;
+    memcpy(&key, plate, 6);
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (slots - 1);
+}
+
+// Look a plate up.
+// pre: plate is 6 characters, NUL terminated or not
+// post: (return == -1 AND plate is not on the whitelist)
+//       OR memcmp(whitelist_plate(w, return), plate, 6) == 0
+static inline int whitelist_find(const whitelist_t *w, const char plate[6]) {
+    const uint32_t *index = whitelist_index(w);
+    for (uint32_t s = whitelist_slot(plate, w->slots);; s = (s + 1) & (w->slots - 1)) {
+        uint32_t id = index[s];
+        if (id == 0) {
+            return -1;
+        }
+        if (memcmp(whitelist_plate(w, id - 1), plate, 6) == 0) {
+            return id - 1;
+        }
+    }
+}
+
+static inline int64_t whitelist_mtime_ns(const struct stat *src) {
+    return (int64_t)src->st_mtim.tv_sec * 1000000000LL + src->st_mtim.tv_nsec;
+}
+
+// read the plates from path into a private array
+static char *whitelist_read(const char *path, uint32_t *count) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+    size_t cap = 1024;
+    char *plates = malloc(cap * WHITELIST_PLATE);
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    *count = 0;
+    while (plates != NULL && (len = getline(&line, &line_cap, f)) >= 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strlen(line) != 6) {
+            continue;  // blank or not a plate
+        }
+        if (*count == cap) {
+            cap *= 2;
+            char *grown = realloc(plates, cap * WHITELIST_PLATE);
+            if (grown == NULL) {
+                free(plates);
+                plates = NULL;
+                break;
+            }
+            plates = grown;
+        }
+        memset(plates + (size_t)*count * WHITELIST_PLATE, 0, WHITELIST_PLATE);
+        memcpy(plates + (size_t)*count * WHITELIST_PLATE, line, 6);
+        (*count)++;
+    }
+    free(line);
+    fclose(f);
+    if (plates == NULL) {
+        fprintf(stderr, "%s: out of memory\n", path);
+    }
+    return plates;
+}
+
+// Build the segment from path, unless another process has started to.
+// pre: src is the stat of path
+// post: (return == false AND the segment could not be built)
+//       OR the segment exists, complete or being built by someone else
+static bool whitelist_build(const char *path, const struct stat *src) {
+    int fd = shm_open(WHITELIST_NAME, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        if (errno == EEXIST) {
+            return true;
+        }
+        perror(WHITELIST_NAME);
+        return false;
+    }
+    // a header with no magic tells other processes to wait while the file is read
+    if (ftruncate(fd, sizeof(whitelist_t)) != 0) {
+        perror(WHITELIST_NAME);
+        close(fd);
+        shm_unlink(WHITELIST_NAME);
+        return false;
+    }
+
+    uint32_t n;
+    char *plates = whitelist_read(path, &n);
+    uint32_t slots = 16;
+    while (slots < 2 * (uint64_t)n) {
+        slots *= 2;
+    }
+    uint64_t plates_off = (sizeof(whitelist_t) + 63) & ~63ULL;
+    uint64_t index_off = (plates_off + (uint64_t)n * WHITELIST_PLATE + 63) & ~63ULL;
+    uint64_t size = index_off + (uint64_t)slots * sizeof(uint32_t);
+
+    whitelist_t *w = MAP_FAILED;
+    if (plates != NULL && ftruncate(fd, size) == 0) {
+        w = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (w == MAP_FAILED) {
+        if (plates != NULL) {
+            perror(WHITELIST_NAME);
+        }
+        free(plates);
+        shm_unlink(WHITELIST_NAME);  // so the next process tries again
+        return false;
+    }
+
+    // the segment starts zeroed, so every slot is empty
+    w->slots = slots;
+    w->src_size = src->st_size;
+    w->src_mtime_ns = whitelist_mtime_ns(src);
+    w->plates_off = plates_off;
+    w->index_off = index_off;
+    w->size = size;
+    uint32_t *index = (uint32_t *)((char *)w + index_off);
+    for (uint32_t i = 0; i < n; i++) {
+        const char *plate = plates + (size_t)i * WHITELIST_PLATE;
+        if (whitelist_find(w, plate) >= 0) {
+            continue;  // listed twice
+        }
+        memcpy((char *)w + plates_off + (size_t)w->count * WHITELIST_PLATE, plate, WHITELIST_PLATE);
+        uint32_t s = whitelist_slot(plate, slots);
+        while (index[s] != 0) {
+            s = (s + 1) & (slots - 1);
+        }
+        index[s] = ++w->count;
+    }
+    free(plates);
+
+    __atomic_store_n(&w->magic, WHITELIST_MAGIC, __ATOMIC_RELEASE);
+    munmap(w, size);
+    return true;
+}
+
+// Map the segment read only, whatever state it is in.
+// pre: true
+// post: (return == NULL AND there is no segment, or only the start of one)
+//       OR (return points at the segment's header AND *size bytes are mapped)
+static whitelist_t *whitelist_map(size_t *size) {
+    int fd = shm_open(WHITELIST_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    whitelist_t *w = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(whitelist_t)) {
+        w = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        *size = st.st_size;
+    }
+    close(fd);
+    return w == MAP_FAILED ? NULL : w;
+}
+
+// Map the whitelist built from path, building it first if need be.
+// pre: true
+// post: (return == NULL AND the whitelist could not be built or mapped)
+//       OR return points at the complete whitelist, read only
+whitelist_t *whitelist_open(const char *path) {
+    struct stat src;
+    if (stat(path, &src) != 0) {
+        perror(path);
+        return NULL;
+    }
+    for (int waited = 0; waited < WHITELIST_WAIT_MS;) {
+        size_t size;
+        whitelist_t *w = whitelist_map(&size);
+        if (w == NULL) {
+            if (!whitelist_build(path, &src)) {
+                return NULL;
+            }
+        } else if (__atomic_load_n(&w->magic, __ATOMIC_ACQUIRE) != WHITELIST_MAGIC) {
+            // another process is building it
+            munmap(w, size);
+            usleep(1000);
+            waited++;
+        } else if (w->src_size != src.st_size || w->src_mtime_ns != whitelist_mtime_ns(&src)) {
+            // plates.txt has changed since, build a new one
+            munmap(w, size);
+            shm_unlink(WHITELIST_NAME);
+        } else {
+            return w;
+        }
+    }
+    fprintf(stderr, "%s: still not built after %d ms, remove it with ./parkplates -u\n", WHITELIST_NAME, WHITELIST_WAIT_MS);
+    return NULL;
+}
+/* ----------Whitelist segment --------------*/
+
+#endif